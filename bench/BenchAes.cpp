@@ -0,0 +1,82 @@
+﻿#include "BenchHarness.h"
+#include <cstdio>
+
+// AES-128的吞吐量：不含LZ4和base64，只有加密和解密本身。
+// 先用NIST SP 800-38A和GCM论文的测试向量检查实现，结果不对时不计时
+using namespace RemoteSaveBench;
+
+// PF_GCM的头：魔数 | flags | nonce[12] | 明文长度，见README
+static const size_t GcmHeaderSize = 20;
+
+static void BenchEncrypt(Session &session, RemoteSaveSession::PayloadFormat format, const char *name)
+{
+	for (auto size : PayloadSizes())
+	{
+		size_t offset = format != RemoteSaveSession::PF_CBC ? GcmHeaderSize : 0;
+		auto plain = std::string(offset, '\0') + MakeSaveJson(size);
+		std::string buffer;
+		buffer.reserve(plain.size() + 32);
+		Run(std::string("encrypt/") + name + "/" + FormatSize(size), size, [&session, &plain, &buffer, offset, format]()
+		{
+			buffer.assign(plain);
+			session.encryptBuffer(buffer, offset, format);
+		});
+	}
+}
+
+// PF_CBC没有单独的解密入口，这里的decode()包含base64解码
+static void BenchCbcDecrypt(Session &session)
+{
+	for (auto size : PayloadSizes())
+	{
+		std::string encoded;
+		session.encode(MakeSaveJson(size), encoded, RemoteSaveSession::PF_CBC);
+
+		std::string scratch, plain;
+		size_t offset = 0;
+		Run("decode/cbc/" + FormatSize(size), size, [&session, &encoded, &scratch, &plain, &offset]()
+		{
+			session.decode(encoded.data(), encoded.size(), scratch, plain, offset);
+		});
+	}
+}
+
+static void BenchGcmDecrypt(Session &session)
+{
+	for (auto size : PayloadSizes())
+	{
+		std::string buffer = std::string(GcmHeaderSize, '\0') + MakeSaveJson(size);
+		session.encryptBuffer(buffer, GcmHeaderSize, RemoteSaveSession::PF_GCM);
+
+		std::string plain;
+		Run("decrypt/gcm/" + FormatSize(size), size, [&session, &buffer, &plain]()
+		{
+			if (!session.decryptBuffer((const unsigned char*)buffer.data(), buffer.size(), plain))
+			{
+				fprintf(stderr, "decrypt failed\n");
+				exit(1);
+			}
+		});
+	}
+}
+
+int main(int argc, char **argv)
+{
+	ParseOptions(argc, argv);
+	if (!Session::selfTest())
+	{
+		fprintf(stderr, "AES self test failed\n");
+		return 1;
+	}
+
+	LoopbackServer server;
+	Session session;
+	session.initForBench(server.transport());
+
+	PrintHeader("AES-128 (in place, no LZ4 or base64)");
+	BenchEncrypt(session, RemoteSaveSession::PF_CBC, "cbc");
+	BenchEncrypt(session, RemoteSaveSession::PF_GCM, "gcm");
+	BenchGcmDecrypt(session);
+	BenchCbcDecrypt(session);
+	return 0;
+}
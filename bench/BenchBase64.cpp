@@ -0,0 +1,103 @@
+﻿#include "BenchHarness.h"
+#include <cstdio>
+
+// 内置的base64和cocos2d::base64Encode/base64Decode对比，1KB、64KB、1MB的随机数据。
+// cocos2d的函数每次调用malloc一次输出，内置的写入重复使用的std::string
+using namespace RemoteSaveBench;
+
+static std::vector<size_t> Sizes()
+{
+	std::vector<size_t> sizes = { 1024, 64 * 1024 };
+	if (!GetOptions().quick)
+	{
+		sizes.push_back(1024 * 1024);
+	}
+	return sizes;
+}
+
+static std::string RandomBytes(size_t size)
+{
+	std::string bytes(size, '\0');
+	unsigned int seed = 12345;
+	for (auto &c : bytes)
+	{
+		seed = seed * 1103515245 + 12345;
+		c = (char)(seed >> 16);
+	}
+	return bytes;
+}
+
+static void BenchCodec()
+{
+	PrintHeader("base64 (in-tree vs cocos2d)");
+	for (auto size : Sizes())
+	{
+		auto bytes = RandomBytes(size);
+		auto data = (const unsigned char*)bytes.data();
+		auto name = FormatSize(size);
+
+		std::string encoded;
+		Run("encode/in-tree/" + name, size, [data, size, &encoded]()
+		{
+			Session::base64Encode(data, size, encoded);
+		});
+		Run("encode/cocos2d/" + name, size, [data, size]()
+		{
+			char *out = nullptr;
+			cocos2d::base64Encode(data, (unsigned int)size, &out);
+			free(out);
+		});
+
+		std::string decoded;
+		Run("decode/in-tree/" + name, size, [&encoded, &decoded]()
+		{
+			Session::base64Decode(encoded.data(), encoded.size(), decoded);
+		});
+		Run("decode/cocos2d/" + name, size, [&encoded]()
+		{
+			unsigned char *out = nullptr;
+			cocos2d::base64Decode((const unsigned char*)encoded.data(), (unsigned int)encoded.size(), &out);
+			free(out);
+		});
+	}
+}
+
+// getDataForKey()/setDataForKey()每次访问都要base64编码或解码
+static void BenchDataForKey()
+{
+	PrintHeader("getDataForKey/setDataForKey");
+	LoopbackServer server;
+	Session session;
+	session.initForBench(server.transport());
+	if (session.loadAndWait() != RemoteSaveSession::EC_OK)
+	{
+		fprintf(stderr, "load failed\n");
+		exit(1);
+	}
+
+	for (auto size : Sizes())
+	{
+		auto bytes = RandomBytes(size);
+		cocos2d::Data value;
+		value.copy((const unsigned char*)bytes.data(), bytes.size());
+		auto key = "data." + FormatSize(size);
+		auto name = FormatSize(size);
+
+		Run("setDataForKey/" + name, size, [&session, &key, &value]()
+		{
+			session.setDataForKey(key.c_str(), value);
+		});
+		Run("getDataForKey/" + name, size, [&session, &key]()
+		{
+			session.getDataForKey(key.c_str());
+		});
+	}
+}
+
+int main(int argc, char **argv)
+{
+	ParseOptions(argc, argv);
+	BenchCodec();
+	BenchDataForKey();
+	return 0;
+}
@@ -0,0 +1,133 @@
+﻿#include "BenchHarness.h"
+#include <cstdio>
+
+// 加密前的LZ4压缩：PF_GCM和PF_GCM_LZ4的save_data大小，以及编码、解码和完整保存的耗时。
+// 除了MakeSaveJson()，还用一份模仿游戏存档的JSON（关卡、背包、成就，键名前缀大量重复）
+using namespace RemoteSaveBench;
+
+// 大约bytes字节的游戏存档JSON
+static std::string MakeGameJson(size_t bytes)
+{
+	static const char *const Items[] = { "sword", "shield", "potion", "arrow", "gem", "scroll" };
+	std::string json = "{";
+	char member[128];
+	for (size_t i = 0; json.size() < bytes; ++i)
+	{
+		switch (i % 4)
+		{
+		case 0:
+			snprintf(member, sizeof(member), "\"level.%04zu.stars\":%zu,\"level.%04zu.best_time\":%.2f,", i / 4, i % 3 + 1, i / 4, 30. + i % 97 * 0.37);
+			break;
+		case 1:
+			snprintf(member, sizeof(member), "\"inventory.%s_%02zu.count\":%zu,", Items[i % 6], i / 4 % 100, i * 7 % 1000);
+			break;
+		case 2:
+			snprintf(member, sizeof(member), "\"achievement.%04zu.unlocked\":%s,", i / 4, i % 5 ? "true" : "false");
+			break;
+		default:
+			snprintf(member, sizeof(member), "\"quest.%04zu.state\":\"%s\",", i / 4, i % 3 ? "completed" : "in_progress");
+			break;
+		}
+		json += member;
+	}
+	json.back() = '}';
+	return json;
+}
+
+struct JsonSource
+{
+	const char *name;
+	std::string (*make)(size_t bytes);
+};
+
+static std::string MakeBenchJson(size_t bytes)
+{
+	return MakeSaveJson(bytes);
+}
+
+static const JsonSource Sources[] =
+{
+	{ "game", MakeGameJson },
+	{ "generic", MakeBenchJson },
+};
+
+static void PrintRatios(Session &session)
+{
+	printf("\n%-24s %12s %14s %14s %8s\n", "save_data size", "json", "gcm", "gcm_lz4", "ratio");
+	for (auto &source : Sources)
+	{
+		for (auto size : PayloadSizes())
+		{
+			auto json = source.make(size);
+			std::string gcm, lz4;
+			session.encode(json, gcm, RemoteSaveSession::PF_GCM);
+			session.encode(json, lz4, RemoteSaveSession::PF_GCM_LZ4);
+			auto name = std::string(source.name) + "/" + FormatSize(size);
+			printf("%-24s %12zu %14zu %14zu %7.1f%%\n", name.c_str(), json.size(), gcm.size(), lz4.size(), 100. * lz4.size() / gcm.size());
+		}
+	}
+	fflush(stdout);
+}
+
+static void BenchLatency(const std::shared_ptr<RemoteSaveSession::Context> &context)
+{
+	const RemoteSaveSession::PayloadFormat formats[] = { RemoteSaveSession::PF_GCM, RemoteSaveSession::PF_GCM_LZ4 };
+	PrintHeader("encode, decode and save (callback to callback), gcm vs gcm_lz4");
+	for (auto &source : Sources)
+	{
+		for (auto size : PayloadSizes())
+		{
+			auto json = source.make(size);
+			for (auto format : formats)
+			{
+				LoopbackServer server;
+				Session session(context);
+				session.setPayloadFormat(format);
+				session.initForBench(server.transport());
+				session.loadJson(server, json, format);
+
+				auto name = std::string(format == RemoteSaveSession::PF_GCM ? "gcm/" : "gcm_lz4/") + source.name + "/" + FormatSize(size);
+				std::string encoded;
+				Run("encode/" + name, size, [&session, &json, &encoded, format]()
+				{
+					session.encode(json, encoded, format);
+				});
+
+				std::string scratch, plain;
+				size_t offset = 0;
+				Run("decode/" + name, size, [&session, &encoded, &scratch, &plain, &offset]()
+				{
+					if (!session.decode(encoded.data(), encoded.size(), scratch, plain, offset))
+					{
+						fprintf(stderr, "decode failed\n");
+						exit(1);
+					}
+				});
+
+				int value = 0;
+				Run("save/" + name, size, [&session, &value]()
+				{
+					session.setIntegerForKey("bench.counter", ++value);
+					if (session.saveAndWait() != RemoteSaveSession::EC_OK)
+					{
+						fprintf(stderr, "save failed\n");
+						exit(1);
+					}
+				});
+			}
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	ParseOptions(argc, argv);
+
+	auto context = std::make_shared<RemoteSaveSession::Context>();
+	LoopbackServer server;
+	Session session(context);
+	session.initForBench(server.transport());
+	PrintRatios(session);
+	BenchLatency(context);
+	return 0;
+}
@@ -0,0 +1,76 @@
+﻿#include "BenchHarness.h"
+#include <cstdio>
+
+// POST数据的application/x-www-form-urlencoded编码，save_data是500KB的base64。
+// 旧的formatPostData()放在这里作对照：只转义'+'，用substr和+=拼接
+using namespace RemoteSaveBench;
+
+static const size_t PayloadSize = 500 * 1024;
+
+static void OldFormatPostData(const std::string &dataIn, std::string &dataOut)
+{
+	std::string c = "+";
+	std::string t = "%2B";
+	std::string::size_type pos1, pos2;
+	pos1 = 0;
+	pos2 = dataIn.find('+');
+
+	while (std::string::npos != pos2)
+	{
+		dataOut += dataIn.substr(pos1, pos2 - pos1);
+		dataOut += t;
+
+		pos1 = pos2 + c.size();
+		pos2 = dataIn.find(c, pos1);
+	}
+
+	if (pos1 != dataIn.length())
+	{
+		dataOut += dataIn.substr(pos1);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	ParseOptions(argc, argv);
+
+	// 和真实存档一样先加密再base64，得到均匀分布的'+'、'/'和'='
+	LoopbackServer server;
+	Session session;
+	session.initForBench(server.transport());
+	std::string saveData;
+	session.encode(MakeSaveJson(PayloadSize / 4 * 3), saveData, RemoteSaveSession::PF_GCM);
+	std::string binary;
+	Session::base64Decode(saveData.data(), saveData.size(), binary);
+	auto size = saveData.size();
+	auto name = FormatSize(PayloadSize);
+
+	PrintHeader("form encoding of save_data");
+	std::string body;
+	Run("formatPostData (old, '+' only)/" + name, size, [&saveData, &body]()
+	{
+		std::string dataIn = "user_id=bench-user&sn=1&version=1&save_data=" + saveData;
+		body.clear();
+		OldFormatPostData(dataIn, body);
+	});
+	Run("appendPostData/" + name, size, [&saveData, &body]()
+	{
+		body.clear();
+		Session::appendPostData(body, saveData.data(), saveData.size());
+	});
+	Run("appendPostDataBase64/" + name, size, [&binary, &body]()
+	{
+		body.clear();
+		Session::appendPostDataBase64(body, (const unsigned char*)binary.data(), binary.size());
+	});
+	// 保存请求的整个POST数据，按字段直接写入
+	Run("save body by fields/" + name, size, [&binary, &body]()
+	{
+		body.clear();
+		body += "user_id=";
+		Session::appendPostData(body, "bench-user", 10);
+		body += "&sn=1&version=1&save_data=";
+		Session::appendPostDataBase64(body, (const unsigned char*)binary.data(), binary.size());
+	});
+	return 0;
+}
@@ -0,0 +1,503 @@
+﻿#include "BenchHarness.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Heap allocations are counted by wrapping glibc's malloc family, which also
+// sees operator new and the engine-style malloc'ed buffers (Data, base64).
+#if defined(__GLIBC__)
+#define REMOTESAVE_BENCH_COUNT_ALLOCS 1
+
+static std::atomic<unsigned long long> s_allocCount(0);
+static std::atomic<unsigned long long> s_allocBytes(0);
+
+extern "C"
+{
+	void *__libc_malloc(size_t size);
+	void *__libc_calloc(size_t count, size_t size);
+	void *__libc_realloc(void *ptr, size_t size);
+	void __libc_free(void *ptr);
+
+	void *malloc(size_t size) noexcept
+	{
+		s_allocCount.fetch_add(1, std::memory_order_relaxed);
+		s_allocBytes.fetch_add(size, std::memory_order_relaxed);
+		return __libc_malloc(size);
+	}
+
+	void *calloc(size_t count, size_t size) noexcept
+	{
+		s_allocCount.fetch_add(1, std::memory_order_relaxed);
+		s_allocBytes.fetch_add(count * size, std::memory_order_relaxed);
+		return __libc_calloc(count, size);
+	}
+
+	void *realloc(void *ptr, size_t size) noexcept
+	{
+		s_allocCount.fetch_add(1, std::memory_order_relaxed);
+		s_allocBytes.fetch_add(size, std::memory_order_relaxed);
+		return __libc_realloc(ptr, size);
+	}
+
+	void free(void *ptr) noexcept
+	{
+		__libc_free(ptr);
+	}
+}
+#else
+#define REMOTESAVE_BENCH_COUNT_ALLOCS 0
+#endif
+
+namespace RemoteSaveBench
+{
+	const char *const UrlLoad = "http://loopback/load";
+	const char *const UrlSave = "http://loopback/save";
+
+	static Options s_options;
+
+	Options ParseOptions(int argc, char **argv)
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			if (strcmp(argv[i], "--quick") == 0)
+			{
+				s_options.quick = true;
+				s_options.minSeconds = 0.01;
+			}
+			else if (strncmp(argv[i], "--filter=", 9) == 0)
+			{
+				s_options.filter = argv[i] + 9;
+			}
+			else if (strncmp(argv[i], "--min-time=", 11) == 0)
+			{
+				s_options.minSeconds = atof(argv[i] + 11);
+			}
+			else
+			{
+				fprintf(stderr, "usage: %s [--quick] [--filter=name] [--min-time=seconds]\n", argv[0]);
+				exit(2);
+			}
+		}
+
+		// Timed runs should not include the library's status lines
+		cocos2d::standin::setLogEnabled(false);
+		return s_options;
+	}
+
+	const Options &GetOptions()
+	{
+		return s_options;
+	}
+
+	unsigned long long AllocCount()
+	{
+#if REMOTESAVE_BENCH_COUNT_ALLOCS
+		return s_allocCount.load(std::memory_order_relaxed);
+#else
+		return 0;
+#endif
+	}
+
+	unsigned long long AllocBytes()
+	{
+#if REMOTESAVE_BENCH_COUNT_ALLOCS
+		return s_allocBytes.load(std::memory_order_relaxed);
+#else
+		return 0;
+#endif
+	}
+
+	CacheMissCounter::CacheMissCounter()
+		: m_fd(-1)
+	{
+#if defined(__linux__)
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		// User space only, so it works with the default perf_event_paranoid of 2;
+		// inherit counts the worker pool threads created later
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.inherit = 1;
+		m_fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+	}
+
+	CacheMissCounter::~CacheMissCounter()
+	{
+#if defined(__linux__)
+		if (m_fd >= 0)
+		{
+			close(m_fd);
+		}
+#endif
+	}
+
+	long long CacheMissCounter::Read() const
+	{
+#if defined(__linux__)
+		long long value = 0;
+		if (m_fd >= 0 && read(m_fd, &value, sizeof(value)) == sizeof(value))
+		{
+			return value;
+		}
+#endif
+		return -1;
+	}
+
+	static double SecondsSince(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	bool Measure(const std::string &name, size_t bytesPerOp, const std::function<void()> &op, Sample &sample)
+	{
+		(void)bytesPerOp;
+		if (!s_options.filter.empty() && name.find(s_options.filter) == std::string::npos)
+		{
+			return false;
+		}
+
+		static CacheMissCounter missCounter;
+		op();
+
+		// Batches double until the time is reached, so reading the clock costs
+		// nothing next to nanosecond operations
+		unsigned long long iterations = 0;
+		unsigned long long batch = 1;
+		auto allocs = AllocCount();
+		auto allocBytes = AllocBytes();
+		auto misses = missCounter.Read();
+		auto start = std::chrono::steady_clock::now();
+		double seconds = 0.;
+		for (;;)
+		{
+			for (unsigned long long i = 0; i < batch; ++i)
+			{
+				op();
+			}
+			iterations += batch;
+			seconds = SecondsSince(start);
+			if (seconds >= s_options.minSeconds)
+			{
+				break;
+			}
+			batch *= 2;
+		}
+		auto missesEnd = missCounter.Read();
+
+		sample.iterations = iterations;
+		sample.nanos = seconds * 1e9 / iterations;
+		sample.allocs = REMOTESAVE_BENCH_COUNT_ALLOCS ? (double)(AllocCount() - allocs) / iterations : -1.;
+		sample.allocBytes = REMOTESAVE_BENCH_COUNT_ALLOCS ? (double)(AllocBytes() - allocBytes) / iterations : -1.;
+		sample.cacheMisses = misses >= 0 && missesEnd >= 0 ? (double)(missesEnd - misses) / iterations : -1.;
+		return true;
+	}
+
+	void Run(const std::string &name, size_t bytesPerOp, const std::function<void()> &op)
+	{
+		Sample sample;
+		if (Measure(name, bytesPerOp, op, sample))
+		{
+			PrintSample(name, bytesPerOp, sample);
+		}
+	}
+
+	void PrintHeader(const std::string &section)
+	{
+		printf("\n%s\n", section.c_str());
+		printf("%-44s %12s %10s %11s %12s %11s\n", "name", "time/op", "MB/s", "allocs/op", "alloc B/op", "misses/op");
+		fflush(stdout);
+	}
+
+	static std::string FormatNanos(double nanos)
+	{
+		char text[32];
+		if (nanos < 1e3)
+		{
+			snprintf(text, sizeof(text), "%.1f ns", nanos);
+		}
+		else if (nanos < 1e6)
+		{
+			snprintf(text, sizeof(text), "%.2f us", nanos / 1e3);
+		}
+		else
+		{
+			snprintf(text, sizeof(text), "%.2f ms", nanos / 1e6);
+		}
+		return text;
+	}
+
+	static std::string FormatCount(double value, const char *format)
+	{
+		if (value < 0.)
+		{
+			return "n/a";
+		}
+
+		char text[32];
+		snprintf(text, sizeof(text), format, value);
+		return text;
+	}
+
+	void PrintSample(const std::string &name, size_t bytesPerOp, const Sample &sample)
+	{
+		std::string throughput = bytesPerOp ? FormatCount(bytesPerOp / sample.nanos * 1e9 / (1024. * 1024.), "%.1f") : "";
+		printf("%-44s %12s %10s %11s %12s %11s\n", name.c_str(), FormatNanos(sample.nanos).c_str(), throughput.c_str(),
+			   FormatCount(sample.allocs, "%.1f").c_str(), FormatCount(sample.allocBytes, "%.0f").c_str(),
+			   FormatCount(sample.cacheMisses, "%.1f").c_str());
+		fflush(stdout);
+	}
+
+	std::vector<size_t> PayloadSizes()
+	{
+		std::vector<size_t> sizes = { 1024, 10 * 1024, 100 * 1024 };
+		if (!s_options.quick)
+		{
+			sizes.push_back(1024 * 1024);
+			sizes.push_back(10 * 1024 * 1024);
+		}
+		return sizes;
+	}
+
+	std::string FormatSize(size_t bytes)
+	{
+		char text[32];
+		if (bytes >= 1024 * 1024 && bytes % (1024 * 1024) == 0)
+		{
+			snprintf(text, sizeof(text), "%zuMB", bytes / (1024 * 1024));
+		}
+		else if (bytes >= 1024 && bytes % 1024 == 0)
+		{
+			snprintf(text, sizeof(text), "%zuKB", bytes / 1024);
+		}
+		else
+		{
+			snprintf(text, sizeof(text), "%zuB", bytes);
+		}
+		return text;
+	}
+
+	std::string KeyName(size_t i)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "key.%06zu", i);
+		return name;
+	}
+
+	std::string MakeSaveJson(size_t bytes, size_t keys /* = 0 */)
+	{
+		// Game-like values: counters and short strings from a small vocabulary,
+		// so LZ4 sees about the redundancy a real save has
+		static const char *const words[] =
+		{
+			"sword", "shield", "potion", "gold", "dragon", "castle", "forest", "level",
+			"quest", "armor", "ring", "scroll", "knight", "archer", "mage", "tower",
+		};
+		uint32_t random = 2463534242u;
+		std::string json = "{";
+		for (size_t i = 0; keys ? i < keys : json.size() + 2 < bytes; ++i)
+		{
+			if (i)
+			{
+				json += ',';
+			}
+			json += '"';
+			json += KeyName(i);
+			json += "\":";
+
+			random ^= random << 13;
+			random ^= random >> 17;
+			random ^= random << 5;
+			if (i % 2 == 0)
+			{
+				json += std::to_string(random % 100000);
+			}
+			else
+			{
+				json += '"';
+				json += words[random % 16];
+				json += '_';
+				json += words[(random >> 4) % 16];
+				json += '_';
+				json += std::to_string((random >> 8) % 1000);
+				json += '"';
+			}
+		}
+		json += '}';
+		return json;
+	}
+
+	void RunFramesUntil(const std::function<bool()> &done)
+	{
+		auto scheduler = cocos2d::Director::getInstance()->getScheduler();
+		auto start = std::chrono::steady_clock::now();
+		while (!done())
+		{
+			scheduler->update(1.f / 60.f);
+			if (done())
+			{
+				break;
+			}
+			std::this_thread::yield();
+			if (SecondsSince(start) > 60.)
+			{
+				fprintf(stderr, "timed out waiting for a callback\n");
+				exit(1);
+			}
+		}
+	}
+
+	LoopbackServer::LoopbackServer()
+		: m_sn(0)
+	{
+	}
+
+	std::shared_ptr<RemoteSaveTransport> LoopbackServer::transport()
+	{
+		return std::make_shared<RemoteSaveLoopbackTransport>(
+			[this](const RemoteSaveTransport::Request &request, RemoteSaveTransport::Response &response)
+		{
+			handle(request, response);
+		});
+	}
+
+	void LoopbackServer::setSave(unsigned long long sn, const std::string &saveData)
+	{
+		m_sn = sn;
+		m_saveData = saveData;
+	}
+
+	static int HexValue(char c)
+	{
+		if (c >= '0' && c <= '9')
+		{
+			return c - '0';
+		}
+		if (c >= 'a' && c <= 'f')
+		{
+			return c - 'a' + 10;
+		}
+		if (c >= 'A' && c <= 'F')
+		{
+			return c - 'A' + 10;
+		}
+		return -1;
+	}
+
+	std::string LoopbackServer::FormValue(const std::string &data, const char *name)
+	{
+		std::string value;
+		size_t nameLength = strlen(name);
+		size_t start = 0;
+		while (start <= data.size())
+		{
+			size_t end = data.find('&', start);
+			if (end == std::string::npos)
+			{
+				end = data.size();
+			}
+			if (end - start > nameLength && data.compare(start, nameLength, name) == 0 && data[start + nameLength] == '=')
+			{
+				for (size_t i = start + nameLength + 1; i < end; ++i)
+				{
+					if (data[i] == '+')
+					{
+						value += ' ';
+					}
+					else if (data[i] == '%' && i + 2 < end && HexValue(data[i + 1]) >= 0 && HexValue(data[i + 2]) >= 0)
+					{
+						value += (char)(HexValue(data[i + 1]) * 16 + HexValue(data[i + 2]));
+						i += 2;
+					}
+					else
+					{
+						value += data[i];
+					}
+				}
+				break;
+			}
+			start = end + 1;
+		}
+		return value;
+	}
+
+	void LoopbackServer::handle(const RemoteSaveTransport::Request &request, RemoteSaveTransport::Response &response)
+	{
+		// Background saves call this from the worker pool; the callback reaches
+		// the main thread through the scheduler's mutex, so no lock is needed here
+		std::string body;
+		if (request.url == UrlLoad)
+		{
+			body = m_sn ? "{\"sn\":" + std::to_string(m_sn) + ",\"save_data\":\"" + m_saveData + "\"}" : "NULL";
+		}
+		else
+		{
+			m_saveData = FormValue(request.data, "save_data");
+			m_sn = strtoull(FormValue(request.data, "sn").c_str(), nullptr, 10);
+			body = "Done";
+		}
+
+		response.statusCode = 200;
+		response.succeeded = true;
+		response.data.assign(body.begin(), body.end());
+	}
+
+	bool Session::initForBench(const std::shared_ptr<RemoteSaveTransport> &transport)
+	{
+		setTransport(transport);
+		setRetryPolicy(1);
+		return init("bench-user", "1", "1a2b3c4d5e6f7g8h", "#this_is_not_key", UrlLoad, UrlSave);
+	}
+
+	RemoteSaveSession::ErrorCode Session::loadAndWait()
+	{
+		bool done = false;
+		ErrorCode result = EC_OK;
+		setCallBackOnLoad([&done, &result](ErrorCode code, const std::string&)
+		{
+			result = code;
+			done = true;
+		});
+		load();
+		RunFramesUntil([&done]() { return done; });
+		return result;
+	}
+
+	RemoteSaveSession::ErrorCode Session::saveAndWait()
+	{
+		bool done = false;
+		ErrorCode result = EC_OK;
+		setCallBackOnSave([&done, &result](ErrorCode code, const std::string&)
+		{
+			result = code;
+			done = true;
+		});
+		save();
+		RunFramesUntil([&done]() { return done; });
+		return result;
+	}
+
+	void Session::loadJson(LoopbackServer &server, const std::string &json, PayloadFormat format /* = PF_CBC */)
+	{
+		std::string saveData;
+		encode(json, saveData, format);
+		server.setSave(1, saveData);
+		if (loadAndWait() != EC_OK)
+		{
+			fprintf(stderr, "load failed\n");
+			exit(1);
+		}
+	}
+}
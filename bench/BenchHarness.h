@@ -0,0 +1,137 @@
+﻿#ifndef __BenchHarness_H
+#define __BenchHarness_H
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "RemoteSave.h"
+
+// 基准测试共用的计时、计数和回环服务器。
+// 每项测量报告每次操作的耗时、吞吐量、堆分配次数和字节数（所有线程）、CPU缓存未命中（本进程，用户态）。
+// 缓存未命中来自perf_event_open，权限不够或虚拟机没有硬件计数器时显示n/a
+namespace RemoteSaveBench
+{
+	// 一项测量中平均每次操作的结果，不可用的计数为负数
+	struct Sample
+	{
+		unsigned long long iterations;
+		double nanos;
+		double allocs;
+		double allocBytes;
+		double cacheMisses;
+	};
+
+	// 命令行参数：--quick 只跑小规模的几项，用于确认能运行；--filter=xxx 只跑名字包含xxx的测量
+	struct Options
+	{
+		Options() : quick(false), minSeconds(0.3) {}
+
+		bool quick;
+		std::string filter;
+		// 每项至少运行的时间
+		double minSeconds;
+	};
+	Options ParseOptions(int argc, char **argv);
+	const Options &GetOptions();
+
+	// 进程启动以来的堆分配次数和字节数，所有线程的合计
+	unsigned long long AllocCount();
+	unsigned long long AllocBytes();
+
+	// 本进程的CPU缓存未命中计数，没有硬件计数器时Read()返回负数
+	class CacheMissCounter
+	{
+	public:
+		CacheMissCounter();
+		~CacheMissCounter();
+
+		bool available() const { return m_fd >= 0; }
+		long long Read() const;
+
+	private:
+		CacheMissCounter(const CacheMissCounter&);
+		CacheMissCounter &operator=(const CacheMissCounter&);
+
+		int m_fd;
+	};
+
+	// 重复调用op直到至少运行minSeconds，第一次调用不计入（预热）。
+	// 过滤掉时返回false，不调用op
+	bool Measure(const std::string &name, size_t bytesPerOp, const std::function<void()> &op, Sample &sample);
+	// Measure()并打印一行
+	void Run(const std::string &name, size_t bytesPerOp, const std::function<void()> &op);
+	// 打印表头，section是这一组测量的标题
+	void PrintHeader(const std::string &section);
+	void PrintSample(const std::string &name, size_t bytesPerOp, const Sample &sample);
+
+	// 1KB、10KB、100KB、1MB、10MB，--quick时只到100KB
+	std::vector<size_t> PayloadSizes();
+	// 例如"64KB"
+	std::string FormatSize(size_t bytes);
+
+	// 大约bytes字节、有keys个键的存档JSON，值是数字和字符串交替；keys为0时按大小决定
+	std::string MakeSaveJson(size_t bytes, size_t keys = 0);
+	// MakeSaveJson()中第i个键的键名
+	std::string KeyName(size_t i);
+
+	// 推进帧直到done()返回true，同时让线程池有机会运行
+	void RunFramesUntil(const std::function<bool()> &done);
+
+	// 进程内的存档服务器，协议同README：加载返回{"sn":N,"save_data":"..."}，保存返回Done。
+	// 不合并增量保存（带base_sn），基准测试都用完整保存
+	class LoopbackServer
+	{
+	public:
+		LoopbackServer();
+
+		// 传给RemoteSaveSession::setTransport()
+		std::shared_ptr<RemoteSaveTransport> transport();
+		// 直接设置服务器上的存档，saveData是已经加密和base64编码的save_data
+		void setSave(unsigned long long sn, const std::string &saveData);
+		const std::string &saveData() const { return m_saveData; }
+		unsigned long long sn() const { return m_sn; }
+
+		// 取出application/x-www-form-urlencoded数据中name的值并解码
+		static std::string FormValue(const std::string &data, const char *name);
+
+	private:
+		void handle(const RemoteSaveTransport::Request &request, RemoteSaveTransport::Response &response);
+
+		unsigned long long m_sn;
+		std::string m_saveData;
+	};
+
+	// 基准测试用的会话，公开要单独测量的内部步骤
+	class Session : public RemoteSaveSession
+	{
+	public:
+		explicit Session(const std::shared_ptr<Context> &context = nullptr) : RemoteSaveSession(context) {}
+
+		// 用测试的uid、密钥和LoopbackServer的URL初始化
+		bool initForBench(const std::shared_ptr<RemoteSaveTransport> &transport);
+		// load()并等到回调，返回回调的错误码
+		ErrorCode loadAndWait();
+		// save()并等到回调
+		ErrorCode saveAndWait();
+		// 把json加密后放到服务器上再加载，失败时退出
+		void loadJson(LoopbackServer &server, const std::string &json, PayloadFormat format = PF_CBC);
+
+		using RemoteSaveSession::encode;
+		using RemoteSaveSession::decode;
+		using RemoteSaveSession::saveToBuffer;
+		using RemoteSaveSession::encryptBuffer;
+		using RemoteSaveSession::decryptBuffer;
+		using RemoteSaveSession::selfTest;
+		using RemoteSaveSession::base64Encode;
+		using RemoteSaveSession::base64Decode;
+		using RemoteSaveSession::appendPostData;
+		using RemoteSaveSession::appendPostDataBase64;
+		const rapidjson::Value &document() const { return m_jsonDoc; }
+	};
+
+	// LoopbackServer使用的URL
+	extern const char *const UrlLoad;
+	extern const char *const UrlSave;
+}
+
+#endif // __BenchHarness_H
@@ -0,0 +1,105 @@
+﻿#include "BenchHarness.h"
+#include <cstdio>
+
+// 键值存储随键数（10到10万个）的变化：键名查找、句柄、修改已有的键、新增和删除键。
+// 以rapidjson的FindMember()作对照，即改成哈希索引之前每次读写的线性查找
+using namespace RemoteSaveBench;
+
+// 在keys中以固定步长跳着取，较大的存档中每次访问不同的键，不会总是命中缓存
+class Stride
+{
+public:
+	explicit Stride(size_t size) : m_size(size), m_next(0) {}
+
+	size_t next()
+	{
+		m_next = (m_next + 7919) % m_size;
+		return m_next;
+	}
+
+private:
+	size_t m_size;
+	size_t m_next;
+};
+
+static void BenchCount(const std::shared_ptr<RemoteSaveSession::Context> &context, size_t count)
+{
+	LoopbackServer server;
+	Session session(context);
+	session.initForBench(server.transport());
+	session.loadJson(server, MakeSaveJson(0, count));
+
+	// MakeSaveJson()中偶数键是整数，奇数键是字符串
+	std::vector<std::string> intKeys, stringKeys;
+	std::vector<RemoteSaveSession::KeyHandle> handles;
+	for (size_t i = 0; i < count; i += 2)
+	{
+		intKeys.push_back(KeyName(i));
+		handles.push_back(session.resolveKey(intKeys.back().c_str(), RemoteSaveSession::KT_INT));
+		if (i + 1 < count)
+		{
+			stringKeys.push_back(KeyName(i + 1));
+		}
+	}
+
+	auto suffix = "/" + std::to_string(count) + " keys";
+	Stride intStride(intKeys.size());
+	Stride stringStride(stringKeys.size() ? stringKeys.size() : 1);
+	int sum = 0;
+
+	Run("FindMember (linear baseline)" + suffix, 0, [&session, &intKeys, &intStride, &sum]()
+	{
+		auto &doc = session.document();
+		auto it = doc.FindMember(intKeys[intStride.next()].c_str());
+		sum += it != doc.MemberEnd() ? it->value.GetInt() : 0;
+	});
+	Run("getIntegerForKey(name)" + suffix, 0, [&session, &intKeys, &intStride, &sum]()
+	{
+		sum += session.getIntegerForKey(intKeys[intStride.next()].c_str());
+	});
+	Run("getIntegerForKey(handle)" + suffix, 0, [&session, &handles, &intStride, &sum]()
+	{
+		sum += session.getIntegerForKey(handles[intStride.next()]);
+	});
+	Run("setIntegerForKey(name)" + suffix, 0, [&session, &intKeys, &intStride, &sum]()
+	{
+		session.setIntegerForKey(intKeys[intStride.next()].c_str(), ++sum);
+	});
+	Run("setIntegerForKey(handle)" + suffix, 0, [&session, &handles, &intStride, &sum]()
+	{
+		session.setIntegerForKey(handles[intStride.next()], ++sum);
+	});
+	if (!stringKeys.empty())
+	{
+		std::string value = "value";
+		Run("setStringForKey(name)" + suffix, 0, [&session, &stringKeys, &stringStride, &value, &sum]()
+		{
+			value.back() = (char)('a' + ++sum % 26);
+			session.setStringForKey(stringKeys[stringStride.next()].c_str(), value);
+		});
+	}
+	Run("insert and delete a key" + suffix, 0, [&session, &sum]()
+	{
+		session.setIntegerForKey("bench.new", ++sum);
+		session.deleteValueForKey("bench.new");
+	});
+}
+
+int main(int argc, char **argv)
+{
+	ParseOptions(argc, argv);
+
+	std::vector<size_t> counts = { 10, 100, 1000, 10000, 100000 };
+	if (GetOptions().quick)
+	{
+		counts.resize(3);
+	}
+
+	auto context = std::make_shared<RemoteSaveSession::Context>();
+	PrintHeader("key store by key count");
+	for (auto count : counts)
+	{
+		BenchCount(context, count);
+	}
+	return 0;
+}
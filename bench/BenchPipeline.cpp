@@ -0,0 +1,170 @@
+﻿#include "BenchHarness.h"
+#include <cstdio>
+
+// 存档流水线的基准测试：
+// 按键数的读写、序列化、各加密格式的编码和解码、经过回环传输层的完整保存和加载
+using namespace RemoteSaveBench;
+
+static const RemoteSaveSession::PayloadFormat Formats[] =
+{
+	RemoteSaveSession::PF_CBC,
+	RemoteSaveSession::PF_GCM,
+	RemoteSaveSession::PF_GCM_LZ4,
+};
+
+static const char *FormatName(RemoteSaveSession::PayloadFormat format)
+{
+	switch (format)
+	{
+	case RemoteSaveSession::PF_CBC:
+		return "cbc";
+	case RemoteSaveSession::PF_GCM:
+		return "gcm";
+	default:
+		return "gcm_lz4";
+	}
+}
+
+static void BenchKeyCount(const std::shared_ptr<RemoteSaveSession::Context> &context)
+{
+	PrintHeader("get/set by key count");
+	std::vector<size_t> counts = { 10, 100, 1000, 10000, 100000 };
+	if (GetOptions().quick)
+	{
+		counts.resize(3);
+	}
+
+	for (auto count : counts)
+	{
+		LoopbackServer server;
+		Session session(context);
+		session.initForBench(server.transport());
+		session.loadJson(server, MakeSaveJson(0, count));
+
+		// Even keys hold integers; walk them in a stride that defeats the cache
+		// for the larger saves instead of hitting one key
+		std::vector<std::string> keys;
+		for (size_t i = 0; i < count; i += 2)
+		{
+			keys.push_back(KeyName(i));
+		}
+		size_t next = 0;
+		auto step = [&keys, &next]() -> const char*
+		{
+			next = (next + 7919) % keys.size();
+			return keys[next].c_str();
+		};
+
+		int sum = 0;
+		Run("getIntegerForKey/" + std::to_string(count) + " keys", 0, [&session, &step, &sum]()
+		{
+			sum += session.getIntegerForKey(step());
+		});
+		Run("setIntegerForKey/" + std::to_string(count) + " keys", 0, [&session, &step, &sum]()
+		{
+			session.setIntegerForKey(step(), ++sum);
+		});
+	}
+}
+
+static void BenchSaveToBuffer(const std::shared_ptr<RemoteSaveSession::Context> &context)
+{
+	PrintHeader("saveToBuffer (serialize the save JSON)");
+	for (auto size : PayloadSizes())
+	{
+		LoopbackServer server;
+		Session session(context);
+		session.initForBench(server.transport());
+		session.loadJson(server, MakeSaveJson(size));
+
+		std::string buffer;
+		Run("saveToBuffer/" + FormatSize(size), size, [&session, &buffer]()
+		{
+			Session::saveToBuffer(session.document(), buffer);
+		});
+	}
+}
+
+static void BenchEncodeDecode(const std::shared_ptr<RemoteSaveSession::Context> &context)
+{
+	PrintHeader("encode/decode (LZ4, AES and base64 of save_data)");
+	LoopbackServer server;
+	Session session(context);
+	session.initForBench(server.transport());
+	for (auto format : Formats)
+	{
+		for (auto size : PayloadSizes())
+		{
+			auto json = MakeSaveJson(size);
+			auto name = std::string(FormatName(format)) + "/" + FormatSize(size);
+
+			std::string encoded;
+			Run("encode/" + name, size, [&session, &json, &encoded, format]()
+			{
+				session.encode(json, encoded, format);
+			});
+
+			session.encode(json, encoded, format);
+			std::string scratch, plain;
+			size_t offset = 0;
+			Run("decode/" + name, size, [&session, &encoded, &scratch, &plain, &offset]()
+			{
+				if (!session.decode(encoded.data(), encoded.size(), scratch, plain, offset))
+				{
+					fprintf(stderr, "decode failed\n");
+					exit(1);
+				}
+			});
+		}
+	}
+}
+
+static void BenchRoundTrip(const std::shared_ptr<RemoteSaveSession::Context> &context)
+{
+	PrintHeader("round trip through the loopback transport (callback to callback)");
+	for (auto format : Formats)
+	{
+		for (auto size : PayloadSizes())
+		{
+			LoopbackServer server;
+			Session session(context);
+			session.setPayloadFormat(format);
+			session.initForBench(server.transport());
+			session.loadJson(server, MakeSaveJson(size), format);
+
+			auto name = std::string(FormatName(format)) + "/" + FormatSize(size);
+			int value = 0;
+			auto key = KeyName(0);
+			Run("save/" + name, size, [&session, &key, &value]()
+			{
+				session.setIntegerForKey(key.c_str(), ++value);
+				if (session.saveAndWait() != RemoteSaveSession::EC_OK)
+				{
+					fprintf(stderr, "save failed\n");
+					exit(1);
+				}
+			});
+			Run("load/" + name, size, [&session]()
+			{
+				if (session.loadAndWait() != RemoteSaveSession::EC_OK)
+				{
+					fprintf(stderr, "load failed\n");
+					exit(1);
+				}
+			});
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	ParseOptions(argc, argv);
+
+	// One context for all sessions, so the worker pool and key schedule are set up once
+	auto context = std::make_shared<RemoteSaveSession::Context>();
+	BenchKeyCount(context);
+	BenchSaveToBuffer(context);
+	BenchEncodeDecode(context);
+	BenchRoundTrip(context);
+	return 0;
+}
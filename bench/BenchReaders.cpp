@@ -0,0 +1,117 @@
+﻿#include "BenchHarness.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+// Reader的读取吞吐量随线程数的变化，每个线程用自己的Reader按步长读取1万个键。
+// 耗时是所有线程合计的每次读取，线程数增加时应该按比例下降（不超过CPU核数时）。
+// 写入时主线程每帧改一个值，读取的线程每次读取前换到新发布的快照
+using namespace RemoteSaveBench;
+
+static const size_t KeyCount = 10000;
+
+static void BenchThreads(RemoteSaveSession &session, const std::vector<std::string> &keys, unsigned threadCount, bool writing)
+{
+	auto name = std::to_string(threadCount) + (threadCount > 1 ? " threads" : " thread") + (writing ? ", writing" : ", idle");
+	auto &filter = GetOptions().filter;
+	if (!filter.empty() && name.find(filter) == std::string::npos)
+	{
+		return;
+	}
+
+	// The counter has to exist before the threads so it inherits them
+	CacheMissCounter missCounter;
+	RemoteSaveSession::Reader reader(session);
+	std::atomic<bool> stop(false);
+	std::atomic<unsigned long long> reads(0);
+	// Keeps the reads from being optimized away
+	std::atomic<int> sink(0);
+	std::vector<std::thread> threads;
+
+	auto allocs = AllocCount();
+	auto allocBytes = AllocBytes();
+	auto misses = missCounter.Read();
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned i = 0; i < threadCount; ++i)
+	{
+		threads.emplace_back([reader, &keys, &stop, &reads, &sink, i]() mutable
+		{
+			size_t next = i * 997;
+			unsigned long long count = 0;
+			int sum = 0;
+			while (!stop.load(std::memory_order_relaxed))
+			{
+				for (int j = 0; j < 256; ++j)
+				{
+					next = (next + 7919) % keys.size();
+					sum += reader.getIntegerForKey(keys[next].c_str());
+				}
+				count += 256;
+			}
+			reads += count;
+			sink += sum;
+		});
+	}
+
+	auto scheduler = cocos2d::Director::getInstance()->getScheduler();
+	int value = 0;
+	double seconds = 0.;
+	while ((seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()) < GetOptions().minSeconds)
+	{
+		if (writing)
+		{
+			session.setIntegerForKey(keys[0].c_str(), ++value);
+			scheduler->update(1.f / 60.f);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(writing ? 1 : 10));
+	}
+	stop = true;
+	for (auto &thread : threads)
+	{
+		thread.join();
+	}
+	seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	auto missesEnd = missCounter.Read();
+
+	Sample sample;
+	sample.iterations = reads;
+	sample.nanos = seconds * 1e9 / sample.iterations;
+	sample.allocs = (double)(AllocCount() - allocs) / sample.iterations;
+	sample.allocBytes = (double)(AllocBytes() - allocBytes) / sample.iterations;
+	sample.cacheMisses = misses >= 0 && missesEnd >= 0 ? (double)(missesEnd - misses) / sample.iterations : -1.;
+	PrintSample(name, 0, sample);
+}
+
+int main(int argc, char **argv)
+{
+	ParseOptions(argc, argv);
+
+	LoopbackServer server;
+	Session session;
+	session.initForBench(server.transport());
+	session.loadJson(server, MakeSaveJson(0, KeyCount));
+
+	// MakeSaveJson()中偶数键是整数
+	std::vector<std::string> keys;
+	for (size_t i = 0; i < KeyCount; i += 2)
+	{
+		keys.push_back(KeyName(i));
+	}
+
+	PrintHeader("Reader::getIntegerForKey by thread count (" + std::to_string(KeyCount) + " keys, " +
+				std::to_string(std::thread::hardware_concurrency()) + " CPUs)");
+	std::vector<unsigned> counts = { 1, 2, 4, 8 };
+	if (GetOptions().quick)
+	{
+		counts.resize(2);
+	}
+	for (auto writing : { false, true })
+	{
+		for (auto count : counts)
+		{
+			BenchThreads(session, keys, count, writing);
+		}
+	}
+	return 0;
+}
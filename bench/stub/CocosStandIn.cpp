@@ -0,0 +1,309 @@
+﻿#include <cocos2d.h>
+#include <network/HttpClient.h>
+
+namespace cocos2d
+{
+	static bool s_logEnabled = true;
+
+	void log(const char *format, ...)
+	{
+		if (!s_logEnabled)
+		{
+			return;
+		}
+
+		va_list args;
+		va_start(args, format);
+		vfprintf(stderr, format, args);
+		va_end(args);
+		fputc('\n', stderr);
+	}
+
+	void standin::setLogEnabled(bool enabled)
+	{
+		s_logEnabled = enabled;
+	}
+
+	const Data Data::Null;
+
+	void Data::copy(const unsigned char *bytes, const ssize_t size)
+	{
+		clear();
+		if (size > 0)
+		{
+			_size = size;
+			_bytes = (unsigned char*)malloc(_size);
+			memcpy(_bytes, bytes, _size);
+		}
+	}
+
+	void Data::clear()
+	{
+		free(_bytes);
+		_bytes = nullptr;
+		_size = 0;
+	}
+
+	// base64 is the algorithm of cocos2d-x 3.8 base/base64.cpp, so benchmarks
+	// against it compare with what the engine actually does (including the
+	// decoder table being rebuilt on every call).
+	static const unsigned char s_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	static int Base64DecodeImpl(const unsigned char *input, unsigned int inputLength, unsigned char *output, unsigned int *outputLength)
+	{
+		char inalphabet[256] = { 0 }, decoder[256] = { 0 };
+		for (int i = (int)sizeof(s_alphabet) - 2; i >= 0; i--)
+		{
+			inalphabet[s_alphabet[i]] = 1;
+			decoder[s_alphabet[i]] = (char)i;
+		}
+
+		int errors = 0;
+		int charCount = 0;
+		int bits = 0;
+		int c = 0;
+		unsigned int inputIndex = 0;
+		unsigned int outputIndex = 0;
+		for (inputIndex = 0; inputIndex < inputLength; inputIndex++)
+		{
+			c = input[inputIndex];
+			if (c == '=')
+			{
+				break;
+			}
+			if (!inalphabet[c])
+			{
+				continue;
+			}
+			bits += decoder[c];
+			charCount++;
+			if (charCount == 4)
+			{
+				output[outputIndex++] = (unsigned char)(bits >> 16);
+				output[outputIndex++] = (unsigned char)((bits >> 8) & 0xff);
+				output[outputIndex++] = (unsigned char)(bits & 0xff);
+				bits = 0;
+				charCount = 0;
+			}
+			else
+			{
+				bits <<= 6;
+			}
+		}
+
+		if (c == '=')
+		{
+			switch (charCount)
+			{
+			case 1:
+				errors++;
+				break;
+			case 2:
+				output[outputIndex++] = (unsigned char)(bits >> 10);
+				break;
+			case 3:
+				output[outputIndex++] = (unsigned char)(bits >> 16);
+				output[outputIndex++] = (unsigned char)((bits >> 8) & 0xff);
+				break;
+			}
+		}
+		else if (inputIndex < inputLength && charCount)
+		{
+			errors++;
+		}
+
+		*outputLength = outputIndex;
+		return errors;
+	}
+
+	static void Base64EncodeImpl(const unsigned char *input, unsigned int inputLength, char *output)
+	{
+		unsigned int charCount = 0;
+		unsigned int bits = 0;
+		unsigned int outputIndex = 0;
+		for (unsigned int inputIndex = 0; inputIndex < inputLength; inputIndex++)
+		{
+			bits |= input[inputIndex];
+			charCount++;
+			if (charCount == 3)
+			{
+				output[outputIndex++] = s_alphabet[(bits >> 18) & 0x3f];
+				output[outputIndex++] = s_alphabet[(bits >> 12) & 0x3f];
+				output[outputIndex++] = s_alphabet[(bits >> 6) & 0x3f];
+				output[outputIndex++] = s_alphabet[bits & 0x3f];
+				bits = 0;
+				charCount = 0;
+			}
+			else
+			{
+				bits <<= 8;
+			}
+		}
+
+		if (charCount)
+		{
+			if (charCount == 1)
+			{
+				bits <<= 8;
+			}
+			output[outputIndex++] = s_alphabet[(bits >> 18) & 0x3f];
+			output[outputIndex++] = s_alphabet[(bits >> 12) & 0x3f];
+			output[outputIndex++] = charCount > 1 ? s_alphabet[(bits >> 6) & 0x3f] : '=';
+			output[outputIndex++] = '=';
+		}
+		output[outputIndex] = 0;
+	}
+
+	int base64Decode(const unsigned char *in, unsigned int inLength, unsigned char **out)
+	{
+		unsigned int outLength = 0;
+		*out = (unsigned char*)malloc(inLength / 4 * 3 + 1);
+		if (*out && Base64DecodeImpl(in, inLength, *out, &outLength) > 0)
+		{
+			free(*out);
+			*out = nullptr;
+			outLength = 0;
+		}
+		return (int)outLength;
+	}
+
+	int base64Encode(const unsigned char *in, unsigned int inLength, char **out)
+	{
+		unsigned int outLength = (inLength + 2) / 3 * 4;
+		*out = (char*)malloc(outLength + 1);
+		if (*out)
+		{
+			Base64EncodeImpl(in, inLength, *out);
+		}
+		return (int)outLength;
+	}
+
+	void Scheduler::schedule(const ccSchedulerFunc &callback, void *target, float interval, bool paused, const std::string &key)
+	{
+		schedule(callback, target, interval, CC_REPEAT_FOREVER, 0.f, paused, key);
+	}
+
+	void Scheduler::schedule(const ccSchedulerFunc &callback, void *target, float interval, unsigned int repeat, float delay,
+							 bool /* paused */, const std::string &key)
+	{
+		// Like cocos2d, scheduling an existing key only updates its interval
+		auto it = _timers.find(std::make_pair(target, key));
+		if (it != _timers.end())
+		{
+			it->second.interval = interval;
+			return;
+		}
+
+		Timer timer;
+		timer.callback = callback;
+		timer.interval = interval;
+		timer.delay = delay;
+		timer.elapsed = 0.f;
+		timer.repeat = repeat;
+		_timers[std::make_pair(target, key)] = timer;
+	}
+
+	void Scheduler::unschedule(const std::string &key, void *target)
+	{
+		_timers.erase(std::make_pair(target, key));
+	}
+
+	bool Scheduler::isScheduled(const std::string &key, void *target)
+	{
+		return _timers.count(std::make_pair(target, key)) != 0;
+	}
+
+	void Scheduler::performFunctionInCocosThread(const std::function<void()> &function)
+	{
+		std::lock_guard<std::mutex> lock(_performMutex);
+		_functionsToPerform.push_back(function);
+	}
+
+	void Scheduler::update(float dt)
+	{
+		// Timers fire before the functions queued from other threads, as in cocos2d
+		std::vector<std::pair<void*, std::string>> due;
+		for (auto &item : _timers)
+		{
+			auto &timer = item.second;
+			timer.elapsed += dt;
+			if (timer.elapsed >= timer.delay + timer.interval)
+			{
+				due.push_back(item.first);
+			}
+		}
+		for (auto &key : due)
+		{
+			// An earlier callback may have unscheduled or replaced it
+			auto it = _timers.find(key);
+			if (it == _timers.end())
+			{
+				continue;
+			}
+
+			auto callback = it->second.callback;
+			float elapsed = it->second.elapsed;
+			it->second.elapsed = 0.f;
+			it->second.delay = 0.f;
+			if (it->second.repeat != CC_REPEAT_FOREVER)
+			{
+				if (it->second.repeat == 0)
+				{
+					_timers.erase(it);
+				}
+				else
+				{
+					--it->second.repeat;
+				}
+			}
+			callback(elapsed);
+		}
+
+		std::vector<std::function<void()>> functions;
+		{
+			std::lock_guard<std::mutex> lock(_performMutex);
+			functions.swap(_functionsToPerform);
+		}
+		for (auto &function : functions)
+		{
+			function();
+		}
+	}
+
+	Director *Director::getInstance()
+	{
+		static Director director;
+		return &director;
+	}
+
+	namespace network
+	{
+		HttpClient *HttpClient::getInstance()
+		{
+			static HttpClient client;
+			return &client;
+		}
+
+		void HttpClient::send(HttpRequest *request)
+		{
+			sendImmediate(request);
+		}
+
+		void HttpClient::sendImmediate(HttpRequest *request)
+		{
+			// No network here: fail the request on the next frame
+			request->retain();
+			Director::getInstance()->getScheduler()->performFunctionInCocosThread([this, request]()
+			{
+				auto response = new HttpResponse(request);
+				response->setErrorBuffer("no network in the cocos2d stand-in");
+				if (request->getCallback())
+				{
+					request->getCallback()(this, response);
+				}
+				response->release();
+				request->release();
+			});
+		}
+	}
+}
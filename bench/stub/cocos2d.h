@@ -0,0 +1,163 @@
+﻿#ifndef __CocosStandIn_H
+#define __CocosStandIn_H
+
+// 基准测试和单元测试用的cocos2d替身，只有RemoteSave用到的部分，接口和cocos2d-x 3.8相同。
+// 没有窗口和主循环，由测试调用Scheduler::update()推进帧
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+#ifndef COCOS2D_DEBUG
+#define COCOS2D_DEBUG 0
+#endif
+
+#if COCOS2D_DEBUG > 0
+#include <cassert>
+#define CCASSERT(cond, msg) assert((cond) && (msg))
+#define CCLOG(format, ...) cocos2d::log(format, ##__VA_ARGS__)
+#else
+#define CCASSERT(cond, msg) do {} while (0)
+#define CCLOG(...) do {} while (0)
+#endif
+
+#define CC_CALLBACK_0(__selector__, __target__, ...) std::bind(&__selector__, __target__, ##__VA_ARGS__)
+#define CC_CALLBACK_1(__selector__, __target__, ...) std::bind(&__selector__, __target__, std::placeholders::_1, ##__VA_ARGS__)
+#define CC_CALLBACK_2(__selector__, __target__, ...) std::bind(&__selector__, __target__, std::placeholders::_1, std::placeholders::_2, ##__VA_ARGS__)
+
+namespace cocos2d
+{
+	void log(const char *format, ...);
+
+	// 替身自己的设置，cocos2d中没有
+	namespace standin
+	{
+		// 关闭后log()不输出，计时时不受日志影响
+		void setLogEnabled(bool enabled);
+	}
+
+	template <typename T>
+	inline T random(T min, T max)
+	{
+		return min + (max - min) * (T)rand() / (T)RAND_MAX;
+	}
+
+	class Ref
+	{
+	public:
+		Ref() : _referenceCount(1) {}
+		virtual ~Ref() {}
+
+		void retain() { ++_referenceCount; }
+		void release()
+		{
+			if (--_referenceCount == 0)
+			{
+				delete this;
+			}
+		}
+		unsigned int getReferenceCount() const { return _referenceCount; }
+
+	protected:
+		unsigned int _referenceCount;
+	};
+
+	class Data
+	{
+	public:
+		static const Data Null;
+
+		Data() : _bytes(nullptr), _size(0) {}
+		Data(const Data &other) : _bytes(nullptr), _size(0) { copy(other._bytes, other._size); }
+		Data(Data &&other) : _bytes(other._bytes), _size(other._size) { other._bytes = nullptr; other._size = 0; }
+		~Data() { clear(); }
+
+		Data &operator=(const Data &other)
+		{
+			if (this != &other)
+			{
+				copy(other._bytes, other._size);
+			}
+			return *this;
+		}
+		Data &operator=(Data &&other)
+		{
+			if (this != &other)
+			{
+				clear();
+				_bytes = other._bytes;
+				_size = other._size;
+				other._bytes = nullptr;
+				other._size = 0;
+			}
+			return *this;
+		}
+
+		unsigned char *getBytes() const { return _bytes; }
+		ssize_t getSize() const { return _size; }
+		void copy(const unsigned char *bytes, const ssize_t size);
+		void fastSet(unsigned char *bytes, const ssize_t size) { _bytes = bytes; _size = size; }
+		void clear();
+		bool isNull() const { return _bytes == nullptr || _size == 0; }
+
+	private:
+		unsigned char *_bytes;
+		ssize_t _size;
+	};
+
+	// base/base64.h，输出用malloc分配，调用方free
+	int base64Decode(const unsigned char *in, unsigned int inLength, unsigned char **out);
+	int base64Encode(const unsigned char *in, unsigned int inLength, char **out);
+
+	typedef std::function<void(float)> ccSchedulerFunc;
+
+	class Scheduler
+	{
+	public:
+		static const unsigned int CC_REPEAT_FOREVER = 0xfffffffe;
+
+		void schedule(const ccSchedulerFunc &callback, void *target, float interval, bool paused, const std::string &key);
+		void schedule(const ccSchedulerFunc &callback, void *target, float interval, unsigned int repeat, float delay,
+					  bool paused, const std::string &key);
+		void unschedule(const std::string &key, void *target);
+		bool isScheduled(const std::string &key, void *target);
+		// 可以在任意线程中调用，下一次update()时在调用update()的线程中执行
+		void performFunctionInCocosThread(const std::function<void()> &function);
+
+		// 推进一帧
+		void update(float dt);
+
+	private:
+		struct Timer
+		{
+			ccSchedulerFunc callback;
+			float interval;
+			float delay;
+			float elapsed;
+			// 还要再执行的次数，CC_REPEAT_FOREVER时一直执行
+			unsigned int repeat;
+		};
+
+		std::map<std::pair<void*, std::string>, Timer> _timers;
+		std::vector<std::function<void()>> _functionsToPerform;
+		std::mutex _performMutex;
+	};
+
+	class Director
+	{
+	public:
+		static Director *getInstance();
+		Scheduler *getScheduler() { return &_scheduler; }
+
+	private:
+		Scheduler _scheduler;
+	};
+}
+
+#endif // __CocosStandIn_H
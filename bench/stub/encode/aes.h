@@ -0,0 +1,6 @@
+﻿#ifndef __AesStandIn_H
+#define __AesStandIn_H
+
+// RemoteSave.cpp自带AES实现，引擎中的encode/aes.h只为兼容保留包含，替身为空
+
+#endif // __AesStandIn_H
@@ -0,0 +1,103 @@
+﻿#ifndef __HttpClientStandIn_H
+#define __HttpClientStandIn_H
+
+// cocos2d::network::HttpClient的替身，没有网络：每个请求在下一帧以连接失败回调。
+// 基准测试和单元测试都用RemoteSaveLoopbackTransport或自己的传输层
+#include <cocos2d.h>
+
+namespace cocos2d
+{
+	namespace network
+	{
+		class HttpClient;
+		class HttpResponse;
+
+		typedef std::function<void(HttpClient*, HttpResponse*)> ccHttpRequestCallback;
+
+		class HttpRequest : public Ref
+		{
+		public:
+			enum class Type
+			{
+				GET,
+				POST,
+				PUT,
+				DELETE,
+				UNKNOWN,
+			};
+
+			HttpRequest() : _requestType(Type::UNKNOWN) {}
+
+			void setRequestType(Type type) { _requestType = type; }
+			Type getRequestType() const { return _requestType; }
+			void setUrl(const char *url) { _url = url; }
+			const char *getUrl() const { return _url.c_str(); }
+			void setRequestData(const char *buffer, size_t len) { _requestData.assign(buffer, buffer + len); }
+			char *getRequestData() { return _requestData.empty() ? nullptr : &_requestData[0]; }
+			ssize_t getRequestDataSize() const { return _requestData.size(); }
+			void setTag(const char *tag) { _tag = tag; }
+			const char *getTag() const { return _tag.c_str(); }
+			void setHeaders(const std::vector<std::string> &headers) { _headers = headers; }
+			std::vector<std::string> getHeaders() const { return _headers; }
+			void setResponseCallback(const ccHttpRequestCallback &callback) { _callback = callback; }
+			const ccHttpRequestCallback &getCallback() const { return _callback; }
+
+		private:
+			Type _requestType;
+			std::string _url;
+			std::vector<char> _requestData;
+			std::string _tag;
+			std::vector<std::string> _headers;
+			ccHttpRequestCallback _callback;
+		};
+
+		class HttpResponse : public Ref
+		{
+		public:
+			explicit HttpResponse(HttpRequest *request) : _pHttpRequest(request), _succeed(false), _responseCode(0)
+			{
+				if (_pHttpRequest)
+				{
+					_pHttpRequest->retain();
+				}
+			}
+			virtual ~HttpResponse()
+			{
+				if (_pHttpRequest)
+				{
+					_pHttpRequest->release();
+				}
+			}
+
+			HttpRequest *getHttpRequest() const { return _pHttpRequest; }
+			bool isSucceed() const { return _succeed; }
+			std::vector<char> *getResponseData() { return &_responseData; }
+			long getResponseCode() const { return _responseCode; }
+			const char *getErrorBuffer() const { return _errorBuffer.c_str(); }
+
+			void setSucceed(bool value) { _succeed = value; }
+			void setResponseCode(long value) { _responseCode = value; }
+			void setErrorBuffer(const char *value) { _errorBuffer = value; }
+
+		private:
+			HttpRequest *_pHttpRequest;
+			bool _succeed;
+			std::vector<char> _responseData;
+			long _responseCode;
+			std::string _errorBuffer;
+		};
+
+		class HttpClient
+		{
+		public:
+			static HttpClient *getInstance();
+
+			void send(HttpRequest *request);
+			void sendImmediate(HttpRequest *request);
+			void setTimeoutForConnect(int value) { (void)value; }
+			void setTimeoutForRead(int value) { (void)value; }
+		};
+	}
+}
+
+#endif // __HttpClientStandIn_H
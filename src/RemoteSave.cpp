@@ -2,1477 +2,5164 @@
 #include <json/stringbuffer.h>
 #include <json/writer.h>
 #include <encode/aes.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <random>
+#include <thread>
 #include "RemoteSave.h"
 
-#ifdef _MSC_VER
-#ifndef  __PRETTY_FUNCTION__
-#define __PRETTY_FUNCTION__ __FUNCTION__
+// x86/x64上运行时检测并选用AES-NI和SSSE3的base64，
+// 把AESNI/BASE64_SSSE3定义为0时只编译通用的实现
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#ifndef AESNI
+#define AESNI 1
+#endif
+#ifndef BASE64_SSSE3
+#define BASE64_SSSE3 1
 #endif
 #endif
 
-namespace __RemoveSave_private
-{
-#define CBC 1
-	/*
-
-	This is an implementation of the AES128 algorithm, specifically ECB and CBC mode.
-
-	The implementation is verified against the test vectors in:
-	National Institute of Standards and Technology Special Publication 800-38A 2001 ED
-
-	ECB-AES128
-	----------
-
-	plain-text:
-	6bc1bee22e409f96e93d7e117393172a
-	ae2d8a571e03ac9c9eb76fac45af8e51
-	30c81c46a35ce411e5fbc1191a0a52ef
-	f69f2445df4f9b17ad2b417be66c3710
-
-	key:
-	2b7e151628aed2a6abf7158809cf4f3c
-
-	resulting cipher
-	3ad77bb40d7a3660a89ecaf32466ef97
-	f5d3d58503b9699de785895a96fdbaaf
-	43b1cd7f598ece23881b00e3ed030688
-	7b0c785e27e8ad3f8223207104725dd4
-
-
-	NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
-	You should pad the end of the string with zeros if this is not the case.
+#if (defined(AESNI) && AESNI) || (defined(BASE64_SSSE3) && BASE64_SSSE3)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
 
-	*/
+#if defined(AESNI) && AESNI
+#include <wmmintrin.h>
+#endif
 
+#if defined(BASE64_SSSE3) && BASE64_SSSE3
+#include <tmmintrin.h>
+#endif
 
-	/*****************************************************************************/
-	/* Includes:                                                                 */
-	/*****************************************************************************/
-// #include <stdint.h>
-// #include <string.h> // CBC mode, for memset
-// #include "aes.h"
+// 本地日志在支持mmap的平台上映射文件
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
+// 请求内容（POST数据、存档JSON、服务器的回应）只在REMOTESAVE_LOG_LEVEL为2时打印，
+// 调试版本默认为2。Release版本不编译这些日志，只保留级别1的简短状态
+#ifndef REMOTESAVE_LOG_LEVEL
+#if COCOS2D_DEBUG > 0
+#define REMOTESAVE_LOG_LEVEL 2
+#else
+#define REMOTESAVE_LOG_LEVEL 1
+#endif
+#endif
 
-	/*****************************************************************************/
-	/* Defines:                                                                  */
-	/*****************************************************************************/
-	// The number of columns comprising a state in AES. This is a constant in AES. Value=4
-#define Nb 4
-	// The number of 32 bit words in a key.
-#define Nk 4
-	// Key length in bytes [128 bit]
-#define KEYLEN 16
-	// The number of rounds in AES Cipher.
-#define Nr 10
+#if REMOTESAVE_LOG_LEVEL >= 2
+#define REMOTESAVE_LOG_PAYLOAD(...) cocos2d::log(__VA_ARGS__)
+#else
+#define REMOTESAVE_LOG_PAYLOAD(...) do {} while (0)
+#endif
 
-	// jcallan@github points out that declaring Multiply as a function 
-	// reduces code size considerably with the Keil ARM compiler.
-	// See this link for more information: https://github.com/kokke/tiny-AES128-C/pull/3
-#ifndef MULTIPLY_AS_A_FUNCTION
-#define MULTIPLY_AS_A_FUNCTION 0
+#ifdef _MSC_VER
+#ifndef  __PRETTY_FUNCTION__
+#define __PRETTY_FUNCTION__ __FUNCTION__
+#endif
 #endif
 
+// 展开后的AES128密钥。只在AES128_init_ctx()中写入一次，之后只读，
+// 同一个上下文可以同时在任意多个线程中使用
+struct RemoteSaveSession::AesContext
+{
+	// 加密的轮密钥，Nb * (Nr + 1)个大端32位字
+	uint32_t roundKey[44];
+	// 等价逆密码（equivalent inverse cipher）的轮密钥
+	uint32_t invRoundKey[44];
+	// 同样的轮密钥按字节存放，给AES-NI用
+	uint8_t roundKeyBytes[176];
+	uint8_t invRoundKeyBytes[176];
+	// CBC模式的初始向量
+	uint8_t iv[16];
+	// GCM哈希子密钥的倍数，4位查表的GHASH
+	uint64_t gcmHL[16];
+	uint64_t gcmHH[16];
+};
+
+// m_jsonDoc成员的开放寻址哈希索引，按键查找不再遍历成员数组。
+// 槽中保存键的哈希和成员的位置，探测时哈希相同才比较键名。
+// 线性探测，容量是2的幂，最多半满
+struct RemoteSaveSession::KeyIndex
+{
+	struct Slot
+	{
+		uint32_t hash;
+		uint32_t member; // 在成员数组中的位置，空槽为EmptySlot
+	};
+	static const uint32_t EmptySlot = 0xffffffff;
+	static const size_t MinSlots = 16;
+
+	std::vector<Slot> slots;
+	size_t count;
+	// 每个成员位置一个标记：上次写入保存之后改变过
+	std::vector<uint8_t> dirty;
+
+	KeyIndex()
+		: count(0)
+	{
+		Clear(MinSlots);
+	}
 
-	/*****************************************************************************/
-	/* Private variables:                                                        */
-	/*****************************************************************************/
-	// state - array holding the intermediate results during decryption.
-	typedef uint8_t state_t[4][4];
-	static state_t* state;
+	// FNV-1a
+	static uint32_t Hash(const char* key, size_t length)
+	{
+		uint32_t hash = 2166136261u;
+		for (size_t i = 0; i < length; ++i)
+		{
+			hash = (hash ^ (uint8_t)key[i]) * 16777619u;
+		}
+		return hash;
+	}
 
-	// The array that stores the round keys.
-	static uint8_t RoundKey[176];
+	void Clear(size_t size)
+	{
+		Slot empty = { 0, EmptySlot };
+		slots.assign(size, empty);
+		count = 0;
+	}
 
-	// The Key input to the AES Program
-	static const uint8_t* Key;
+	// 返回key所在的槽，没有时返回探测序列结尾的空槽
+	Slot* Find(const rapidjson::Value& object, const char* key, size_t length, uint32_t hash)
+	{
+		size_t mask = slots.size() - 1;
+		for (size_t i = hash & mask; ; i = (i + 1) & mask)
+		{
+			Slot& slot = slots[i];
+			if (slot.member == EmptySlot)
+			{
+				return &slot;
+			}
+			if (slot.hash == hash)
+			{
+				const rapidjson::Value& name = (object.MemberBegin() + slot.member)->name;
+				if (name.GetStringLength() == length && memcmp(name.GetString(), key, length) == 0)
+				{
+					return &slot;
+				}
+			}
+		}
+	}
 
-#if defined(CBC) && CBC
-	// Initial Vector used only for CBC mode
-	static const uint8_t* Iv;
-#endif
+	const Slot* Find(const rapidjson::Value& object, const char* key, size_t length, uint32_t hash) const
+	{
+		return const_cast<KeyIndex*>(this)->Find(object, key, length, hash);
+	}
 
-	// The lookup-tables are marked const so they can be placed in read-only storage instead of RAM
-	// The numbers below can be computed dynamically trading ROM for RAM - 
-	// This can be useful in (embedded) bootloader applications, where ROM is often limited.
-	static const uint8_t sbox[256] = {
-		//0     1    2      3     4    5     6     7      8    9     A      B    C     D     E     F
-		0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
-		0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
-		0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
-		0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
-		0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
-		0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
-		0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
-		0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
-		0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
-		0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
-		0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
-		0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
-		0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
-		0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
-		0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
-		0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16 };
+	// 删除slot，把同一探测序列中后面的项前移，不留删除标记。
+	// 之前取得的Slot指针失效
+	void Erase(Slot* slot)
+	{
+		size_t mask = slots.size() - 1;
+		size_t i = slot - &slots[0];
+		for (size_t j = (i + 1) & mask; slots[j].member != EmptySlot; j = (j + 1) & mask)
+		{
+			// j处的项原本的槽不在(i, j]中时可以移到空位
+			size_t home = slots[j].hash & mask;
+			if (((j - home) & mask) >= ((j - i) & mask))
+			{
+				slots[i] = slots[j];
+				i = j;
+			}
+		}
+		slots[i].member = EmptySlot;
+		--count;
+	}
 
-	static const uint8_t rsbox[256] =
-	{ 0x52, 0x09, 0x6a, 0xd5, 0x30, 0x36, 0xa5, 0x38, 0xbf, 0x40, 0xa3, 0x9e, 0x81, 0xf3, 0xd7, 0xfb,
-	0x7c, 0xe3, 0x39, 0x82, 0x9b, 0x2f, 0xff, 0x87, 0x34, 0x8e, 0x43, 0x44, 0xc4, 0xde, 0xe9, 0xcb,
-	0x54, 0x7b, 0x94, 0x32, 0xa6, 0xc2, 0x23, 0x3d, 0xee, 0x4c, 0x95, 0x0b, 0x42, 0xfa, 0xc3, 0x4e,
-	0x08, 0x2e, 0xa1, 0x66, 0x28, 0xd9, 0x24, 0xb2, 0x76, 0x5b, 0xa2, 0x49, 0x6d, 0x8b, 0xd1, 0x25,
-	0x72, 0xf8, 0xf6, 0x64, 0x86, 0x68, 0x98, 0x16, 0xd4, 0xa4, 0x5c, 0xcc, 0x5d, 0x65, 0xb6, 0x92,
-	0x6c, 0x70, 0x48, 0x50, 0xfd, 0xed, 0xb9, 0xda, 0x5e, 0x15, 0x46, 0x57, 0xa7, 0x8d, 0x9d, 0x84,
-	0x90, 0xd8, 0xab, 0x00, 0x8c, 0xbc, 0xd3, 0x0a, 0xf7, 0xe4, 0x58, 0x05, 0xb8, 0xb3, 0x45, 0x06,
-	0xd0, 0x2c, 0x1e, 0x8f, 0xca, 0x3f, 0x0f, 0x02, 0xc1, 0xaf, 0xbd, 0x03, 0x01, 0x13, 0x8a, 0x6b,
-	0x3a, 0x91, 0x11, 0x41, 0x4f, 0x67, 0xdc, 0xea, 0x97, 0xf2, 0xcf, 0xce, 0xf0, 0xb4, 0xe6, 0x73,
-	0x96, 0xac, 0x74, 0x22, 0xe7, 0xad, 0x35, 0x85, 0xe2, 0xf9, 0x37, 0xe8, 0x1c, 0x75, 0xdf, 0x6e,
-	0x47, 0xf1, 0x1a, 0x71, 0x1d, 0x29, 0xc5, 0x89, 0x6f, 0xb7, 0x62, 0x0e, 0xaa, 0x18, 0xbe, 0x1b,
-	0xfc, 0x56, 0x3e, 0x4b, 0xc6, 0xd2, 0x79, 0x20, 0x9a, 0xdb, 0xc0, 0xfe, 0x78, 0xcd, 0x5a, 0xf4,
-	0x1f, 0xdd, 0xa8, 0x33, 0x88, 0x07, 0xc7, 0x31, 0xb1, 0x12, 0x10, 0x59, 0x27, 0x80, 0xec, 0x5f,
-	0x60, 0x51, 0x7f, 0xa9, 0x19, 0xb5, 0x4a, 0x0d, 0x2d, 0xe5, 0x7a, 0x9f, 0x93, 0xc9, 0x9c, 0xef,
-	0xa0, 0xe0, 0x3b, 0x4d, 0xae, 0x2a, 0xf5, 0xb0, 0xc8, 0xeb, 0xbb, 0x3c, 0x83, 0x53, 0x99, 0x61,
-	0x17, 0x2b, 0x04, 0x7e, 0xba, 0x77, 0xd6, 0x26, 0xe1, 0x69, 0x14, 0x63, 0x55, 0x21, 0x0c, 0x7d };
+	// key必须还不在索引中。之前取得的Slot指针失效
+	void Insert(uint32_t hash, uint32_t member)
+	{
+		if ((count + 1) * 2 > slots.size())
+		{
+			// 哈希已经保存在槽中，扩容时不读取键名
+			std::vector<Slot> old;
+			old.swap(slots);
+			Clear(old.size() * 2);
+			for (size_t i = 0; i < old.size(); ++i)
+			{
+				if (old[i].member != EmptySlot)
+				{
+					Insert(old[i].hash, old[i].member);
+				}
+			}
+		}
 
+		size_t mask = slots.size() - 1;
+		size_t i = hash & mask;
+		while (slots[i].member != EmptySlot)
+		{
+			i = (i + 1) & mask;
+		}
+		slots[i].hash = hash;
+		slots[i].member = member;
+		++count;
+	}
 
-	// The round constant word array, Rcon[i], contains the values given by 
-	// x to th e power (i-1) being powers of x (x is denoted as {02}) in the field GF(2^8)
-	// Note that i starts at 1, not 0).
-	static const uint8_t Rcon[255] = {
-		0x8d, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36, 0x6c, 0xd8, 0xab, 0x4d, 0x9a,
-		0x2f, 0x5e, 0xbc, 0x63, 0xc6, 0x97, 0x35, 0x6a, 0xd4, 0xb3, 0x7d, 0xfa, 0xef, 0xc5, 0x91, 0x39,
-		0x72, 0xe4, 0xd3, 0xbd, 0x61, 0xc2, 0x9f, 0x25, 0x4a, 0x94, 0x33, 0x66, 0xcc, 0x83, 0x1d, 0x3a,
-		0x74, 0xe8, 0xcb, 0x8d, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36, 0x6c, 0xd8,
-		0xab, 0x4d, 0x9a, 0x2f, 0x5e, 0xbc, 0x63, 0xc6, 0x97, 0x35, 0x6a, 0xd4, 0xb3, 0x7d, 0xfa, 0xef,
-		0xc5, 0x91, 0x39, 0x72, 0xe4, 0xd3, 0xbd, 0x61, 0xc2, 0x9f, 0x25, 0x4a, 0x94, 0x33, 0x66, 0xcc,
-		0x83, 0x1d, 0x3a, 0x74, 0xe8, 0xcb, 0x8d, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b,
-		0x36, 0x6c, 0xd8, 0xab, 0x4d, 0x9a, 0x2f, 0x5e, 0xbc, 0x63, 0xc6, 0x97, 0x35, 0x6a, 0xd4, 0xb3,
-		0x7d, 0xfa, 0xef, 0xc5, 0x91, 0x39, 0x72, 0xe4, 0xd3, 0xbd, 0x61, 0xc2, 0x9f, 0x25, 0x4a, 0x94,
-		0x33, 0x66, 0xcc, 0x83, 0x1d, 0x3a, 0x74, 0xe8, 0xcb, 0x8d, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20,
-		0x40, 0x80, 0x1b, 0x36, 0x6c, 0xd8, 0xab, 0x4d, 0x9a, 0x2f, 0x5e, 0xbc, 0x63, 0xc6, 0x97, 0x35,
-		0x6a, 0xd4, 0xb3, 0x7d, 0xfa, 0xef, 0xc5, 0x91, 0x39, 0x72, 0xe4, 0xd3, 0xbd, 0x61, 0xc2, 0x9f,
-		0x25, 0x4a, 0x94, 0x33, 0x66, 0xcc, 0x83, 0x1d, 0x3a, 0x74, 0xe8, 0xcb, 0x8d, 0x01, 0x02, 0x04,
-		0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36, 0x6c, 0xd8, 0xab, 0x4d, 0x9a, 0x2f, 0x5e, 0xbc, 0x63,
-		0xc6, 0x97, 0x35, 0x6a, 0xd4, 0xb3, 0x7d, 0xfa, 0xef, 0xc5, 0x91, 0x39, 0x72, 0xe4, 0xd3, 0xbd,
-		0x61, 0xc2, 0x9f, 0x25, 0x4a, 0x94, 0x33, 0x66, 0xcc, 0x83, 0x1d, 0x3a, 0x74, 0xe8, 0xcb };
+	// 索引object的所有成员。重复的键删除后面的，FindMember()从来不会返回它们，
+	// 留下会成为索引找不到的成员
+	void Rebuild(rapidjson::Value& object)
+	{
+		size_t members = object.IsObject() ? object.MemberCount() : 0;
+		size_t size = MinSlots;
+		while (size < members * 2)
+		{
+			size *= 2;
+		}
+		Clear(size);
+
+		for (size_t i = 0; i < members; )
+		{
+			auto member = object.MemberBegin() + i;
+			const rapidjson::Value& name = member->name;
+			auto hash = Hash(name.GetString(), name.GetStringLength());
+			if (Find(object, name.GetString(), name.GetStringLength(), hash)->member != EmptySlot)
+			{
+				object.EraseMember(member);
+				--members;
+				continue;
+			}
+			Insert(hash, (uint32_t)i);
+			++i;
+		}
+		dirty.assign(members, 0);
+	}
+};
 
+// 存档的本地副本：整个存档加密后的快照，以及之后的改变的只追加日志。
+// 每条日志记录是 长度（大端32位） | GCM数据，崩溃时只写了一部分的记录
+// 长度或tag校验失败，重放到此为止
+struct RemoteSaveSession::Journal
+{
+	std::string snapshotPath;
+	std::string journalPath;
+	// 日志重放之后以追加方式打开
+	FILE* file;
+	size_t fileSize;
+	size_t snapshotSize;
+	// 日志只对同一代（generation）的快照有效
+	uint32_t generation;
+	// 已加密还没写入的记录，例如批量修改中
+	std::string pending;
+	// 正在生成的记录，PayloadHeaderSize之后是JSON明文
+	std::string record;
+
+	// 跨快照累计的改变次数。sentSn那次保存包含前sentChanges个改变，
+	// 前syncedChanges个已经由服务器确认
+	unsigned long long changes;
+	unsigned long long syncedChanges;
+	unsigned long long sentSn;
+	unsigned long long sentChanges;
+
+	Journal()
+		: file(nullptr)
+		, fileSize(0)
+		, snapshotSize(0)
+		, generation(0)
+		, changes(0)
+		, syncedChanges(0)
+		, sentSn(0)
+		, sentChanges(0)
+	{
+	}
 
-	/*****************************************************************************/
-	/* Private functions:                                                        */
-	/*****************************************************************************/
-	static uint8_t getSBoxValue(uint8_t num)
+	~Journal()
 	{
-		return sbox[num];
+		Close();
 	}
 
-	static uint8_t getSBoxInvert(uint8_t num)
+	bool Unsynced() const
 	{
-		return rsbox[num];
+		return changes > syncedChanges;
 	}
 
-	// This function produces Nb(Nr+1) round keys. The round keys are used in each round to decrypt the states. 
-	static void KeyExpansion(void)
+	// fflush()把记录交给操作系统，应用被杀掉也不会丢失。
+	// 只有快照会同步到磁盘
+	void Write()
 	{
-		uint32_t i, j, k;
-		uint8_t tempa[4]; // Used for the column/row operations
+		if (!file || pending.empty())
+		{
+			return;
+		}
 
-		// The first round key is the key itself.
-		for (i = 0; i < Nk; ++i)
+		if (fwrite(pending.data(), 1, pending.size(), file) == pending.size() && fflush(file) == 0)
 		{
-			RoundKey[(i * 4) + 0] = Key[(i * 4) + 0];
-			RoundKey[(i * 4) + 1] = Key[(i * 4) + 1];
-			RoundKey[(i * 4) + 2] = Key[(i * 4) + 2];
-			RoundKey[(i * 4) + 3] = Key[(i * 4) + 3];
+			fileSize += pending.size();
 		}
+		else
+		{
+			// 只写了一部分的记录结束重放，下次启动时整理掉
+			cocos2d::log("[%s]: write failed, journal disabled: %s", __PRETTY_FUNCTION__, journalPath.c_str());
+			fclose(file);
+			file = nullptr;
+		}
+		pending.clear();
+	}
 
-		// All other round keys are found from the previous round keys.
-		for (; (i < (Nb * (Nr + 1))); ++i)
+	void Close()
+	{
+		Write();
+		if (file)
+		{
+			fclose(file);
+			file = nullptr;
+		}
+	}
+};
+
+// getMetrics()的统计数据。每个字段都是relaxed的原子变量，记录时不加锁也不分配内存，
+// 任意线程可以同时记录和读取。读取时可能看到记录了一半的数据（例如已计数还没累加），
+// 对统计没有影响
+struct RemoteSaveSession::MetricsRecorder
+{
+	// 类似HdrHistogram的对数线性直方图：小于16的值每个一个桶，之上每个2的幂区间
+	// 线性分成16个子桶。桶宽最多是其中值的1/16，百分位数的误差在6.25%以内
+	struct Histogram
+	{
+		static const int SubBucketBits = 4;
+		static const int SubBuckets = 1 << SubBucketBits;
+		// 纳秒，最大2^42（73分钟），更大的值计入最后一个桶
+		static const int MaxBits = 42;
+		static const int BucketCount = (MaxBits - SubBucketBits + 1) * SubBuckets;
+
+		std::atomic<uint64_t> counts[BucketCount];
+		std::atomic<uint64_t> count;
+		std::atomic<uint64_t> sum;
+		std::atomic<uint64_t> max;
+
+		static int BucketIndex(uint64_t value)
 		{
-			for (j = 0; j < 4; ++j)
+			if (value < (uint64_t)SubBuckets)
 			{
-				tempa[j] = RoundKey[(i - 1) * 4 + j];
+				return (int)value;
 			}
-			if (i % Nk == 0)
+			if (value >> MaxBits)
 			{
-				// This function rotates the 4 bytes in a word to the left once.
-				// [a0,a1,a2,a3] becomes [a1,a2,a3,a0]
+				return BucketCount - 1;
+			}
 
-				// Function RotWord()
+			// 最高的1所在的位，再取它下面的SubBucketBits位
+			int bit = 0;
+			for (int shift = 32; shift; shift >>= 1)
+			{
+				if (value >> (bit + shift))
 				{
-					k = tempa[0];
-					tempa[0] = tempa[1];
-					tempa[1] = tempa[2];
-					tempa[2] = tempa[3];
-					tempa[3] = k;
+					bit += shift;
 				}
+			}
+			int sub = (int)(value >> (bit - SubBucketBits)) - SubBuckets;
+			return (bit - SubBucketBits + 1) * SubBuckets + sub;
+		}
 
-				// SubWord() is a function that takes a four-byte input word and 
-				// applies the S-box to each of the four bytes to produce an output word.
+		// 落在这个桶中的最大值
+		static uint64_t BucketValue(int index)
+		{
+			if (index < SubBuckets)
+			{
+				return (uint64_t)index;
+			}
+			int shift = index / SubBuckets - 1;
+			uint64_t low = (uint64_t)(SubBuckets + index % SubBuckets) << shift;
+			return low + ((uint64_t)1 << shift) - 1;
+		}
 
-				// Function Subword()
-	  {
-		  tempa[0] = getSBoxValue(tempa[0]);
-		  tempa[1] = getSBoxValue(tempa[1]);
-		  tempa[2] = getSBoxValue(tempa[2]);
-		  tempa[3] = getSBoxValue(tempa[3]);
-	  }
+		void Record(uint64_t value)
+		{
+			counts[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+			count.fetch_add(1, std::memory_order_relaxed);
+			sum.fetch_add(value, std::memory_order_relaxed);
+			uint64_t current = max.load(std::memory_order_relaxed);
+			while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed))
+			{
+			}
+		}
 
-	  tempa[0] = tempa[0] ^ Rcon[i / Nk];
+		// 不小于fraction比例的记录值的最小的桶值
+		uint64_t Percentile(double fraction) const
+		{
+			uint64_t total = 0;
+			for (auto &bucket : counts)
+			{
+				total += bucket.load(std::memory_order_relaxed);
+			}
+			if (!total)
+			{
+				return 0;
 			}
-			else if (Nk > 6 && i % Nk == 4)
+
+			uint64_t target = (uint64_t)(fraction * (double)total + 0.5);
+			target = target < 1 ? 1 : (target > total ? total : target);
+			uint64_t seen = 0;
+			for (int i = 0; i < BucketCount; ++i)
 			{
-				// Function Subword()
+				seen += counts[i].load(std::memory_order_relaxed);
+				if (seen >= target)
 				{
-					tempa[0] = getSBoxValue(tempa[0]);
-					tempa[1] = getSBoxValue(tempa[1]);
-					tempa[2] = getSBoxValue(tempa[2]);
-					tempa[3] = getSBoxValue(tempa[3]);
+					// 桶的上界可能大于所有记录的值
+					uint64_t value = BucketValue(i);
+					uint64_t largest = max.load(std::memory_order_relaxed);
+					return value < largest ? value : largest;
 				}
 			}
-			RoundKey[i * 4 + 0] = RoundKey[(i - Nk) * 4 + 0] ^ tempa[0];
-			RoundKey[i * 4 + 1] = RoundKey[(i - Nk) * 4 + 1] ^ tempa[1];
-			RoundKey[i * 4 + 2] = RoundKey[(i - Nk) * 4 + 2] ^ tempa[2];
-			RoundKey[i * 4 + 3] = RoundKey[(i - Nk) * 4 + 3] ^ tempa[3];
+			return max.load(std::memory_order_relaxed);
 		}
-	}
 
-	// This function adds the round key to state.
-	// The round key is added to the state by an XOR function.
-	static void AddRoundKey(uint8_t round)
-	{
-		uint8_t i, j;
-		for (i = 0; i < 4; ++i)
+		void Reset()
 		{
-			for (j = 0; j < 4; ++j)
+			for (auto &bucket : counts)
 			{
-				(*state)[i][j] ^= RoundKey[round * Nb * 4 + i * Nb + j];
+				bucket.store(0, std::memory_order_relaxed);
 			}
+			count.store(0, std::memory_order_relaxed);
+			sum.store(0, std::memory_order_relaxed);
+			max.store(0, std::memory_order_relaxed);
 		}
-	}
+	};
 
-	// The SubBytes Function Substitutes the values in the
-	// state matrix with values in an S-box.
-	static void SubBytes(void)
+	Histogram latency[MS_COUNT];
+	std::atomic<uint64_t> bytes[MS_COUNT];
+	std::atomic<uint64_t> counters[MC_COUNT];
+
+	MetricsRecorder()
 	{
-		uint8_t i, j;
-		for (i = 0; i < 4; ++i)
-		{
-			for (j = 0; j < 4; ++j)
-			{
-				(*state)[j][i] = getSBoxValue((*state)[j][i]);
-			}
-		}
+		Reset();
 	}
 
-	// The ShiftRows() function shifts the rows in the state to the left.
-	// Each row is shifted with different offset.
-	// Offset = Row number. So the first row is not shifted.
-	static void ShiftRows(void)
+	// 阶段计时用的单调时钟
+	static uint64_t Now()
 	{
-		uint8_t temp;
-
-		// Rotate first row 1 columns to left  
-		temp = (*state)[0][1];
-		(*state)[0][1] = (*state)[1][1];
-		(*state)[1][1] = (*state)[2][1];
-		(*state)[2][1] = (*state)[3][1];
-		(*state)[3][1] = temp;
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
 
-		// Rotate second row 2 columns to left  
-		temp = (*state)[0][2];
-		(*state)[0][2] = (*state)[2][2];
-		(*state)[2][2] = temp;
+	void Record(MetricStage stage, uint64_t nanos, size_t size)
+	{
+		latency[stage].Record(nanos);
+		bytes[stage].fetch_add(size, std::memory_order_relaxed);
+	}
 
-		temp = (*state)[1][2];
-		(*state)[1][2] = (*state)[3][2];
-		(*state)[3][2] = temp;
+	void Count(MetricCounter counter)
+	{
+		counters[counter].fetch_add(1, std::memory_order_relaxed);
+	}
 
-		// Rotate third row 3 columns to left
-		temp = (*state)[0][3];
-		(*state)[0][3] = (*state)[3][3];
-		(*state)[3][3] = (*state)[2][3];
-		(*state)[2][3] = (*state)[1][3];
-		(*state)[1][3] = temp;
+	void Reset()
+	{
+		for (int i = 0; i < MS_COUNT; ++i)
+		{
+			latency[i].Reset();
+			bytes[i].store(0, std::memory_order_relaxed);
+		}
+		for (auto &counter : counters)
+		{
+			counter.store(0, std::memory_order_relaxed);
+		}
 	}
+};
 
-	static uint8_t xtime(uint8_t x)
+// 同一个Context的会话共用的固定大小的线程池，第一个任务时启动线程。
+// Run()把一个任务分成几部分，调用的线程等待时也执行排队中的部分，在线程池的线程中调用Run()不会死锁。
+// Post()排队整个任务，只由线程池的线程执行，排在等待中的部分之后
+struct RemoteSaveSession::Context::WorkerPool
+{
+	explicit WorkerPool(unsigned int threads)
+		: size(threads ? threads : std::max(std::thread::hardware_concurrency(), 1u))
+		, stopping(false)
 	{
-		return ((x << 1) ^ (((x >> 7) & 1) * 0x1b));
 	}
 
-	// MixColumns function mixes the columns of the state matrix
-	static void MixColumns(void)
+	~WorkerPool()
 	{
-		uint8_t i;
-		uint8_t Tmp, Tm, t;
-		for (i = 0; i < 4; ++i)
 		{
-			t = (*state)[i][0];
-			Tmp = (*state)[i][0] ^ (*state)[i][1] ^ (*state)[i][2] ^ (*state)[i][3];
-			Tm = (*state)[i][0] ^ (*state)[i][1]; Tm = xtime(Tm);  (*state)[i][0] ^= Tm ^ Tmp;
-			Tm = (*state)[i][1] ^ (*state)[i][2]; Tm = xtime(Tm);  (*state)[i][1] ^= Tm ^ Tmp;
-			Tm = (*state)[i][2] ^ (*state)[i][3]; Tm = xtime(Tm);  (*state)[i][2] ^= Tm ^ Tmp;
-			Tm = (*state)[i][3] ^ t;        Tm = xtime(Tm);  (*state)[i][3] ^= Tm ^ Tmp;
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wakeUp.notify_all();
+		for (auto &thread : threads)
+		{
+			thread.join();
 		}
 	}
 
-	// Multiply is used to multiply numbers in the field GF(2^8)
-#if MULTIPLY_AS_A_FUNCTION
-	static uint8_t Multiply(uint8_t x, uint8_t y)
+	unsigned int Size() const
 	{
-		return (((y & 1) * x) ^
-				((y >> 1 & 1) * xtime(x)) ^
-				((y >> 2 & 1) * xtime(xtime(x))) ^
-				((y >> 3 & 1) * xtime(xtime(xtime(x)))) ^
-				((y >> 4 & 1) * xtime(xtime(xtime(xtime(x))))));
+		return size;
 	}
-#else
-#define Multiply(x, y)                                \
-      (  ((y & 1) * x) ^                              \
-      ((y>>1 & 1) * xtime(x)) ^                       \
-      ((y>>2 & 1) * xtime(xtime(x))) ^                \
-      ((y>>3 & 1) * xtime(xtime(xtime(x)))) ^         \
-      ((y>>4 & 1) * xtime(xtime(xtime(xtime(x))))))   \
-
-#endif
 
-	// MixColumns function mixes the columns of the state matrix.
-	// The method used to multiply may be difficult to understand for the inexperienced.
-	// Please use the references to gain more information.
-	static void InvMixColumns(void)
+	// 对[0, count)中的每个i调用task(i)，第0部分在调用的线程中执行。
+	// 所有部分完成后返回
+	void Run(unsigned int count, const std::function<void(unsigned int)> &task)
 	{
-		int i;
-		uint8_t a, b, c, d;
-		for (i = 0; i < 4; ++i)
+		if (count == 0)
+		{
+			return;
+		}
+
+		unsigned int remaining = count - 1;
 		{
-			a = (*state)[i][0];
-			b = (*state)[i][1];
-			c = (*state)[i][2];
-			d = (*state)[i][3];
+			std::lock_guard<std::mutex> lock(mutex);
+			Start();
+			for (unsigned int i = 1; i < count; ++i)
+			{
+				queue.push_back([this, &task, &remaining, i]()
+				{
+					task(i);
+					std::lock_guard<std::mutex> lock(mutex);
+					--remaining;
+					finished.notify_all();
+				});
+			}
+		}
+		wakeUp.notify_all();
+
+		task(0);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		while (remaining > 0)
+		{
+			if (queue.empty())
+			{
+				finished.wait(lock);
+				continue;
+			}
+
+			auto job = std::move(queue.front());
+			queue.pop_front();
+			lock.unlock();
+			job();
+			lock.lock();
+		}
+	}
+
+	// 在线程池的线程中执行task，立即返回
+	void Post(std::function<void()> task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			Start();
+			background.push_back(std::move(task));
+		}
+		wakeUp.notify_one();
+	}
+
+	// 调用时已持有mutex
+	void Start()
+	{
+		while (threads.size() < size)
+		{
+			threads.push_back(std::thread([this]()
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				for (;;)
+				{
+					wakeUp.wait(lock, [this] { return stopping || !queue.empty() || !background.empty(); });
+					if (stopping)
+					{
+						return;
+					}
+
+					// 先执行Run()的部分，有调用方在等待
+					auto &source = !queue.empty() ? queue : background;
+					auto job = std::move(source.front());
+					source.pop_front();
+					lock.unlock();
+					job();
+					lock.lock();
+				}
+			}));
+		}
+	}
+
+	const unsigned int size;
+	std::mutex mutex;
+	std::condition_variable wakeUp;
+	std::condition_variable finished;
+	std::deque<std::function<void()>> queue;
+	std::deque<std::function<void()>> background;
+	std::vector<std::thread> threads;
+	bool stopping;
+};
+
+// 由调用的线程填写，线程池的线程（不在后台保存时是调用的线程自己）把它变成请求。
+// 每个会话同时只有一个保存在发送，下一次保存在waitSaveJob()之后复用它
+struct RemoteSaveSession::SaveJob
+{
+	SaveJob()
+		: snapshot(&allocator)
+		, delta(false)
+		, format(PF_CBC)
+		, sn(0)
+		, baseSn(0)
+		, running(false)
+	{
+	}
+
+	// 整个存档，增量时是{"set":{...},"remove":[...]}。原地解析的字符串没有复制，
+	// 仍然指向加载的缓冲区，由loadBuffer持有
+	JsonAllocator allocator;
+	rapidjson::Document snapshot;
+	std::shared_ptr<std::string> loadBuffer;
+	bool delta;
+	PayloadFormat format;
+	unsigned long long sn;
+	unsigned long long baseSn;
+	std::shared_ptr<RemoteSaveTransport::Request> request;
+	// 原地存放明文和密文，LZ4的输出和它交换
+	std::string buffer;
+	std::string compressBuffer;
+
+	std::mutex mutex;
+	std::condition_variable done;
+	bool running;
+};
+
+// 给Reader的存档的不可变副本。CopyFrom()保持成员顺序，会话的索引中的槽直接适用，
+// 不复制修改标记
+struct RemoteSaveSession::ReadSnapshot
+{
+	explicit ReadSnapshot(size_t chunkSize)
+		: allocator(chunkSize)
+		, doc(&allocator)
+	{
+	}
+
+	JsonAllocator allocator;
+	rapidjson::Document doc;
+	KeyIndex index;
+	// 原地解析的字符串仍然指向加载的缓冲区
+	std::shared_ptr<std::string> loadBuffer;
+};
+
+// 会话在这里发布快照，Reader从这里取得。Reader只在version改变时加锁，
+// 两次发布之间读取时只访问共享的version
+struct RemoteSaveSession::ReadChannel
+{
+	ReadChannel()
+		: version(0)
+	{
+	}
+
+	void Publish(const std::shared_ptr<const ReadSnapshot> &snapshot)
+	{
+		// 旧的快照在锁外释放，或者由最后一个持有它的Reader释放
+		std::shared_ptr<const ReadSnapshot> old = snapshot;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			current.swap(old);
+			version.fetch_add(1, std::memory_order_release);
+		}
+	}
+
+	unsigned long long Acquire(std::shared_ptr<const ReadSnapshot> &snapshot)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		snapshot = current;
+		return version.load(std::memory_order_relaxed);
+	}
+
+	std::mutex mutex;
+	std::shared_ptr<const ReadSnapshot> current;
+	std::atomic<unsigned long long> version;
+};
+
+namespace __RemoveSave_private
+{
+	typedef RemoteSaveSession::AesContext AesContext;
+	typedef RemoteSaveSession::Context::WorkerPool WorkerPool;
+
+#define CBC 1
+#define GCM 1
+	/*
+
+	This is an implementation of the AES128 algorithm, specifically ECB, CBC and GCM mode.
+
+	The implementation is verified against the test vectors in:
+	National Institute of Standards and Technology Special Publication 800-38A 2001 ED
+
+	ECB-AES128
+	----------
+
+	plain-text:
+	6bc1bee22e409f96e93d7e117393172a
+	ae2d8a571e03ac9c9eb76fac45af8e51
+	30c81c46a35ce411e5fbc1191a0a52ef
+	f69f2445df4f9b17ad2b417be66c3710
+
+	key:
+	2b7e151628aed2a6abf7158809cf4f3c
+
+	resulting cipher
+	3ad77bb40d7a3660a89ecaf32466ef97
+	f5d3d58503b9699de785895a96fdbaaf
+	43b1cd7f598ece23881b00e3ed030688
+	7b0c785e27e8ad3f8223207104725dd4
+
+	CBC-AES128 (same plain-text and key)
+	----------
+
+	iv:
+	000102030405060708090a0b0c0d0e0f
+
+	resulting cipher
+	7649abac8119b246cee98e9b12e9197d
+	5086cb9b507219ee95db113a917678b2
+	73bed6b8e3c1743b7116e69e22229516
+	3ff1caa1681fac09120eca307586e1a7
+
+	GCM-AES128 is checked against test case 4 of McGrew and Viega,
+	"The Galois/Counter Mode of Operation (GCM)".
+
+
+	NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
+	You should pad the end of the string with zeros if this is not the case.
+
+	The cipher works on whole 32 bit columns: SubBytes, ShiftRows and MixColumns
+	of one round are folded into four 256-entry lookup tables (Te0..Te3), and the
+	inverse rounds likewise into Td0..Td3 together with the round keys of the
+	"equivalent inverse cipher" (FIPS-197 5.3.5).
+
+	*/
+
+
+	/*****************************************************************************/
+	/* Includes:                                                                 */
+	/*****************************************************************************/
+// #include <stdint.h>
+// #include <string.h> // CBC mode, for memset
+// #include "aes.h"
+
+
+	/*****************************************************************************/
+	/* Defines:                                                                  */
+	/*****************************************************************************/
+	// The number of columns comprising a state in AES. This is a constant in AES. Value=4
+#define Nb 4
+	// The number of 32 bit words in a key.
+#define Nk 4
+	// Key length in bytes [128 bit]
+#define KEYLEN 16
+	// The number of rounds in AES Cipher.
+#define Nr 10
+
+	// Big-endian load/store of one state column
+#define GETU32(p) (((uint32_t)(p)[0] << 24) ^ ((uint32_t)(p)[1] << 16) ^ ((uint32_t)(p)[2] << 8) ^ ((uint32_t)(p)[3]))
+#define PUTU32(p, v) { (p)[0] = (uint8_t)((v) >> 24); (p)[1] = (uint8_t)((v) >> 16); (p)[2] = (uint8_t)((v) >> 8); (p)[3] = (uint8_t)(v); }
+
+#if defined(AESNI) && AESNI
+	// GCC/Clang only emit the AES instructions inside functions that enable the target
+#if defined(__GNUC__)
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+#else
+#define AESNI_TARGET
+#endif
+	// The number of blocks decrypted in parallel by the AES-NI path.
+#define AESNI_PARALLEL 8
+#endif
+
+#if defined(BASE64_SSSE3) && BASE64_SSSE3
+#if defined(__GNUC__)
+#define SSSE3_TARGET __attribute__((target("ssse3")))
+#else
+#define SSSE3_TARGET
+#endif
+#endif
+
+
+	/*****************************************************************************/
+	/* Private variables:                                                        */
+	/*****************************************************************************/
+	// All key dependent state lives in AesContext, only constant tables are kept here.
+
+	// The lookup-tables are marked const so they can be placed in read-only storage instead of RAM
+	// The numbers below can be computed dynamically trading ROM for RAM -
+	// This can be useful in (embedded) bootloader applications, where ROM is often limited.
+	static const uint8_t sbox[256] = {
+		//0     1    2      3     4    5     6     7      8    9     A      B    C     D     E     F
+		0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+		0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+		0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+		0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+		0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+		0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+		0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+		0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+		0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+		0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+		0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+		0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+		0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+		0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+		0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+		0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16 };
+
+	static const uint8_t rsbox[256] =
+	{ 0x52, 0x09, 0x6a, 0xd5, 0x30, 0x36, 0xa5, 0x38, 0xbf, 0x40, 0xa3, 0x9e, 0x81, 0xf3, 0xd7, 0xfb,
+	0x7c, 0xe3, 0x39, 0x82, 0x9b, 0x2f, 0xff, 0x87, 0x34, 0x8e, 0x43, 0x44, 0xc4, 0xde, 0xe9, 0xcb,
+	0x54, 0x7b, 0x94, 0x32, 0xa6, 0xc2, 0x23, 0x3d, 0xee, 0x4c, 0x95, 0x0b, 0x42, 0xfa, 0xc3, 0x4e,
+	0x08, 0x2e, 0xa1, 0x66, 0x28, 0xd9, 0x24, 0xb2, 0x76, 0x5b, 0xa2, 0x49, 0x6d, 0x8b, 0xd1, 0x25,
+	0x72, 0xf8, 0xf6, 0x64, 0x86, 0x68, 0x98, 0x16, 0xd4, 0xa4, 0x5c, 0xcc, 0x5d, 0x65, 0xb6, 0x92,
+	0x6c, 0x70, 0x48, 0x50, 0xfd, 0xed, 0xb9, 0xda, 0x5e, 0x15, 0x46, 0x57, 0xa7, 0x8d, 0x9d, 0x84,
+	0x90, 0xd8, 0xab, 0x00, 0x8c, 0xbc, 0xd3, 0x0a, 0xf7, 0xe4, 0x58, 0x05, 0xb8, 0xb3, 0x45, 0x06,
+	0xd0, 0x2c, 0x1e, 0x8f, 0xca, 0x3f, 0x0f, 0x02, 0xc1, 0xaf, 0xbd, 0x03, 0x01, 0x13, 0x8a, 0x6b,
+	0x3a, 0x91, 0x11, 0x41, 0x4f, 0x67, 0xdc, 0xea, 0x97, 0xf2, 0xcf, 0xce, 0xf0, 0xb4, 0xe6, 0x73,
+	0x96, 0xac, 0x74, 0x22, 0xe7, 0xad, 0x35, 0x85, 0xe2, 0xf9, 0x37, 0xe8, 0x1c, 0x75, 0xdf, 0x6e,
+	0x47, 0xf1, 0x1a, 0x71, 0x1d, 0x29, 0xc5, 0x89, 0x6f, 0xb7, 0x62, 0x0e, 0xaa, 0x18, 0xbe, 0x1b,
+	0xfc, 0x56, 0x3e, 0x4b, 0xc6, 0xd2, 0x79, 0x20, 0x9a, 0xdb, 0xc0, 0xfe, 0x78, 0xcd, 0x5a, 0xf4,
+	0x1f, 0xdd, 0xa8, 0x33, 0x88, 0x07, 0xc7, 0x31, 0xb1, 0x12, 0x10, 0x59, 0x27, 0x80, 0xec, 0x5f,
+	0x60, 0x51, 0x7f, 0xa9, 0x19, 0xb5, 0x4a, 0x0d, 0x2d, 0xe5, 0x7a, 0x9f, 0x93, 0xc9, 0x9c, 0xef,
+	0xa0, 0xe0, 0x3b, 0x4d, 0xae, 0x2a, 0xf5, 0xb0, 0xc8, 0xeb, 0xbb, 0x3c, 0x83, 0x53, 0x99, 0x61,
+	0x17, 0x2b, 0x04, 0x7e, 0xba, 0x77, 0xd6, 0x26, 0xe1, 0x69, 0x14, 0x63, 0x55, 0x21, 0x0c, 0x7d };
+
+
+	// The round constant word array, Rcon[i], contains the values given by
+	// x to th e power (i-1) being powers of x (x is denoted as {02}) in the field GF(2^8)
+	// Note that i starts at 1, not 0).
+	static const uint8_t Rcon[255] = {
+		0x8d, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36, 0x6c, 0xd8, 0xab, 0x4d, 0x9a,
+		0x2f, 0x5e, 0xbc, 0x63, 0xc6, 0x97, 0x35, 0x6a, 0xd4, 0xb3, 0x7d, 0xfa, 0xef, 0xc5, 0x91, 0x39,
+		0x72, 0xe4, 0xd3, 0xbd, 0x61, 0xc2, 0x9f, 0x25, 0x4a, 0x94, 0x33, 0x66, 0xcc, 0x83, 0x1d, 0x3a,
+		0x74, 0xe8, 0xcb, 0x8d, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36, 0x6c, 0xd8,
+		0xab, 0x4d, 0x9a, 0x2f, 0x5e, 0xbc, 0x63, 0xc6, 0x97, 0x35, 0x6a, 0xd4, 0xb3, 0x7d, 0xfa, 0xef,
+		0xc5, 0x91, 0x39, 0x72, 0xe4, 0xd3, 0xbd, 0x61, 0xc2, 0x9f, 0x25, 0x4a, 0x94, 0x33, 0x66, 0xcc,
+		0x83, 0x1d, 0x3a, 0x74, 0xe8, 0xcb, 0x8d, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b,
+		0x36, 0x6c, 0xd8, 0xab, 0x4d, 0x9a, 0x2f, 0x5e, 0xbc, 0x63, 0xc6, 0x97, 0x35, 0x6a, 0xd4, 0xb3,
+		0x7d, 0xfa, 0xef, 0xc5, 0x91, 0x39, 0x72, 0xe4, 0xd3, 0xbd, 0x61, 0xc2, 0x9f, 0x25, 0x4a, 0x94,
+		0x33, 0x66, 0xcc, 0x83, 0x1d, 0x3a, 0x74, 0xe8, 0xcb, 0x8d, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20,
+		0x40, 0x80, 0x1b, 0x36, 0x6c, 0xd8, 0xab, 0x4d, 0x9a, 0x2f, 0x5e, 0xbc, 0x63, 0xc6, 0x97, 0x35,
+		0x6a, 0xd4, 0xb3, 0x7d, 0xfa, 0xef, 0xc5, 0x91, 0x39, 0x72, 0xe4, 0xd3, 0xbd, 0x61, 0xc2, 0x9f,
+		0x25, 0x4a, 0x94, 0x33, 0x66, 0xcc, 0x83, 0x1d, 0x3a, 0x74, 0xe8, 0xcb, 0x8d, 0x01, 0x02, 0x04,
+		0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36, 0x6c, 0xd8, 0xab, 0x4d, 0x9a, 0x2f, 0x5e, 0xbc, 0x63,
+		0xc6, 0x97, 0x35, 0x6a, 0xd4, 0xb3, 0x7d, 0xfa, 0xef, 0xc5, 0x91, 0x39, 0x72, 0xe4, 0xd3, 0xbd,
+		0x61, 0xc2, 0x9f, 0x25, 0x4a, 0x94, 0x33, 0x66, 0xcc, 0x83, 0x1d, 0x3a, 0x74, 0xe8, 0xcb };
+
+
+	/*****************************************************************************/
+	/* Private functions:                                                        */
+	/*****************************************************************************/
+	static uint8_t xtime(uint8_t x)
+	{
+		return ((x << 1) ^ (((x >> 7) & 1) * 0x1b));
+	}
+
+	// Multiply is used to multiply numbers in the field GF(2^8)
+	static uint8_t Multiply(uint8_t x, uint8_t y)
+	{
+		return (((y & 1) * x) ^
+				((y >> 1 & 1) * xtime(x)) ^
+				((y >> 2 & 1) * xtime(xtime(x))) ^
+				((y >> 3 & 1) * xtime(xtime(xtime(x)))) ^
+				((y >> 4 & 1) * xtime(xtime(xtime(xtime(x))))));
+	}
+
+	static uint32_t RotateRight8(uint32_t x)
+	{
+		return (x >> 8) | (x << 24);
+	}
+
+	// The round lookup-tables.
+	// Te0[x] = S[x].[02, 01, 01, 03], Td0[x] = Si[x].[0e, 09, 0d, 0b];
+	// Te1..Te3 and Td1..Td3 are the same columns rotated right by 8, 16 and 24 bits.
+	// They are derived from sbox/rsbox during static initialization, so they are
+	// complete before any code can reach the cipher.
+	struct RoundTables
+	{
+		uint32_t Te[4][256];
+		uint32_t Td[4][256];
+
+		RoundTables()
+		{
+			for (int i = 0; i < 256; ++i)
+			{
+				uint8_t s = sbox[i];
+				uint8_t r = rsbox[i];
+				uint32_t te = ((uint32_t)xtime(s) << 24) | ((uint32_t)s << 16) | ((uint32_t)s << 8) | (uint32_t)(xtime(s) ^ s);
+				uint32_t td = ((uint32_t)Multiply(r, 0x0e) << 24) | ((uint32_t)Multiply(r, 0x09) << 16)
+					| ((uint32_t)Multiply(r, 0x0d) << 8) | (uint32_t)Multiply(r, 0x0b);
+				for (int j = 0; j < 4; ++j)
+				{
+					Te[j][i] = te;
+					Td[j][i] = td;
+					te = RotateRight8(te);
+					td = RotateRight8(td);
+				}
+			}
+		}
+	};
+	static const RoundTables Tables;
+
+#define Te0 Tables.Te[0]
+#define Te1 Tables.Te[1]
+#define Te2 Tables.Te[2]
+#define Te3 Tables.Te[3]
+#define Td0 Tables.Td[0]
+#define Td1 Tables.Td[1]
+#define Td2 Tables.Td[2]
+#define Td3 Tables.Td[3]
+
+	static uint32_t SubWord(uint32_t w)
+	{
+		return ((uint32_t)sbox[w >> 24] << 24) | ((uint32_t)sbox[(w >> 16) & 0xff] << 16)
+			| ((uint32_t)sbox[(w >> 8) & 0xff] << 8) | (uint32_t)sbox[w & 0xff];
+	}
+
+	// This function produces Nb(Nr+1) round keys. The round keys are used in each round to decrypt the states.
+	static void KeyExpansion(AesContext* ctx, const uint8_t* key)
+	{
+		uint32_t* RoundKey = ctx->roundKey;
+		uint32_t* InvRoundKey = ctx->invRoundKey;
+		uint32_t i, j, temp;
+
+		// The first round key is the key itself.
+		for (i = 0; i < Nk; ++i)
+		{
+			RoundKey[i] = GETU32(key + i * 4);
+		}
+
+		// All other round keys are found from the previous round keys.
+		for (; i < Nb * (Nr + 1); ++i)
+		{
+			temp = RoundKey[i - 1];
+			if (i % Nk == 0)
+			{
+				// RotWord() rotates [a0,a1,a2,a3] to [a1,a2,a3,a0], then
+				// SubWord() applies the S-box to each of the four bytes.
+				temp = SubWord((temp << 8) | (temp >> 24)) ^ ((uint32_t)Rcon[i / Nk] << 24);
+			}
+			RoundKey[i] = RoundKey[i - Nk] ^ temp;
+		}
+
+		// The decryption round keys are the encryption round keys in reverse order,
+		// with InvMixColumns applied to all but the first and the last one.
+		for (i = 0; i <= Nr; ++i)
+		{
+			for (j = 0; j < Nb; ++j)
+			{
+				InvRoundKey[i * Nb + j] = RoundKey[(Nr - i) * Nb + j];
+			}
+		}
+		for (i = Nb; i < Nb * Nr; ++i)
+		{
+			temp = InvRoundKey[i];
+			InvRoundKey[i] = Td0[sbox[temp >> 24]] ^ Td1[sbox[(temp >> 16) & 0xff]]
+				^ Td2[sbox[(temp >> 8) & 0xff]] ^ Td3[sbox[temp & 0xff]];
+		}
+
+#if defined(AESNI) && AESNI
+		// AESDEC expects exactly the equivalent inverse cipher keys computed above
+		for (i = 0; i < Nb * (Nr + 1); ++i)
+		{
+			PUTU32(ctx->roundKeyBytes + i * 4, RoundKey[i]);
+			PUTU32(ctx->invRoundKeyBytes + i * 4, InvRoundKey[i]);
+		}
+#endif
+	}
+
+	// Cipher is the main function that encrypts the PlainText.
+	// s holds the four state columns, the result is written back to it.
+	static void Cipher(const AesContext* ctx, uint32_t s[4])
+	{
+		const uint32_t *rk = ctx->roundKey;
+		uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+		uint8_t round;
+
+		// Add the First round key to the state before starting the rounds.
+		s0 = s[0] ^ rk[0];
+		s1 = s[1] ^ rk[1];
+		s2 = s[2] ^ rk[2];
+		s3 = s[3] ^ rk[3];
+
+		// There will be Nr rounds.
+		// The first Nr-1 rounds are identical.
+		// These Nr-1 rounds are executed in the loop below.
+		for (round = 1; round < Nr; ++round)
+		{
+			rk += Nb;
+			t0 = Te0[s0 >> 24] ^ Te1[(s1 >> 16) & 0xff] ^ Te2[(s2 >> 8) & 0xff] ^ Te3[s3 & 0xff] ^ rk[0];
+			t1 = Te0[s1 >> 24] ^ Te1[(s2 >> 16) & 0xff] ^ Te2[(s3 >> 8) & 0xff] ^ Te3[s0 & 0xff] ^ rk[1];
+			t2 = Te0[s2 >> 24] ^ Te1[(s3 >> 16) & 0xff] ^ Te2[(s0 >> 8) & 0xff] ^ Te3[s1 & 0xff] ^ rk[2];
+			t3 = Te0[s3 >> 24] ^ Te1[(s0 >> 16) & 0xff] ^ Te2[(s1 >> 8) & 0xff] ^ Te3[s2 & 0xff] ^ rk[3];
+			s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+		}
+
+		// The last round is given below.
+		// The MixColumns function is not here in the last round.
+		rk += Nb;
+		s[0] = ((uint32_t)sbox[s0 >> 24] << 24) ^ ((uint32_t)sbox[(s1 >> 16) & 0xff] << 16)
+			^ ((uint32_t)sbox[(s2 >> 8) & 0xff] << 8) ^ (uint32_t)sbox[s3 & 0xff] ^ rk[0];
+		s[1] = ((uint32_t)sbox[s1 >> 24] << 24) ^ ((uint32_t)sbox[(s2 >> 16) & 0xff] << 16)
+			^ ((uint32_t)sbox[(s3 >> 8) & 0xff] << 8) ^ (uint32_t)sbox[s0 & 0xff] ^ rk[1];
+		s[2] = ((uint32_t)sbox[s2 >> 24] << 24) ^ ((uint32_t)sbox[(s3 >> 16) & 0xff] << 16)
+			^ ((uint32_t)sbox[(s0 >> 8) & 0xff] << 8) ^ (uint32_t)sbox[s1 & 0xff] ^ rk[2];
+		s[3] = ((uint32_t)sbox[s3 >> 24] << 24) ^ ((uint32_t)sbox[(s0 >> 16) & 0xff] << 16)
+			^ ((uint32_t)sbox[(s1 >> 8) & 0xff] << 8) ^ (uint32_t)sbox[s2 & 0xff] ^ rk[3];
+	}
+
+	static void InvCipher(const AesContext* ctx, uint32_t s[4])
+	{
+		const uint32_t *rk = ctx->invRoundKey;
+		uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+		uint8_t round;
+
+		// Add the First round key to the state before starting the rounds.
+		s0 = s[0] ^ rk[0];
+		s1 = s[1] ^ rk[1];
+		s2 = s[2] ^ rk[2];
+		s3 = s[3] ^ rk[3];
+
+		// There will be Nr rounds.
+		// The first Nr-1 rounds are identical.
+		// These Nr-1 rounds are executed in the loop below.
+		for (round = 1; round < Nr; ++round)
+		{
+			rk += Nb;
+			t0 = Td0[s0 >> 24] ^ Td1[(s3 >> 16) & 0xff] ^ Td2[(s2 >> 8) & 0xff] ^ Td3[s1 & 0xff] ^ rk[0];
+			t1 = Td0[s1 >> 24] ^ Td1[(s0 >> 16) & 0xff] ^ Td2[(s3 >> 8) & 0xff] ^ Td3[s2 & 0xff] ^ rk[1];
+			t2 = Td0[s2 >> 24] ^ Td1[(s1 >> 16) & 0xff] ^ Td2[(s0 >> 8) & 0xff] ^ Td3[s3 & 0xff] ^ rk[2];
+			t3 = Td0[s3 >> 24] ^ Td1[(s2 >> 16) & 0xff] ^ Td2[(s1 >> 8) & 0xff] ^ Td3[s0 & 0xff] ^ rk[3];
+			s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+		}
+
+		// The last round is given below.
+		// The MixColumns function is not here in the last round.
+		rk += Nb;
+		s[0] = ((uint32_t)rsbox[s0 >> 24] << 24) ^ ((uint32_t)rsbox[(s3 >> 16) & 0xff] << 16)
+			^ ((uint32_t)rsbox[(s2 >> 8) & 0xff] << 8) ^ (uint32_t)rsbox[s1 & 0xff] ^ rk[0];
+		s[1] = ((uint32_t)rsbox[s1 >> 24] << 24) ^ ((uint32_t)rsbox[(s0 >> 16) & 0xff] << 16)
+			^ ((uint32_t)rsbox[(s3 >> 8) & 0xff] << 8) ^ (uint32_t)rsbox[s2 & 0xff] ^ rk[1];
+		s[2] = ((uint32_t)rsbox[s2 >> 24] << 24) ^ ((uint32_t)rsbox[(s1 >> 16) & 0xff] << 16)
+			^ ((uint32_t)rsbox[(s0 >> 8) & 0xff] << 8) ^ (uint32_t)rsbox[s3 & 0xff] ^ rk[2];
+		s[3] = ((uint32_t)rsbox[s3 >> 24] << 24) ^ ((uint32_t)rsbox[(s2 >> 16) & 0xff] << 16)
+			^ ((uint32_t)rsbox[(s1 >> 8) & 0xff] << 8) ^ (uint32_t)rsbox[s0 & 0xff] ^ rk[3];
+	}
+
+	static void BlockLoad(uint32_t s[4], const uint8_t* input)
+	{
+		s[0] = GETU32(input);
+		s[1] = GETU32(input + 4);
+		s[2] = GETU32(input + 8);
+		s[3] = GETU32(input + 12);
+	}
+
+	static void BlockStore(uint8_t* output, const uint32_t s[4])
+	{
+		PUTU32(output, s[0]);
+		PUTU32(output + 4, s[1]);
+		PUTU32(output + 8, s[2]);
+		PUTU32(output + 12, s[3]);
+	}
+
+#if (defined(AESNI) && AESNI) || (defined(BASE64_SSSE3) && BASE64_SSSE3)
+	// Reads the feature flags of CPUID leaf 1.
+	static bool CpuidLeaf1(unsigned int* ecx, unsigned int* edx)
+	{
+#ifdef _MSC_VER
+		int info[4] = { 0 };
+		__cpuid(info, 1);
+		*ecx = info[2];
+		*edx = info[3];
+		return true;
+#else
+		unsigned int eax = 0, ebx = 0;
+		return __get_cpuid(1, &eax, &ebx, ecx, edx) != 0;
+#endif
+	}
+#endif
+
+#if defined(AESNI) && AESNI
+	// Checks CPUID for the AES and SSE2 feature bits.
+	static bool DetectAesNi()
+	{
+		unsigned int ecx = 0, edx = 0;
+		return CpuidLeaf1(&ecx, &edx) && (ecx & (1u << 25)) && (edx & (1u << 26));
+	}
+
+	// Evaluated once during static initialization.
+	static const bool HasAesNi = DetectAesNi();
+
+	// CBC encryption of whole blocks with AES-NI. Each block depends on the previous
+	// cipher text, so they can only be processed one after another.
+	AESNI_TARGET static void CBC_encrypt_aesni(const AesContext* ctx, uint8_t* output, const uint8_t* input, uintptr_t blocks, const uint8_t* iv)
+	{
+		__m128i rk[Nr + 1];
+		__m128i chain, b;
+		int round;
+
+		for (round = 0; round <= Nr; ++round)
+		{
+			rk[round] = _mm_loadu_si128((const __m128i*)(ctx->roundKeyBytes + round * KEYLEN));
+		}
+
+		chain = _mm_loadu_si128((const __m128i*)iv);
+		for (; blocks; --blocks)
+		{
+			b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)input), chain);
+			b = _mm_xor_si128(b, rk[0]);
+			for (round = 1; round < Nr; ++round)
+			{
+				b = _mm_aesenc_si128(b, rk[round]);
+			}
+			chain = _mm_aesenclast_si128(b, rk[Nr]);
+			_mm_storeu_si128((__m128i*)output, chain);
+			input += KEYLEN;
+			output += KEYLEN;
+		}
+	}
+
+	// CBC decryption of whole blocks with AES-NI. The inverse cipher of every block
+	// only needs its own cipher text, so AESNI_PARALLEL blocks are interleaved to
+	// hide the latency of AESDEC. output may alias input.
+	AESNI_TARGET static void CBC_decrypt_aesni(const AesContext* ctx, uint8_t* output, const uint8_t* input, uintptr_t blocks, const uint8_t* iv)
+	{
+		__m128i rk[Nr + 1];
+		__m128i chain, c[AESNI_PARALLEL], b[AESNI_PARALLEL];
+		int round, k;
+
+		for (round = 0; round <= Nr; ++round)
+		{
+			rk[round] = _mm_loadu_si128((const __m128i*)(ctx->invRoundKeyBytes + round * KEYLEN));
+		}
+
+		chain = _mm_loadu_si128((const __m128i*)iv);
+		for (; blocks >= AESNI_PARALLEL; blocks -= AESNI_PARALLEL)
+		{
+			for (k = 0; k < AESNI_PARALLEL; ++k)
+			{
+				c[k] = _mm_loadu_si128((const __m128i*)(input + k * KEYLEN));
+				b[k] = _mm_xor_si128(c[k], rk[0]);
+			}
+			for (round = 1; round < Nr; ++round)
+			{
+				for (k = 0; k < AESNI_PARALLEL; ++k)
+				{
+					b[k] = _mm_aesdec_si128(b[k], rk[round]);
+				}
+			}
+			for (k = 0; k < AESNI_PARALLEL; ++k)
+			{
+				b[k] = _mm_aesdeclast_si128(b[k], rk[Nr]);
+				_mm_storeu_si128((__m128i*)(output + k * KEYLEN), _mm_xor_si128(b[k], chain));
+				chain = c[k];
+			}
+			input += AESNI_PARALLEL * KEYLEN;
+			output += AESNI_PARALLEL * KEYLEN;
+		}
+
+		for (; blocks; --blocks)
+		{
+			c[0] = _mm_loadu_si128((const __m128i*)input);
+			b[0] = _mm_xor_si128(c[0], rk[0]);
+			for (round = 1; round < Nr; ++round)
+			{
+				b[0] = _mm_aesdec_si128(b[0], rk[round]);
+			}
+			b[0] = _mm_aesdeclast_si128(b[0], rk[Nr]);
+			_mm_storeu_si128((__m128i*)output, _mm_xor_si128(b[0], chain));
+			chain = c[0];
+			input += KEYLEN;
+			output += KEYLEN;
+		}
+	}
+#endif // #if defined(AESNI) && AESNI
+
+
+
+	/*****************************************************************************/
+	/* Public functions:                                                         */
+	/*****************************************************************************/
+#if defined(GCM) && GCM
+	static void GcmGenTable(AesContext* ctx);
+#endif
+
+	// Expands key into ctx and stores iv. Must run before the context is shared.
+	void AES128_init_ctx(AesContext* ctx, const uint8_t* key, const uint8_t* iv)
+	{
+		KeyExpansion(ctx, key);
+		memcpy(ctx->iv, iv, KEYLEN);
+#if defined(GCM) && GCM
+		GcmGenTable(ctx);
+#endif
+	}
+
+#if defined(ECB) && ECB
+
+	void AES128_ECB_encrypt(const AesContext* ctx, const uint8_t* input, uint8_t* output)
+	{
+		uint32_t s[4];
+
+		// The next function call encrypts the PlainText with the Key using AES algorithm.
+		BlockLoad(s, input);
+		Cipher(ctx, s);
+		BlockStore(output, s);
+	}
+
+	void AES128_ECB_decrypt(const AesContext* ctx, const uint8_t* input, uint8_t *output)
+	{
+		uint32_t s[4];
+
+		BlockLoad(s, input);
+		InvCipher(ctx, s);
+		BlockStore(output, s);
+	}
+
+#endif // #if defined(ECB) && ECB
+
+
+#if defined(CBC) && CBC
+
+	void AES128_CBC_encrypt_buffer(const AesContext* ctx, uint8_t* output, const uint8_t* input, uint32_t length)
+	{
+		uintptr_t i;
+		uint8_t remainders = length % KEYLEN; /* Remaining bytes in the last non-full block */
+		uint32_t s[4], chain[4];
+		uint8_t block[KEYLEN];
+
+#if defined(AESNI) && AESNI
+		if (HasAesNi)
+		{
+			uintptr_t blocks = length / KEYLEN;
+			const uint8_t* iv = ctx->iv;
+			CBC_encrypt_aesni(ctx, output, input, blocks, iv);
+			if (blocks)
+			{
+				iv = output + (blocks - 1) * KEYLEN;
+			}
+
+			if (remainders)
+			{
+				memcpy(block, input + blocks * KEYLEN, remainders);
+				memset(block + remainders, 0, KEYLEN - remainders); /* add 0-padding */
+				CBC_encrypt_aesni(ctx, output + blocks * KEYLEN, block, 1, iv);
+			}
+			return;
+		}
+#endif
+
+		// The chaining value stays in registers between blocks
+		BlockLoad(chain, ctx->iv);
+		for (i = KEYLEN; i <= length; i += KEYLEN)
+		{
+			BlockLoad(s, input);
+			s[0] ^= chain[0]; s[1] ^= chain[1]; s[2] ^= chain[2]; s[3] ^= chain[3];
+			Cipher(ctx, s);
+			BlockStore(output, s);
+			chain[0] = s[0]; chain[1] = s[1]; chain[2] = s[2]; chain[3] = s[3];
+			input += KEYLEN;
+			output += KEYLEN;
+		}
+
+		if (remainders)
+		{
+			memcpy(block, input, remainders);
+			memset(block + remainders, 0, KEYLEN - remainders); /* add 0-padding */
+			BlockLoad(s, block);
+			s[0] ^= chain[0]; s[1] ^= chain[1]; s[2] ^= chain[2]; s[3] ^= chain[3];
+			Cipher(ctx, s);
+			BlockStore(output, s);
+		}
+	}
+
+	void AES128_CBC_decrypt_buffer(const AesContext* ctx, uint8_t* output, const uint8_t* input, uint32_t length)
+	{
+		uintptr_t i;
+		uint8_t remainders = length % KEYLEN; /* Remaining bytes in the last non-full block */
+		uint32_t s[4], c[4], chain[4];
+
+#if defined(AESNI) && AESNI
+		if (HasAesNi)
+		{
+			uintptr_t blocks = length / KEYLEN;
+			CBC_decrypt_aesni(ctx, output, input, blocks + (remainders ? 1 : 0), ctx->iv);
+			if (remainders)
+			{
+				memset(output + length, 0, KEYLEN - remainders); /* add 0-padding */
+			}
+			return;
+		}
+#endif
+
+		// The previous cipher block is kept as words, so output may alias input
+		BlockLoad(chain, ctx->iv);
+		for (i = KEYLEN; i <= length; i += KEYLEN)
+		{
+			BlockLoad(c, input);
+			s[0] = c[0]; s[1] = c[1]; s[2] = c[2]; s[3] = c[3];
+			InvCipher(ctx, s);
+			s[0] ^= chain[0]; s[1] ^= chain[1]; s[2] ^= chain[2]; s[3] ^= chain[3];
+			BlockStore(output, s);
+			chain[0] = c[0]; chain[1] = c[1]; chain[2] = c[2]; chain[3] = c[3];
+			input += KEYLEN;
+			output += KEYLEN;
+		}
+
+		if (remainders)
+		{
+			BlockLoad(s, input);
+			InvCipher(ctx, s);
+			s[0] ^= chain[0]; s[1] ^= chain[1]; s[2] ^= chain[2]; s[3] ^= chain[3];
+			BlockStore(output, s);
+			memset(output + remainders, 0, KEYLEN - remainders); /* add 0-padding */
+		}
+	}
+
+	// Runs the CBC-AES128 vectors of NIST SP 800-38A quoted at the top of this file
+	// through both directions.
+	static bool AES128_CBC_selfTest()
+	{
+		static const uint8_t key[16] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+		static const uint8_t iv[16] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+		static const uint8_t plain[64] = {
+			0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+			0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+			0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+			0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10 };
+		static const uint8_t cipher[64] = {
+			0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46, 0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d,
+			0x50, 0x86, 0xcb, 0x9b, 0x50, 0x72, 0x19, 0xee, 0x95, 0xdb, 0x11, 0x3a, 0x91, 0x76, 0x78, 0xb2,
+			0x73, 0xbe, 0xd6, 0xb8, 0xe3, 0xc1, 0x74, 0x3b, 0x71, 0x16, 0xe6, 0x9e, 0x22, 0x22, 0x95, 0x16,
+			0x3f, 0xf1, 0xca, 0xa1, 0x68, 0x1f, 0xac, 0x09, 0x12, 0x0e, 0xca, 0x30, 0x75, 0x86, 0xe1, 0xa7 };
+
+		AesContext ctx;
+		uint8_t buffer[64];
+		AES128_init_ctx(&ctx, key, iv);
+		AES128_CBC_encrypt_buffer(&ctx, buffer, plain, sizeof(plain));
+		if (memcmp(buffer, cipher, sizeof(cipher)) != 0)
+		{
+			return false;
+		}
+
+		AES128_CBC_decrypt_buffer(&ctx, buffer, cipher, sizeof(cipher));
+		return memcmp(buffer, plain, sizeof(plain)) == 0;
+	}
+
+#endif // #if defined(CBC) && CBC
+
+#if defined(GCM) && GCM
+
+	// Large buffers are split into chunks of at least this size, one per thread.
+#define GCM_PARALLEL_CHUNK (128 * 1024)
+	// Upper bound of threads used for one buffer.
+#define GCM_PARALLEL_MAX_THREADS 8
+
+	// Reduction constants for the 4 bit GHASH tables, see gcm_gen_table() in mbed TLS
+	static const uint64_t last4[16] = {
+		0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+		0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0 };
+
+	// Precomputes the multiples of the hash subkey H = E(K, 0^128) used by GHASH.
+	static void GcmGenTable(AesContext* ctx)
+	{
+		uint32_t s[4] = { 0, 0, 0, 0 };
+		uint64_t vh, vl;
+		int i, j;
+
+		Cipher(ctx, s);
+		vh = ((uint64_t)s[0] << 32) | s[1];
+		vl = ((uint64_t)s[2] << 32) | s[3];
+
+		ctx->gcmHL[8] = vl;
+		ctx->gcmHH[8] = vh;
+		ctx->gcmHL[0] = 0;
+		ctx->gcmHH[0] = 0;
+
+		for (i = 4; i > 0; i >>= 1)
+		{
+			uint32_t T = (vl & 1) * 0xe1000000U;
+			vl = (vh << 63) | (vl >> 1);
+			vh = (vh >> 1) ^ ((uint64_t)T << 32);
+			ctx->gcmHL[i] = vl;
+			ctx->gcmHH[i] = vh;
+		}
+
+		for (i = 2; i <= 8; i *= 2)
+		{
+			vh = ctx->gcmHH[i];
+			vl = ctx->gcmHL[i];
+			for (j = 1; j < i; ++j)
+			{
+				ctx->gcmHH[i + j] = vh ^ ctx->gcmHH[j];
+				ctx->gcmHL[i + j] = vl ^ ctx->gcmHL[j];
+			}
+		}
+	}
+
+	// x = x * H in GF(2^128)
+	static void GcmMult(const AesContext* ctx, uint8_t x[16])
+	{
+		uint8_t lo, hi, rem;
+		uint64_t zh, zl;
+		int i;
+
+		lo = x[15] & 0xf;
+		zh = ctx->gcmHH[lo];
+		zl = ctx->gcmHL[lo];
+
+		for (i = 15; i >= 0; --i)
+		{
+			lo = x[i] & 0xf;
+			hi = (x[i] >> 4) & 0xf;
+
+			if (i != 15)
+			{
+				rem = (uint8_t)zl & 0xf;
+				zl = (zh << 60) | (zl >> 4);
+				zh = (zh >> 4) ^ (last4[rem] << 48);
+				zh ^= ctx->gcmHH[lo];
+				zl ^= ctx->gcmHL[lo];
+			}
+
+			rem = (uint8_t)zl & 0xf;
+			zl = (zh << 60) | (zl >> 4);
+			zh = (zh >> 4) ^ (last4[rem] << 48);
+			zh ^= ctx->gcmHH[hi];
+			zl ^= ctx->gcmHL[hi];
+		}
+
+		PUTU32(x, (uint32_t)(zh >> 32));
+		PUTU32(x + 4, (uint32_t)zh);
+		PUTU32(x + 8, (uint32_t)(zl >> 32));
+		PUTU32(x + 12, (uint32_t)zl);
+	}
+
+	// Absorbs length bytes into the running hash, zero padding the last block.
+	static void GcmHash(const AesContext* ctx, uint8_t hash[16], const uint8_t* input, uint32_t length)
+	{
+		uint32_t i, n;
+		while (length)
+		{
+			n = length < KEYLEN ? length : KEYLEN;
+			for (i = 0; i < n; ++i)
+			{
+				hash[i] ^= input[i];
+			}
+			GcmMult(ctx, hash);
+			input += n;
+			length -= n;
+		}
+	}
+
+	// The tag over aad and the cipher text, before it is masked with E(K, J0).
+	static void GcmTag(const AesContext* ctx, uint8_t hash[16], const uint8_t* aad, uint32_t aadLength, const uint8_t* cipher, uint32_t length)
+	{
+		uint8_t lengths[16];
+
+		memset(hash, 0, KEYLEN);
+		GcmHash(ctx, hash, aad, aadLength);
+		GcmHash(ctx, hash, cipher, length);
+
+		// Bit lengths of aad and cipher text as two 64 bit big-endian numbers
+		PUTU32(lengths, aadLength >> 29);
+		PUTU32(lengths + 4, aadLength << 3);
+		PUTU32(lengths + 8, length >> 29);
+		PUTU32(lengths + 12, length << 3);
+		GcmHash(ctx, hash, lengths, KEYLEN);
+	}
+
+#if defined(AESNI) && AESNI
+	// CTR keystream for whole blocks with AES-NI, AESNI_PARALLEL counters at a time.
+	AESNI_TARGET static void CTR_xcrypt_aesni(const AesContext* ctx, uint8_t* output, const uint8_t* input, uintptr_t blocks, const uint8_t* nonce, uint32_t counter)
+	{
+		__m128i rk[Nr + 1];
+		__m128i b[AESNI_PARALLEL];
+		uint8_t counterBlock[KEYLEN];
+		int round, k, n;
+
+		for (round = 0; round <= Nr; ++round)
+		{
+			rk[round] = _mm_loadu_si128((const __m128i*)(ctx->roundKeyBytes + round * KEYLEN));
+		}
+
+		memcpy(counterBlock, nonce, 12);
+		while (blocks)
+		{
+			n = blocks < AESNI_PARALLEL ? (int)blocks : AESNI_PARALLEL;
+			for (k = 0; k < n; ++k)
+			{
+				PUTU32(counterBlock + 12, counter);
+				++counter;
+				b[k] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)counterBlock), rk[0]);
+			}
+			for (round = 1; round < Nr; ++round)
+			{
+				for (k = 0; k < n; ++k)
+				{
+					b[k] = _mm_aesenc_si128(b[k], rk[round]);
+				}
+			}
+			for (k = 0; k < n; ++k)
+			{
+				b[k] = _mm_aesenclast_si128(b[k], rk[Nr]);
+				b[k] = _mm_xor_si128(b[k], _mm_loadu_si128((const __m128i*)(input + k * KEYLEN)));
+				_mm_storeu_si128((__m128i*)(output + k * KEYLEN), b[k]);
+			}
+			input += n * KEYLEN;
+			output += n * KEYLEN;
+			blocks -= n;
+		}
+	}
+#endif // #if defined(AESNI) && AESNI
+
+	// Encrypts/decrypts length bytes in CTR mode, the first block uses counter.
+	static void CTR_xcrypt(const AesContext* ctx, uint8_t* output, const uint8_t* input, uint32_t length, const uint8_t* nonce, uint32_t counter)
+	{
+		uintptr_t blocks = length / KEYLEN;
+		uint8_t remainders = length % KEYLEN;
+		uint8_t keystream[KEYLEN];
+		uint32_t s[4];
+		uint8_t i;
+
+#if defined(AESNI) && AESNI
+		if (HasAesNi)
+		{
+			CTR_xcrypt_aesni(ctx, output, input, blocks, nonce, counter);
+			input += blocks * KEYLEN;
+			output += blocks * KEYLEN;
+			counter += (uint32_t)blocks;
+			blocks = 0;
+		}
+#endif
+
+		for (; blocks; --blocks)
+		{
+			s[0] = GETU32(nonce);
+			s[1] = GETU32(nonce + 4);
+			s[2] = GETU32(nonce + 8);
+			s[3] = counter++;
+			Cipher(ctx, s);
+			BlockStore(keystream, s);
+			for (i = 0; i < KEYLEN; ++i)
+			{
+				output[i] = input[i] ^ keystream[i];
+			}
+			input += KEYLEN;
+			output += KEYLEN;
+		}
+
+		if (remainders)
+		{
+			s[0] = GETU32(nonce);
+			s[1] = GETU32(nonce + 4);
+			s[2] = GETU32(nonce + 8);
+			s[3] = counter;
+			Cipher(ctx, s);
+			BlockStore(keystream, s);
+			for (i = 0; i < remainders; ++i)
+			{
+				output[i] = input[i] ^ keystream[i];
+			}
+		}
+	}
+
+	// CTR over the whole buffer. Every block only depends on its counter, so large
+	// buffers are cut into block aligned chunks that run on their own threads.
+	static void CTR_xcrypt_parallel(const AesContext* ctx, uint8_t* output, const uint8_t* input, uint32_t length, const uint8_t* nonce, uint32_t counter,
+									WorkerPool* pool)
+	{
+		uint32_t threads = length / GCM_PARALLEL_CHUNK;
+		// The calling thread takes a chunk too
+		uint32_t available = pool ? pool->Size() + 1 : 1;
+		if (threads > available)
+		{
+			threads = available;
+		}
+		if (threads > GCM_PARALLEL_MAX_THREADS)
+		{
+			threads = GCM_PARALLEL_MAX_THREADS;
+		}
+		if (threads < 2)
+		{
+			CTR_xcrypt(ctx, output, input, length, nonce, counter);
+			return;
+		}
+
+		uint32_t chunk = (length / threads + KEYLEN - 1) / KEYLEN * KEYLEN;
+		pool->Run((length + chunk - 1) / chunk, [=](unsigned int i)
+		{
+			uint32_t offset = i * chunk;
+			uint32_t size = length - offset < chunk ? length - offset : chunk;
+			CTR_xcrypt(ctx, output + offset, input + offset, size, nonce, counter + offset / KEYLEN);
+		});
+	}
+
+	// GCM with a 96 bit nonce: J0 = nonce || 1, the data starts at counter 2.
+	// pool may be nullptr, large buffers are then encrypted on the calling thread alone.
+	void AES128_GCM_encrypt(const AesContext* ctx, uint8_t* output, const uint8_t* input, uint32_t length,
+							const uint8_t* nonce, const uint8_t* aad, uint32_t aadLength, uint8_t* tag, WorkerPool* pool = nullptr)
+	{
+		uint8_t hash[KEYLEN], mask[KEYLEN];
+		uint8_t i;
+
+		CTR_xcrypt_parallel(ctx, output, input, length, nonce, 2, pool);
+		GcmTag(ctx, hash, aad, aadLength, output, length);
+
+		memset(mask, 0, KEYLEN);
+		CTR_xcrypt(ctx, mask, mask, KEYLEN, nonce, 1);
+		for (i = 0; i < KEYLEN; ++i)
+		{
+			tag[i] = hash[i] ^ mask[i];
+		}
+	}
+
+	// Checks the tag before anything is decrypted, returns false if it does not match.
+	bool AES128_GCM_decrypt(const AesContext* ctx, uint8_t* output, const uint8_t* input, uint32_t length,
+							const uint8_t* nonce, const uint8_t* aad, uint32_t aadLength, const uint8_t* tag, WorkerPool* pool = nullptr)
+	{
+		uint8_t hash[KEYLEN], mask[KEYLEN];
+		uint8_t i, diff = 0;
+
+		GcmTag(ctx, hash, aad, aadLength, input, length);
+
+		memset(mask, 0, KEYLEN);
+		CTR_xcrypt(ctx, mask, mask, KEYLEN, nonce, 1);
+		// Constant time compare
+		for (i = 0; i < KEYLEN; ++i)
+		{
+			diff |= hash[i] ^ mask[i] ^ tag[i];
+		}
+		if (diff)
+		{
+			return false;
+		}
+
+		CTR_xcrypt_parallel(ctx, output, input, length, nonce, 2, pool);
+		return true;
+	}
+
+	// Random GCM nonces. Every user shares the key, so a nonce cannot be derived from uid/sn.
+	// std::random_device may cost a system call per value, it only seeds an AES-CTR
+	// generator here, each nonce is then one block of its output. Thread safe.
+	class NonceGenerator
+	{
+	public:
+		NonceGenerator()
+			: m_counter(0)
+		{
+			std::random_device random;
+			uint8_t key[KEYLEN], iv[KEYLEN] = { 0 };
+			for (uint8_t i = 0; i < KEYLEN; i += 4)
+			{
+				uint32_t value = random();
+				memcpy(key + i, &value, 4);
+			}
+			AES128_init_ctx(&m_ctx, key, iv);
+			m_seed[0] = random();
+			m_seed[1] = random();
+		}
+
+		void Generate(uint8_t* nonce, size_t length)
+		{
+			uint64_t counter = m_counter.fetch_add(1);
+			uint32_t s[4] = { m_seed[0], m_seed[1], (uint32_t)(counter >> 32), (uint32_t)counter };
+			uint8_t block[KEYLEN];
+			Cipher(&m_ctx, s);
+			BlockStore(block, s);
+			memcpy(nonce, block, length);
+		}
+
+	private:
+		AesContext m_ctx;
+		uint32_t m_seed[2];
+		std::atomic<uint64_t> m_counter;
+	};
+
+	void GenerateNonce(uint8_t* nonce, size_t length)
+	{
+		static NonceGenerator generator;
+		generator.Generate(nonce, length);
+	}
+
+	// Runs GCM test case 4 of "The Galois/Counter Mode of Operation" (McGrew, Viega)
+	// through both directions.
+	static bool AES128_GCM_selfTest()
+	{
+		static const uint8_t key[16] = { 0xfe, 0xff, 0xe9, 0x92, 0x86, 0x65, 0x73, 0x1c, 0x6d, 0x6a, 0x8f, 0x94, 0x67, 0x30, 0x83, 0x08 };
+		static const uint8_t nonce[12] = { 0xca, 0xfe, 0xba, 0xbe, 0xfa, 0xce, 0xdb, 0xad, 0xde, 0xca, 0xf8, 0x88 };
+		static const uint8_t aad[20] = {
+			0xfe, 0xed, 0xfa, 0xce, 0xde, 0xad, 0xbe, 0xef, 0xfe, 0xed, 0xfa, 0xce, 0xde, 0xad, 0xbe, 0xef,
+			0xab, 0xad, 0xda, 0xd2 };
+		static const uint8_t plain[60] = {
+			0xd9, 0x31, 0x32, 0x25, 0xf8, 0x84, 0x06, 0xe5, 0xa5, 0x59, 0x09, 0xc5, 0xaf, 0xf5, 0x26, 0x9a,
+			0x86, 0xa7, 0xa9, 0x53, 0x15, 0x34, 0xf7, 0xda, 0x2e, 0x4c, 0x30, 0x3d, 0x8a, 0x31, 0x8a, 0x72,
+			0x1c, 0x3c, 0x0c, 0x95, 0x95, 0x68, 0x09, 0x53, 0x2f, 0xcf, 0x0e, 0x24, 0x49, 0xa6, 0xb5, 0x25,
+			0xb1, 0x6a, 0xed, 0xf5, 0xaa, 0x0d, 0xe6, 0x57, 0xba, 0x63, 0x7b, 0x39 };
+		static const uint8_t cipher[60] = {
+			0x42, 0x83, 0x1e, 0xc2, 0x21, 0x77, 0x74, 0x24, 0x4b, 0x72, 0x21, 0xb7, 0x84, 0xd0, 0xd4, 0x9c,
+			0xe3, 0xaa, 0x21, 0x2f, 0x2c, 0x02, 0xa4, 0xe0, 0x35, 0xc1, 0x7e, 0x23, 0x29, 0xac, 0xa1, 0x2e,
+			0x21, 0xd5, 0x14, 0xb2, 0x54, 0x66, 0x93, 0x1c, 0x7d, 0x8f, 0x6a, 0x5a, 0xac, 0x84, 0xaa, 0x05,
+			0x1b, 0xa3, 0x0b, 0x39, 0x6a, 0x0a, 0xac, 0x97, 0x3d, 0x58, 0xe0, 0x91 };
+		static const uint8_t tag[16] = { 0x5b, 0xc9, 0x4f, 0xbc, 0x32, 0x21, 0xa5, 0xdb, 0x94, 0xfa, 0xe9, 0x5a, 0xe7, 0x12, 0x1a, 0x47 };
+		static const uint8_t iv[16] = { 0 };
+
+		AesContext ctx;
+		uint8_t buffer[60], result[16];
+		AES128_init_ctx(&ctx, key, iv);
+		AES128_GCM_encrypt(&ctx, buffer, plain, sizeof(plain), nonce, aad, sizeof(aad), result);
+		if (memcmp(buffer, cipher, sizeof(cipher)) != 0 || memcmp(result, tag, sizeof(tag)) != 0)
+		{
+			return false;
+		}
+
+		if (!AES128_GCM_decrypt(&ctx, buffer, cipher, sizeof(cipher), nonce, aad, sizeof(aad), tag))
+		{
+			return false;
+		}
+		return memcmp(buffer, plain, sizeof(plain)) == 0;
+	}
+
+#endif // #if defined(GCM) && GCM
+
+
+	/*****************************************************************************/
+	/* Base64:                                                                   */
+	/*****************************************************************************/
+	// Standard alphabet with '=' padding, compatible with cocos2d::base64Encode/base64Decode.
+	// Both directions write into caller provided buffers and never allocate. On x86/x64
+	// 12 input bytes <-> 16 characters are handled per step with SSSE3 (see Wojciech Mula,
+	// "Base64 encoding and decoding with SIMD instructions"), everything else is scalar.
+
+	static const char base64Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	// Character -> 6 bit value, 0xff for everything outside the alphabet
+	struct Base64DecodeTable
+	{
+		uint8_t value[256];
+
+		Base64DecodeTable()
+		{
+			memset(value, 0xff, sizeof(value));
+			for (uint8_t i = 0; i < 64; ++i)
+			{
+				value[(uint8_t)base64Alphabet[i]] = i;
+			}
+		}
+	};
+	static const Base64DecodeTable base64DecodeTable;
+
+	// Number of characters Base64Encode() writes for length bytes.
+	size_t Base64EncodedSize(size_t length)
+	{
+		return (length + 2) / 3 * 4;
+	}
+
+	// Size of the output buffer Base64Decode() needs for length characters.
+	// Includes the slack the SIMD path may store past the decoded bytes.
+	size_t Base64DecodeBufferSize(size_t length)
+	{
+		return (length + 3) / 4 * 3 + 4;
+	}
+
+#if defined(BASE64_SSSE3) && BASE64_SSSE3
+	// Checks CPUID for the SSSE3 feature bit, evaluated once during static initialization.
+	static bool DetectSsse3()
+	{
+		unsigned int ecx = 0, edx = 0;
+		return CpuidLeaf1(&ecx, &edx) && (ecx & (1u << 9));
+	}
+	static const bool HasSsse3 = DetectSsse3();
+
+	// Encodes as many whole 12 byte groups as possible, reading 16 bytes per step.
+	// Returns the number of input bytes consumed.
+	SSSE3_TARGET static size_t Base64Encode_ssse3(char* output, const uint8_t* input, size_t length)
+	{
+		const __m128i shuffle = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+		const __m128i shiftLUT = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+											   '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+											   '/' - 63, 'A', 0, 0);
+		size_t i = 0;
+
+		for (; length - i >= 16; i += 12)
+		{
+			__m128i in = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(input + i)), shuffle);
+
+			// Spread the four 6 bit fields of every 3 byte group into their own bytes
+			__m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+			__m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+			__m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+			__m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+			__m128i indices = _mm_or_si128(t1, t3);
+
+			// Map 0..63 to the alphabet by adding a per range offset
+			__m128i ranges = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+			__m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+			ranges = _mm_or_si128(ranges, _mm_and_si128(less, _mm_set1_epi8(13)));
+			__m128i result = _mm_add_epi8(_mm_shuffle_epi8(shiftLUT, ranges), indices);
+
+			_mm_storeu_si128((__m128i*)(output + i / 3 * 4), result);
+		}
+		return i;
+	}
+
+	// Decodes 16 character groups until one contains anything but alphabet characters
+	// (padding, line breaks, garbage). Stores 16 bytes per step of which 12 are valid.
+	// Returns the number of input characters consumed.
+	SSSE3_TARGET static size_t Base64Decode_ssse3(uint8_t* output, const char* input, size_t length)
+	{
+		const __m128i lutLo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+											0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+		const __m128i lutHi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+											0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+		const __m128i lutRoll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+		const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+		const __m128i nibble = _mm_set1_epi8(0x0f);
+		size_t i = 0;
+
+		for (; length - i >= 16; i += 16)
+		{
+			__m128i in = _mm_loadu_si128((const __m128i*)(input + i));
+			__m128i hi = _mm_and_si128(_mm_srli_epi32(in, 4), nibble);
+			__m128i lo = _mm_and_si128(in, nibble);
+
+			// Every character outside the alphabet has a bit in common in both tables
+			__m128i invalid = _mm_and_si128(_mm_shuffle_epi8(lutLo, lo), _mm_shuffle_epi8(lutHi, hi));
+			if (_mm_movemask_epi8(_mm_cmpgt_epi8(invalid, _mm_setzero_si128())))
+			{
+				break;
+			}
+
+			__m128i slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+			__m128i values = _mm_add_epi8(in, _mm_shuffle_epi8(lutRoll, _mm_add_epi8(slash, hi)));
+
+			// Join the 6 bit values into 3 byte groups and compact them
+			__m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+			merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+			_mm_storeu_si128((__m128i*)(output + i / 4 * 3), _mm_shuffle_epi8(merged, pack));
+		}
+		return i;
+	}
+#endif // #if defined(BASE64_SSSE3) && BASE64_SSSE3
+
+	// output must hold Base64EncodedSize(length) characters, no terminator is written.
+	// Returns the number of characters written.
+	size_t Base64Encode(char* output, const uint8_t* input, size_t length)
+	{
+		size_t i = 0;
+		char* out = output;
+
+#if defined(BASE64_SSSE3) && BASE64_SSSE3
+		if (HasSsse3)
+		{
+			i = Base64Encode_ssse3(output, input, length);
+			out += i / 3 * 4;
+		}
+#endif
+
+		for (; length - i >= 3; i += 3)
+		{
+			uint32_t v = ((uint32_t)input[i] << 16) | ((uint32_t)input[i + 1] << 8) | input[i + 2];
+			out[0] = base64Alphabet[v >> 18];
+			out[1] = base64Alphabet[(v >> 12) & 0x3f];
+			out[2] = base64Alphabet[(v >> 6) & 0x3f];
+			out[3] = base64Alphabet[v & 0x3f];
+			out += 4;
+		}
+
+		if (length - i == 1)
+		{
+			uint32_t v = (uint32_t)input[i] << 16;
+			out[0] = base64Alphabet[v >> 18];
+			out[1] = base64Alphabet[(v >> 12) & 0x3f];
+			out[2] = '=';
+			out[3] = '=';
+			out += 4;
+		}
+		else if (length - i == 2)
+		{
+			uint32_t v = ((uint32_t)input[i] << 16) | ((uint32_t)input[i + 1] << 8);
+			out[0] = base64Alphabet[v >> 18];
+			out[1] = base64Alphabet[(v >> 12) & 0x3f];
+			out[2] = base64Alphabet[(v >> 6) & 0x3f];
+			out[3] = '=';
+			out += 4;
+		}
+
+		return out - output;
+	}
+
+	// output must hold Base64DecodeBufferSize(length) bytes. Like cocos2d::base64Decode,
+	// characters outside the alphabet are skipped and '=' ends the input.
+	// Returns false if the input ends in the middle of a byte.
+	bool Base64Decode(uint8_t* output, size_t* outLength, const char* input, size_t length)
+	{
+		size_t i = 0;
+		uint8_t* out = output;
+		uint32_t bits = 0;
+		int count = 0;
+
+#if defined(BASE64_SSSE3) && BASE64_SSSE3
+		if (HasSsse3)
+		{
+			i = Base64Decode_ssse3(output, input, length);
+			out += i / 4 * 3;
+		}
+#endif
+
+		for (; i < length; ++i)
+		{
+			uint8_t c = (uint8_t)input[i];
+			if (c == '=')
+			{
+				break;
+			}
+
+			uint8_t v = base64DecodeTable.value[c];
+			if (v == 0xff)
+			{
+				continue;
+			}
+
+			bits = (bits << 6) | v;
+			if (++count == 4)
+			{
+				out[0] = (uint8_t)(bits >> 16);
+				out[1] = (uint8_t)(bits >> 8);
+				out[2] = (uint8_t)bits;
+				out += 3;
+				bits = 0;
+				count = 0;
+			}
+		}
+
+		switch (count)
+		{
+			case 1:
+				*outLength = 0;
+				return false;
+			case 2:
+				*out++ = (uint8_t)(bits >> 4);
+				break;
+			case 3:
+				*out++ = (uint8_t)(bits >> 10);
+				*out++ = (uint8_t)(bits >> 2);
+				break;
+		}
+
+		*outLength = out - output;
+		return true;
+	}
+
+	// Decodes a Data value. cocos2d::Data frees its bytes with free(), so they come from malloc()
+	bool Base64DecodeData(cocos2d::Data& data, const char* input, size_t length)
+	{
+		auto output = (uint8_t*)malloc(Base64DecodeBufferSize(length));
+		size_t outLength = 0;
+		if (!Base64Decode(output, &outLength, input, length))
+		{
+			free(output);
+			return false;
+		}
+		data.fastSet(output, outLength);
+		return true;
+	}
+
+
+	/*****************************************************************************/
+	/* Form encoding:                                                            */
+	/*****************************************************************************/
+	// application/x-www-form-urlencoded as browsers do it: alphanumerics and "*-._" are kept,
+	// space becomes '+', every other byte becomes %XX. Base64 output therefore has its '+',
+	// '/' and '=' escaped.
+
+	// Byte -> its encoding (1 or 3 characters). Each entry is 4 bytes so one load gets both
+	// the characters and the length; three characters are always copied and the output
+	// advances by length, so the encoder has no branches.
+	struct FormEncodeEntry
+	{
+		char code[3];
+		uint8_t length;
+	};
+
+	struct FormEncodeTable
+	{
+		FormEncodeEntry entry[256];
+
+		FormEncodeTable()
+		{
+			static const char hex[] = "0123456789ABCDEF";
+			for (int c = 0; c < 256; ++c)
+			{
+				FormEncodeEntry& e = entry[c];
+				if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')
+					|| c == '*' || c == '-' || c == '.' || c == '_')
+				{
+					e.code[0] = (char)c;
+					e.code[1] = e.code[2] = 0;
+					e.length = 1;
+				}
+				else if (c == ' ')
+				{
+					e.code[0] = '+';
+					e.code[1] = e.code[2] = 0;
+					e.length = 1;
+				}
+				else
+				{
+					e.code[0] = '%';
+					e.code[1] = hex[c >> 4];
+					e.code[2] = hex[c & 0x0f];
+					e.length = 3;
+				}
+			}
+		}
+	};
+	static const FormEncodeTable formEncode;
+
+	// Worst case number of characters FormEncode() writes for length bytes.
+	size_t FormEncodedMaxSize(size_t length)
+	{
+		return length * 3;
+	}
+
+	// output must hold FormEncodedMaxSize(length) characters, no terminator is written.
+	// Returns the number of characters written.
+	size_t FormEncode(char* output, const char* input, size_t length)
+	{
+		char* out = output;
+		for (size_t i = 0; i < length; ++i)
+		{
+			const FormEncodeEntry& e = formEncode.entry[(uint8_t)input[i]];
+			memcpy(out, e.code, 3);
+			out += e.length;
+		}
+		return out - output;
+	}
+
+
+	/*****************************************************************************/
+	/* LZ4:                                                                      */
+	/*****************************************************************************/
+	// LZ4 block format (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md), so any
+	// LZ4 implementation can read what Lz4Compress() writes. Greedy single pass with a 4 byte
+	// hash table like LZ4_compress_fast(), saves are mostly JSON with long repeated keys.
+
+	#define LZ4_HASHLOG 12
+	#define LZ4_MINMATCH 4
+	#define LZ4_LASTLITERALS 5 // the last 5 bytes are always literals
+	#define LZ4_MFLIMIT 12 // the last match must start at least 12 bytes before the end
+	#define LZ4_MAXOFFSET 65535
+
+	static inline uint32_t Lz4Read32(const uint8_t* p)
+	{
+		uint32_t v;
+		memcpy(&v, p, 4);
+		return v;
+	}
+
+	static inline uint32_t Lz4Hash(uint32_t sequence)
+	{
+		return (sequence * 2654435761u) >> (32 - LZ4_HASHLOG);
+	}
+
+	// Writes 255 bytes until the rest of length fits into one byte
+	static inline uint8_t* Lz4WriteLength(uint8_t* op, size_t length)
+	{
+		for (; length >= 255; length -= 255)
+		{
+			*op++ = 255;
+		}
+		*op++ = (uint8_t)length;
+		return op;
+	}
+
+	static uint8_t* Lz4WriteSequence(uint8_t* op, const uint8_t* literals, size_t literalLength,
+									 size_t offset, size_t matchLength)
+	{
+		uint8_t* token = op++;
+		*token = (uint8_t)((literalLength < 15 ? literalLength : 15) << 4);
+		if (literalLength >= 15)
+		{
+			op = Lz4WriteLength(op, literalLength - 15);
+		}
+		memcpy(op, literals, literalLength);
+		op += literalLength;
+
+		if (matchLength)
+		{
+			*op++ = (uint8_t)offset;
+			*op++ = (uint8_t)(offset >> 8);
+			matchLength -= LZ4_MINMATCH;
+			*token |= (uint8_t)(matchLength < 15 ? matchLength : 15);
+			if (matchLength >= 15)
+			{
+				op = Lz4WriteLength(op, matchLength - 15);
+			}
+		}
+		return op;
+	}
+
+	// Worst case size of Lz4Compress() output for length input bytes.
+	size_t Lz4CompressBound(size_t length)
+	{
+		return length + length / 255 + 16;
+	}
+
+	// output must hold Lz4CompressBound(length) bytes. Returns the compressed size.
+	size_t Lz4Compress(uint8_t* output, const uint8_t* input, size_t length)
+	{
+		uint8_t* op = output;
+		size_t anchor = 0;
+
+		if (length > LZ4_MFLIMIT)
+		{
+			uint32_t table[1 << LZ4_HASHLOG];
+			memset(table, 0, sizeof(table));
+
+			size_t matchLimit = length - LZ4_LASTLITERALS;
+			size_t mfLimit = length - LZ4_MFLIMIT;
+			size_t ip = 1;
+			size_t misses = 0;
+			while (ip < mfLimit)
+			{
+				uint32_t sequence = Lz4Read32(input + ip);
+				uint32_t h = Lz4Hash(sequence);
+				size_t ref = table[h];
+				table[h] = (uint32_t)ip;
+
+				if (ip - ref > LZ4_MAXOFFSET || Lz4Read32(input + ref) != sequence)
+				{
+					// Skip faster through data that does not compress
+					ip += 1 + (misses++ >> 6);
+					continue;
+				}
+				misses = 0;
+
+				// Extend backwards over literals, then forwards
+				while (ip > anchor && ref > 0 && input[ip - 1] == input[ref - 1])
+				{
+					--ip;
+					--ref;
+				}
+				size_t matchLength = LZ4_MINMATCH;
+				while (ip + matchLength < matchLimit && input[ref + matchLength] == input[ip + matchLength])
+				{
+					++matchLength;
+				}
+
+				op = Lz4WriteSequence(op, input + anchor, ip - anchor, ip - ref, matchLength);
+				ip += matchLength;
+				anchor = ip;
+
+				if (ip < mfLimit)
+				{
+					table[Lz4Hash(Lz4Read32(input + ip - 2))] = (uint32_t)(ip - 2);
+				}
+			}
+		}
+
+		op = Lz4WriteSequence(op, input + anchor, length - anchor, 0, 0);
+		return op - output;
+	}
+
+	// Decompresses exactly outputLength bytes. Every read and write is bounds checked,
+	// returns false for malformed input.
+	bool Lz4Decompress(uint8_t* output, size_t outputLength, const uint8_t* input, size_t inputLength)
+	{
+		size_t ip = 0;
+		size_t op = 0;
+
+		while (ip < inputLength)
+		{
+			uint8_t token = input[ip++];
+
+			size_t literalLength = token >> 4;
+			if (literalLength == 15)
+			{
+				uint8_t b;
+				do
+				{
+					if (ip >= inputLength)
+					{
+						return false;
+					}
+					b = input[ip++];
+					literalLength += b;
+				} while (b == 255);
+			}
+			if (literalLength > inputLength - ip || literalLength > outputLength - op)
+			{
+				return false;
+			}
+			memcpy(output + op, input + ip, literalLength);
+			ip += literalLength;
+			op += literalLength;
+
+			// The last sequence has no match
+			if (ip == inputLength)
+			{
+				break;
+			}
+
+			if (inputLength - ip < 2)
+			{
+				return false;
+			}
+			size_t offset = input[ip] | ((size_t)input[ip + 1] << 8);
+			ip += 2;
+			if (offset == 0 || offset > op)
+			{
+				return false;
+			}
+
+			size_t matchLength = token & 15;
+			if (matchLength == 15)
+			{
+				uint8_t b;
+				do
+				{
+					if (ip >= inputLength)
+					{
+						return false;
+					}
+					b = input[ip++];
+					matchLength += b;
+				} while (b == 255);
+			}
+			matchLength += LZ4_MINMATCH;
+			if (matchLength > outputLength - op)
+			{
+				return false;
+			}
+
+			// Matches may overlap their own output
+			const uint8_t* match = output + op - offset;
+			uint8_t* out = output + op;
+			if (offset >= matchLength)
+			{
+				memcpy(out, match, matchLength);
+			}
+			else
+			{
+				for (size_t i = 0; i < matchLength; ++i)
+				{
+					out[i] = match[i];
+				}
+			}
+			op += matchLength;
+		}
+
+		return op == outputLength;
+	}
+
+	// Replaces buffer[offset, end) with its raw length (big-endian 32 bit) followed by the
+	// LZ4 block. scratch is reused as the output and swapped into buffer.
+	void Lz4CompressBuffer(std::string& buffer, size_t offset, std::string& scratch)
+	{
+		size_t length = buffer.size() - offset;
+		scratch.resize(offset + 4 + Lz4CompressBound(length));
+		auto out = (uint8_t*)&scratch[offset];
+		out[0] = (uint8_t)(length >> 24);
+		out[1] = (uint8_t)(length >> 16);
+		out[2] = (uint8_t)(length >> 8);
+		out[3] = (uint8_t)length;
+		auto size = Lz4Compress(out + 4, (const uint8_t*)buffer.data() + offset, length);
+		scratch.resize(offset + 4 + size);
+		buffer.swap(scratch);
+	}
+} // namespace
+
+
+// PF_GCM格式的save_data（base64之前）：
+// "RS" 0x02 flags | nonce[12] | 明文长度（大端32位） | 密文 | tag[16]
+// 头部20字节作为附加数据参与校验
+// flags为PayloadFlagLz4时，明文是 原始长度（大端32位） | LZ4块
+static const unsigned char PayloadMagic[3] = { 'R', 'S', 0x02 };
+static const unsigned char PayloadFlagLz4 = 0x01;
+static const size_t PayloadNonceSize = 12;
+static const size_t PayloadHeaderSize = sizeof(PayloadMagic) + 1 + PayloadNonceSize + 4;
+// 解压时允许的最大原始长度，防止错误的长度分配过多内存
+static const size_t PayloadMaxPlainSize = 256 * 1024 * 1024;
+static const size_t PayloadTagSize = 16;
+
+const std::string RemoteSaveSession::NullString = "";
+const std::string RemoteSaveSession::AutoSaveScheduleKey = "RemoteSave::updateAutoSave";
+const std::string RemoteSaveSession::DeltaRejected = "SN_MISMATCH";
+const std::string RemoteSaveSession::RetryLoadScheduleKey = "RemoteSave::retryLoad";
+const std::string RemoteSaveSession::RetrySaveScheduleKey = "RemoteSave::retrySave";
+const std::string RemoteSaveSession::PublishScheduleKey = "RemoteSave::publishReads";
+RemoteSave* RemoteSave::m_instance = nullptr;
+
+RemoteSaveSession::Context::Context(unsigned int threads /* = 0 */)
+	: m_workerPool(new WorkerPool(threads))
+	, m_metrics(new MetricsRecorder)
+{
+}
+
+RemoteSaveSession::Context::~Context()
+{
+	delete m_workerPool;
+	delete m_metrics;
+}
+
+const std::shared_ptr<RemoteSaveTransport> &RemoteSaveSession::Context::getTransport()
+{
+	if (!m_transport)
+	{
+		m_transport = RemoteSaveTransport::createDefault();
+	}
+	return m_transport;
+}
+
+std::shared_ptr<const RemoteSaveSession::AesContext> RemoteSaveSession::Context::getAesContext(const std::string &key, const std::string &iv)
+{
+	auto id = key.substr(0, 16) + iv.substr(0, 16);
+	auto &entry = m_aesContexts[id];
+	auto aesContext = entry.lock();
+	if (aesContext)
+	{
+		return aesContext;
+	}
+
+	// 密钥只在这里展开一次，之后encode()/decode()只读取
+	auto expanded = std::make_shared<AesContext>();
+	__RemoveSave_private::AES128_init_ctx(expanded.get(), (const uint8_t*)key.c_str(), (const uint8_t*)iv.c_str());
+	entry = expanded;
+
+	// 顺便清理不再使用的密钥
+	for (auto it = m_aesContexts.begin(); it != m_aesContexts.end(); )
+	{
+		it = it->second.expired() ? m_aesContexts.erase(it) : ++it;
+	}
+	return expanded;
+}
+
+RemoteSaveSession::RemoteSaveSession(const std::shared_ptr<Context> &context /* = nullptr */)
+	: m_context(context ? context : std::make_shared<Context>())
+	, m_alive(std::make_shared<bool>(true))
+	, m_generation(0)
+	, m_inited(false)
+	, m_saveOnGetDefault(false)
+	, m_saveOnChangeValue(false)
+	, m_cbOnLoad(nullptr)
+	, m_cbOnSave(nullptr)
+	, m_sn(0)
+	, m_aesContext(nullptr)
+	, m_payloadFormat(PF_CBC)
+	, m_jsonAllocator(new JsonAllocator)
+	, m_jsonDoc(m_jsonAllocator.get())
+	, m_keyIndex(nullptr)
+	, m_allocatorGarbage(0)
+	, m_compactRatio(0.5f)
+	, m_keyLayout(0)
+	, m_saveQuietPeriod(0.f)
+	, m_saveMaxDelay(0.f)
+	, m_saveDirty(false)
+	, m_saveQuietElapsed(0.f)
+	, m_saveDirtyElapsed(0.f)
+	, m_batchDepth(0)
+	, m_batchPending(false)
+	, m_retryMaxAttempts(4)
+	, m_retryBaseDelay(1.f)
+	, m_retryMaxDelay(30.f)
+	, m_loadAttempts(0)
+	, m_saveAttempts(0)
+	, m_loadSentAt(0)
+	, m_saveSentAt(0)
+	, m_saveMode(SM_FULL)
+	, m_fullSaveInterval(20)
+	, m_deltaSaveCount(0)
+	, m_ackedSn(0)
+	, m_fullSaveRequired(true)
+	, m_saveInFlight(false)
+	, m_savePending(false)
+	, m_journal(nullptr)
+	, m_instantStart(false)
+	, m_serverLoaded(false)
+	, m_backgroundSave(true)
+	, m_readSnapshotDirty(false)
+	, m_metrics(m_context->m_metrics)
+{
+}
+
+RemoteSaveSession::~RemoteSaveSession()
+{
+	release();
+}
+
+bool RemoteSaveSession::getBoolForKey(const char *pKey, bool defaultValue /* = false */)
+{
+	if (!m_inited)
+	{
+		return defaultValue;
+	}
+
+	if (!pKey || !(*pKey))
+	{
+		return defaultValue;
+	}
+
+	auto pNode = findValue(pKey);
+	if (pNode)
+	{
+		auto &node = *pNode;
+		if (node.IsBool())
+		{
+			return node.GetBool();
+		}
+	}
+
+	if (waitingForServer())
+	{
+		return defaultValue;
+	}
+
+	rapidjson::Value jsonValue(defaultValue);
+	setValue(pKey, jsonValue);
+	saveOnGetDefault();
+
+	return defaultValue;
+}
+
+int RemoteSaveSession::getIntegerForKey(const char *pKey, int defaultValue /* = 0 */)
+{
+	if (!m_inited)
+	{
+		return defaultValue;
+	}
+
+	if (!pKey || !(*pKey))
+	{
+		return defaultValue;
+	}
+
+	auto pNode = findValue(pKey);
+	if (pNode)
+	{
+		auto &node = *pNode;
+		if (node.IsInt())
+		{
+			return node.GetInt();
+		}
+	}
+
+	if (waitingForServer())
+	{
+		return defaultValue;
+	}
+
+	rapidjson::Value jsonValue(defaultValue);
+	setValue(pKey, jsonValue);
+	saveOnGetDefault();
+
+	return defaultValue;
+}
+
+float RemoteSaveSession::getFloatForKey(const char *pKey, float defaultValue /* = 0.f */)
+{
+	if (!m_inited)
+	{
+		return defaultValue;
+	}
+
+	if (!pKey || !(*pKey))
+	{
+		return defaultValue;
+	}
+
+	auto pNode = findValue(pKey);
+	if (pNode)
+	{
+		auto &node = *pNode;
+		if (node.IsDouble())
+		{
+			return node.GetDouble();
+		}
+	}
+
+	if (waitingForServer())
+	{
+		return defaultValue;
+	}
+
+	rapidjson::Value jsonValue(defaultValue);
+	setValue(pKey, jsonValue);
+	saveOnGetDefault();
+
+	return defaultValue;
+}
+
+double RemoteSaveSession::getDoubleForKey(const char *pKey, double defaultValue /* = 0. */)
+{
+	if (!m_inited)
+	{
+		return defaultValue;
+	}
+
+	if (!pKey || !(*pKey))
+	{
+		return defaultValue;
+	}
+
+	auto pNode = findValue(pKey);
+	if (pNode)
+	{
+		auto &node = *pNode;
+		if (node.IsDouble())
+		{
+			return node.GetDouble();
+		}
+	}
+
+	if (waitingForServer())
+	{
+		return defaultValue;
+	}
+
+	rapidjson::Value jsonValue(defaultValue);
+	setValue(pKey, jsonValue);
+	saveOnGetDefault();
+
+	return defaultValue;
+}
+
+std::string RemoteSaveSession::getStringForKey(const char *pKey, const std::string &defaultValue /* = RemoteSaveSession::NullString */)
+{
+	if (!m_inited)
+	{
+		return defaultValue;
+	}
+
+	if (!pKey || !(*pKey))
+	{
+		return defaultValue;
+	}
+
+	auto pNode = findValue(pKey);
+	if (pNode)
+	{
+		auto &node = *pNode;
+		if (node.IsString())
+		{
+			auto str = node.GetString();
+			auto len = node.GetStringLength();
+			std::string ret(str, len);
+			return ret;
+		}
+	}
+
+	if (waitingForServer())
+	{
+		return defaultValue;
+	}
+
+	rapidjson::Document::AllocatorType &allocator = m_jsonDoc.GetAllocator();
+
+	rapidjson::Value jsonValue;
+	jsonValue.SetString(defaultValue.c_str(), defaultValue.size(), allocator);
+
+	setValue(pKey, jsonValue);
+	saveOnGetDefault();
+
+	return defaultValue;
+}
+
+cocos2d::Data RemoteSaveSession::getDataForKey(const char *pKey, const cocos2d::Data &defaultValue /* = cocos2d::Data::Null */)
+{
+	if (!m_inited)
+	{
+		return defaultValue;
+	}
+
+	if (!pKey || !(*pKey))
+	{
+		return defaultValue;
+	}
+
+	auto pNode = findValue(pKey);
+	if (pNode)
+	{
+		auto &node = *pNode;
+		cocos2d::Data ret;
+		if (node.IsString() && __RemoveSave_private::Base64DecodeData(ret, node.GetString(), node.GetStringLength()))
+		{
+			return ret;
+		}
+	}
+
+	if (waitingForServer())
+	{
+		return defaultValue;
+	}
+
+	auto &encodedData = m_base64Buffer;
+	encodedData.resize(__RemoveSave_private::Base64EncodedSize(defaultValue.getSize()));
+	auto encodedDataLen = __RemoveSave_private::Base64Encode(&encodedData[0], defaultValue.getBytes(), defaultValue.getSize());
+
+	rapidjson::Document::AllocatorType &allocator = m_jsonDoc.GetAllocator();
+
+	rapidjson::Value jsonValue;
+	jsonValue.SetString(encodedData.data(), encodedDataLen, allocator);
+
+	setValue(pKey, jsonValue);
+	saveOnGetDefault();
+
+	return defaultValue;
+}
+
+void RemoteSaveSession::setBoolForKey(const char *pKey, bool value)
+{
+	if (!m_inited)
+	{
+		return;
+	}
+
+	if (!pKey || !(*pKey))
+	{
+		return;
+	}
+
+	auto pNode = findValue(pKey);
+	if (pNode)
+	{
+		auto &node = *pNode;
+		if (node.IsBool())
+		{
+			auto curValue = node.GetBool();
+			if (curValue == value)
+			{
+				return;
+			}
+		}
+	}
+
+	rapidjson::Value jsonValue(value);
+	setValue(pKey, jsonValue);
+	saveOnChangeValue();
+}
+
+void RemoteSaveSession::setIntegerForKey(const char *pKey, int value)
+{
+	if (!m_inited)
+	{
+		return;
+	}
+
+	if (!pKey || !(*pKey))
+	{
+		return;
+	}
+
+	auto pNode = findValue(pKey);
+	if (pNode)
+	{
+		auto &node = *pNode;
+		if (node.IsInt())
+		{
+			auto curValue = node.GetInt();
+			if (curValue == value)
+			{
+				return;
+			}
+		}
+	}
+
+	rapidjson::Value jsonValue(value);
+	setValue(pKey, jsonValue);
+	saveOnChangeValue();
+}
+
+void RemoteSaveSession::setFloatForKey(const char *pKey, float value)
+{
+	if (!m_inited)
+	{
+		return;
+	}
+
+	if (!pKey || !(*pKey))
+	{
+		return;
+	}
+
+	auto pNode = findValue(pKey);
+	if (pNode)
+	{
+		auto &node = *pNode;
+		if (node.IsDouble())
+		{
+			auto curValue = node.GetDouble();
+			if (curValue == value)
+			{
+				return;
+			}
+		}
+	}
+
+	rapidjson::Value jsonValue(value);
+	setValue(pKey, jsonValue);
+	saveOnChangeValue();
+}
+
+void RemoteSaveSession::setDoubleForKey(const char *pKey, double value)
+{
+	if (!m_inited)
+	{
+		return;
+	}
+
+	if (!pKey || !(*pKey))
+	{
+		return;
+	}
+
+	auto pNode = findValue(pKey);
+	if (pNode)
+	{
+		auto &node = *pNode;
+		if (node.IsDouble())
+		{
+			auto curValue = node.GetDouble();
+			if (curValue == value)
+			{
+				return;
+			}
+		}
+	}
+
+	rapidjson::Value jsonValue(value);
+	setValue(pKey, jsonValue);
+	saveOnChangeValue();
+}
+
+void RemoteSaveSession::setStringForKey(const char *pKey, const std::string &value)
+{
+	if (!m_inited)
+	{
+		return;
+	}
+
+	if (!pKey || !(*pKey))
+	{
+		return;
+	}
+
+	auto pNode = findValue(pKey);
+	if (pNode)
+	{
+		auto &node = *pNode;
+		if (node.IsString())
+		{
+			auto str = node.GetString();
+			auto len = node.GetStringLength();
+			std::string curValue(str, len);
+			if (curValue == value)
+			{
+				return;
+			}
+		}
+	}
+
+	rapidjson::Document::AllocatorType &allocator = m_jsonDoc.GetAllocator();
+
+	rapidjson::Value jsonValue;
+	jsonValue.SetString(value.data(), value.size(), allocator);
+
+	setValue(pKey, jsonValue);
+	saveOnChangeValue();
+}
+
+void RemoteSaveSession::setDataForKey(const char *pKey, const cocos2d::Data &value)
+{
+	if (!m_inited)
+	{
+		return;
+	}
+
+	if (!pKey || !(*pKey))
+	{
+		return;
+	}
+
+	// 编码结果是唯一的，直接比较编码后的字符串，省去一次解码
+	auto &encodedData = m_base64Buffer;
+	encodedData.resize(__RemoveSave_private::Base64EncodedSize(value.getSize()));
+	auto encodedDataLen = __RemoveSave_private::Base64Encode(&encodedData[0], value.getBytes(), value.getSize());
+
+	auto pNode = findValue(pKey);
+	if (pNode)
+	{
+		auto &node = *pNode;
+		if (node.IsString())
+		{
+			auto str = node.GetString();
+			auto len = node.GetStringLength();
+			if (len == encodedDataLen && memcmp(str, encodedData.data(), len) == 0)
+			{
+				return;
+			}
+		}
+	}
+
+	rapidjson::Document::AllocatorType &allocator = m_jsonDoc.GetAllocator();
+
+	rapidjson::Value jsonValue;
+	jsonValue.SetString(encodedData.data(), encodedDataLen, allocator);
+
+	setValue(pKey, jsonValue);
+	saveOnChangeValue();
+}
+
+void RemoteSaveSession::deleteValueForKey(const char *pKey)
+{
+	if (!m_inited)
+	{
+		return;
+	}
+
+	if (!pKey || !(*pKey) || !m_jsonDoc.IsObject())
+	{
+		return;
+	}
+
+	if (!eraseValue(pKey))
+	{
+		return;
+	}
+
+	auto length = strlen(pKey);
+	m_removedKeys.push_back(std::string(pKey, length));
+	journalChange(pKey, length, nullptr);
+	saveOnChangeValue();
+}
+
+RemoteSaveSession::KeyHandle RemoteSaveSession::resolveKey(const char *pKey, KeyType type)
+{
+	KeyHandle handle;
+	if (!pKey || !(*pKey))
+	{
+		return handle;
+	}
+
+	auto result = m_keyHandleIds.insert(std::make_pair(std::string(pKey), (unsigned int)m_keyHandles.size()));
+	if (result.second)
+	{
+		// 第一次访问时再查找位置
+		KeyHandleEntry entry = { result.first->first, KeyIndex::Hash(pKey, strlen(pKey)), KeyIndex::EmptySlot, m_keyLayout };
+		m_keyHandles.push_back(entry);
+	}
+	handle.id = result.first->second;
+	handle.type = type;
+	return handle;
+}
+
+rapidjson::Value *RemoteSaveSession::findValue(KeyHandle handle, KeyType type)
+{
+	CCASSERT(!handle.isValid() || handle.type == type, "key handle resolved for another type");
+	// COCOS2D_DEBUG为0时CCASSERT为空，type没有用到
+	(void)type;
+	if (!m_inited || !handle.isValid() || !m_jsonDoc.IsObject())
+	{
+		return nullptr;
+	}
+
+	auto &entry = m_keyHandles[handle.id];
+	if (entry.member == KeyIndex::EmptySlot || entry.layout != m_keyLayout)
+	{
+		// 哈希已经算好，只需要比较一次键名
+		entry.member = m_keyIndex->Find(m_jsonDoc, entry.key.data(), entry.key.size(), entry.hash)->member;
+		entry.layout = m_keyLayout;
+		if (entry.member == KeyIndex::EmptySlot)
+		{
+			return nullptr;
+		}
+	}
+	return &(m_jsonDoc.MemberBegin() + entry.member)->value;
+}
+
+void RemoteSaveSession::setValue(KeyHandle handle, rapidjson::Value &value)
+{
+	auto &entry = m_keyHandles[handle.id];
+	replaceValue(entry.member, entry.key.c_str(), entry.key.size(), value);
+}
+
+const char *RemoteSaveSession::getKeyName(KeyHandle handle) const
+{
+	return handle.isValid() ? m_keyHandles[handle.id].key.c_str() : nullptr;
+}
+
+// 用句柄读写时只处理已有的键，没有这个键或者类型不对时交给用键名的方法，写入默认值等行为和它相同
+
+bool RemoteSaveSession::getBoolForKey(KeyHandle handle, bool defaultValue /* = false */)
+{
+	auto pNode = findValue(handle, KT_BOOL);
+	if (pNode && pNode->IsBool())
+	{
+		return pNode->GetBool();
+	}
+	return getBoolForKey(getKeyName(handle), defaultValue);
+}
+
+int RemoteSaveSession::getIntegerForKey(KeyHandle handle, int defaultValue /* = 0 */)
+{
+	auto pNode = findValue(handle, KT_INT);
+	if (pNode && pNode->IsInt())
+	{
+		return pNode->GetInt();
+	}
+	return getIntegerForKey(getKeyName(handle), defaultValue);
+}
+
+float RemoteSaveSession::getFloatForKey(KeyHandle handle, float defaultValue /* = 0.f */)
+{
+	auto pNode = findValue(handle, KT_FLOAT);
+	if (pNode && pNode->IsDouble())
+	{
+		return (float)pNode->GetDouble();
+	}
+	return getFloatForKey(getKeyName(handle), defaultValue);
+}
+
+double RemoteSaveSession::getDoubleForKey(KeyHandle handle, double defaultValue /* = 0. */)
+{
+	auto pNode = findValue(handle, KT_DOUBLE);
+	if (pNode && pNode->IsDouble())
+	{
+		return pNode->GetDouble();
+	}
+	return getDoubleForKey(getKeyName(handle), defaultValue);
+}
+
+std::string RemoteSaveSession::getStringForKey(KeyHandle handle, const std::string &defaultValue /* = RemoteSaveSession::NullString */)
+{
+	auto pNode = findValue(handle, KT_STRING);
+	if (pNode && pNode->IsString())
+	{
+		return std::string(pNode->GetString(), pNode->GetStringLength());
+	}
+	return getStringForKey(getKeyName(handle), defaultValue);
+}
+
+cocos2d::Data RemoteSaveSession::getDataForKey(KeyHandle handle, const cocos2d::Data &defaultValue /* = cocos2d::Data::Null */)
+{
+	auto pNode = findValue(handle, KT_DATA);
+	cocos2d::Data ret;
+	if (pNode && pNode->IsString() && __RemoveSave_private::Base64DecodeData(ret, pNode->GetString(), pNode->GetStringLength()))
+	{
+		return ret;
+	}
+	return getDataForKey(getKeyName(handle), defaultValue);
+}
+
+void RemoteSaveSession::setBoolForKey(KeyHandle handle, bool value)
+{
+	auto pNode = findValue(handle, KT_BOOL);
+	if (!pNode)
+	{
+		setBoolForKey(getKeyName(handle), value);
+		return;
+	}
+
+	if (pNode->IsBool() && pNode->GetBool() == value)
+	{
+		return;
+	}
+
+	rapidjson::Value jsonValue(value);
+	setValue(handle, jsonValue);
+	saveOnChangeValue();
+}
+
+void RemoteSaveSession::setIntegerForKey(KeyHandle handle, int value)
+{
+	auto pNode = findValue(handle, KT_INT);
+	if (!pNode)
+	{
+		setIntegerForKey(getKeyName(handle), value);
+		return;
+	}
+
+	if (pNode->IsInt() && pNode->GetInt() == value)
+	{
+		return;
+	}
+
+	rapidjson::Value jsonValue(value);
+	setValue(handle, jsonValue);
+	saveOnChangeValue();
+}
+
+void RemoteSaveSession::setFloatForKey(KeyHandle handle, float value)
+{
+	auto pNode = findValue(handle, KT_FLOAT);
+	if (!pNode)
+	{
+		setFloatForKey(getKeyName(handle), value);
+		return;
+	}
+
+	if (pNode->IsDouble() && pNode->GetDouble() == value)
+	{
+		return;
+	}
+
+	rapidjson::Value jsonValue(value);
+	setValue(handle, jsonValue);
+	saveOnChangeValue();
+}
+
+void RemoteSaveSession::setDoubleForKey(KeyHandle handle, double value)
+{
+	auto pNode = findValue(handle, KT_DOUBLE);
+	if (!pNode)
+	{
+		setDoubleForKey(getKeyName(handle), value);
+		return;
+	}
+
+	if (pNode->IsDouble() && pNode->GetDouble() == value)
+	{
+		return;
+	}
+
+	rapidjson::Value jsonValue(value);
+	setValue(handle, jsonValue);
+	saveOnChangeValue();
+}
+
+void RemoteSaveSession::setStringForKey(KeyHandle handle, const std::string &value)
+{
+	auto pNode = findValue(handle, KT_STRING);
+	if (!pNode)
+	{
+		setStringForKey(getKeyName(handle), value);
+		return;
+	}
+
+	if (pNode->IsString() && pNode->GetStringLength() == value.size() && memcmp(pNode->GetString(), value.data(), value.size()) == 0)
+	{
+		return;
+	}
+
+	rapidjson::Value jsonValue;
+	jsonValue.SetString(value.data(), value.size(), m_jsonDoc.GetAllocator());
+	setValue(handle, jsonValue);
+	saveOnChangeValue();
+}
+
+void RemoteSaveSession::setDataForKey(KeyHandle handle, const cocos2d::Data &value)
+{
+	auto pNode = findValue(handle, KT_DATA);
+	if (!pNode)
+	{
+		setDataForKey(getKeyName(handle), value);
+		return;
+	}
+
+	auto &encodedData = m_base64Buffer;
+	encodedData.resize(__RemoveSave_private::Base64EncodedSize(value.getSize()));
+	auto encodedDataLen = __RemoveSave_private::Base64Encode(&encodedData[0], value.getBytes(), value.getSize());
+	if (pNode->IsString() && pNode->GetStringLength() == encodedDataLen && memcmp(pNode->GetString(), encodedData.data(), encodedDataLen) == 0)
+	{
+		return;
+	}
+
+	rapidjson::Value jsonValue;
+	jsonValue.SetString(encodedData.data(), encodedDataLen, m_jsonDoc.GetAllocator());
+	setValue(handle, jsonValue);
+	saveOnChangeValue();
+}
+
+bool RemoteSaveSession::eraseValue(const char *pKey)
+{
+	auto length = strlen(pKey);
+	auto slot = m_keyIndex->Find(m_jsonDoc, pKey, length, KeyIndex::Hash(pKey, length));
+	if (slot->member == KeyIndex::EmptySlot)
+	{
+		return false;
+	}
+	markReadSnapshotDirty();
+	++m_keyLayout;
+
+	// RemoveMember()把最后一个成员移到被删除的位置，索引和修改标记跟着移动
+	uint32_t member = slot->member;
+	uint32_t last = m_jsonDoc.MemberCount() - 1;
+	auto target = m_jsonDoc.MemberBegin() + member;
+	if (member != last)
+	{
+		auto &lastName = (m_jsonDoc.MemberBegin() + last)->name;
+		auto lastHash = KeyIndex::Hash(lastName.GetString(), lastName.GetStringLength());
+		m_keyIndex->Find(m_jsonDoc, lastName.GetString(), lastName.GetStringLength(), lastHash)->member = member;
+		m_keyIndex->dirty[member] = m_keyIndex->dirty[last];
+	}
+	m_keyIndex->dirty.pop_back();
+	m_keyIndex->Erase(slot);
+
+	m_allocatorGarbage += getPoolSize(target->name) + getPoolSize(target->value);
+	m_jsonDoc.RemoveMember(target);
+	// 只删除不覆盖时垃圾同样会积累
+	compactAllocator();
+	return true;
+}
+
+rapidjson::Value *RemoteSaveSession::findValue(const char *pKey)
+{
+	if (!m_jsonDoc.IsObject())
+	{
+		return nullptr;
+	}
+
+	auto length = strlen(pKey);
+	auto slot = m_keyIndex->Find(m_jsonDoc, pKey, length, KeyIndex::Hash(pKey, length));
+	if (slot->member == KeyIndex::EmptySlot)
+	{
+		return nullptr;
+	}
+	return &(m_jsonDoc.MemberBegin() + slot->member)->value;
+}
+
+void RemoteSaveSession::setValue(const char *pKey, rapidjson::Value &value)
+{
+	auto length = strlen(pKey);
+	auto hash = KeyIndex::Hash(pKey, length);
+	auto slot = m_keyIndex->Find(m_jsonDoc, pKey, length, hash);
+	if (slot->member != KeyIndex::EmptySlot)
+	{
+		replaceValue(slot->member, pKey, length, value);
+		return;
+	}
+
+	markReadSnapshotDirty();
+	rapidjson::Document::AllocatorType &allocator = m_jsonDoc.GetAllocator();
+	m_jsonDoc.AddMember(rapidjson::Value(pKey, (rapidjson::SizeType)length, allocator).Move(), value, allocator);
+	m_keyIndex->Insert(hash, m_jsonDoc.MemberCount() - 1);
+	m_keyIndex->dirty.push_back(1);
+	journalChange(pKey, length, &(m_jsonDoc.MemberEnd() - 1)->value);
+}
+
+void RemoteSaveSession::replaceValue(uint32_t member, const char *pKey, size_t length, rapidjson::Value &value)
+{
+	markReadSnapshotDirty();
+	m_keyIndex->dirty[member] = 1;
+
+	// 已有的键直接覆盖值，键名不再重新分配
+	// 被覆盖的值留在m_jsonDoc的内存池中无法释放，记为垃圾，积累到一定比例时整理
+	auto &node = (m_jsonDoc.MemberBegin() + member)->value;
+	m_allocatorGarbage += getPoolSize(node);
+	node = value;
+	journalChange(pKey, length, &node);
+	compactAllocator();
+}
+
+size_t RemoteSaveSession::getAllocatorSize()
+{
+	return m_jsonDoc.GetAllocator().Size();
+}
+
+unsigned int RemoteSaveSession::getCoalescedSaveCount() const
+{
+	return (unsigned int)m_metrics->counters[MC_COALESCED_SAVES].load(std::memory_order_relaxed);
+}
+
+void RemoteSaveSession::getMetrics(Metrics &metrics) const
+{
+	for (int i = 0; i < MS_COUNT; ++i)
+	{
+		auto &histogram = m_metrics->latency[i];
+		auto &stage = metrics.stages[i];
+		stage.count = histogram.count.load(std::memory_order_relaxed);
+		stage.bytes = m_metrics->bytes[i].load(std::memory_order_relaxed);
+		stage.meanMicros = stage.count ? histogram.sum.load(std::memory_order_relaxed) / 1000. / stage.count : 0.;
+		stage.p50Micros = histogram.Percentile(0.5) / 1000.;
+		stage.p90Micros = histogram.Percentile(0.9) / 1000.;
+		stage.p99Micros = histogram.Percentile(0.99) / 1000.;
+		stage.maxMicros = histogram.max.load(std::memory_order_relaxed) / 1000.;
+	}
+	for (int i = 0; i < MC_COUNT; ++i)
+	{
+		metrics.counters[i] = m_metrics->counters[i].load(std::memory_order_relaxed);
+	}
+}
+
+void RemoteSaveSession::resetMetrics()
+{
+	m_metrics->Reset();
+}
+
+std::string RemoteSaveSession::getMetricsReport() const
+{
+	Metrics metrics;
+	getMetrics(metrics);
+
+	std::string report;
+	char line[256];
+	for (int i = 0; i < MS_COUNT; ++i)
+	{
+		auto &stage = metrics.stages[i];
+		snprintf(line, sizeof(line), "%-15s count %llu, bytes %llu, mean %.1fus, p50 %.1fus, p90 %.1fus, p99 %.1fus, max %.1fus\n",
+				 getMetricStageName((MetricStage)i), stage.count, stage.bytes,
+				 stage.meanMicros, stage.p50Micros, stage.p90Micros, stage.p99Micros, stage.maxMicros);
+		report += line;
+	}
+	for (int i = 0; i < MC_COUNT; ++i)
+	{
+		snprintf(line, sizeof(line), "%-15s %llu\n", getMetricCounterName((MetricCounter)i), metrics.counters[i]);
+		report += line;
+	}
+	return report;
+}
+
+const char *RemoteSaveSession::getMetricStageName(MetricStage stage)
+{
+	static const char *names[MS_COUNT] =
+	{
+		"save_main", "serialize", "encrypt", "base64_encode", "form_encode", "http_save",
+		"http_load", "base64_decode", "decrypt", "parse",
+	};
+	return stage >= 0 && stage < MS_COUNT ? names[stage] : "";
+}
+
+const char *RemoteSaveSession::getMetricCounterName(MetricCounter counter)
+{
+	static const char *names[MC_COUNT] =
+	{
+		"loads", "saves", "delta_saves", "load_retries", "save_retries",
+		"failed_loads", "failed_saves", "coalesced_saves",
+	};
+	return counter >= 0 && counter < MC_COUNT ? names[counter] : "";
+}
+
+void RemoteSaveSession::compactAllocator()
+{
+	auto size = m_jsonDoc.GetAllocator().Size();
+	if (m_allocatorGarbage < CompactMinGarbage || m_allocatorGarbage < size * m_compactRatio)
+	{
+		return;
+	}
+
+	// 直接复制到按存活数据大小分配的新内存池，旧的整个释放
+	// 复制保持成员顺序，m_keyIndex不需要重建；指向m_loadBuffer的字符串不复制
+	assignJsonDoc(m_jsonDoc, m_allocatorGarbage < size ? size - m_allocatorGarbage : 0);
+
+	cocos2d::log("[%s]: allocator compacted, %s -> %s bytes", __PRETTY_FUNCTION__,
+				 std::to_string(size).c_str(), std::to_string(getAllocatorSize()).c_str());
+}
+
+size_t RemoteSaveSession::getPoolSize(const rapidjson::Value &value) const
+{
+	if (value.IsString())
+	{
+		auto str = value.GetString();
+		auto node = reinterpret_cast<const char*>(&value);
+		if (str >= node && str < node + sizeof(value))
+		{
+			return 0;
+		}
+		if (m_loadBuffer && str >= m_loadBuffer->data() && str < m_loadBuffer->data() + m_loadBuffer->size())
+		{
+			return 0;
+		}
+		return value.GetStringLength() + 1;
+	}
+
+	// 成员和元素数组本身也在内存池中
+	size_t size = 0;
+	if (value.IsObject())
+	{
+		size += value.MemberCount() * sizeof(*value.MemberBegin());
+		for (auto it = value.MemberBegin(); it != value.MemberEnd(); ++it)
+		{
+			size += getPoolSize(it->name) + getPoolSize(it->value);
+		}
+	}
+	else if (value.IsArray())
+	{
+		size += value.Capacity() * sizeof(value);
+		for (auto it = value.Begin(); it != value.End(); ++it)
+		{
+			size += getPoolSize(*it);
+		}
+	}
+	return size;
+}
+
+void RemoteSaveSession::assignJsonDoc(const rapidjson::Value &value, size_t size /* = 0 */)
+{
+	// 块大小只能在构造时指定，多留1/4给之后新增的键，复制时只分配一块
+	size += size / 4;
+	std::unique_ptr<JsonAllocator> allocator(new JsonAllocator(size > AllocatorMinChunk ? size : AllocatorMinChunk));
+	rapidjson::Value copy(value, *allocator);
+
+	// Document::Swap()要rapidjson 1.1，cocos2d-x 3.8带的版本只有Value::Swap()，不交换内存池
+	// m_jsonDoc只保存内存池的指针，改用新的内存池原地重新构造，再把复制好的值交换进来
+	// value可能就在旧的内存池中，复制完之后才能释放旧的
+	m_jsonDoc.~GenericDocument();
+	new (&m_jsonDoc) rapidjson::Document(allocator.get());
+	m_jsonDoc.Swap(copy);
+	m_jsonAllocator.swap(allocator);
+	m_allocatorGarbage = 0;
+	++m_keyLayout;
+	markReadSnapshotDirty();
+}
+
+void RemoteSaveSession::markReadSnapshotDirty()
+{
+	// 没有Reader时不用发布；同一帧内的多次改变只发布一次
+	if (!m_readChannel || m_readSnapshotDirty)
+	{
+		return;
+	}
+
+	m_readSnapshotDirty = true;
+	cocos2d::Director::getInstance()->getScheduler()->schedule([this](float)
+	{
+		publishReadSnapshot();
+	}, this, 0.f, 0, 0.f, false, PublishScheduleKey);
+}
+
+void RemoteSaveSession::publishReadSnapshot()
+{
+	m_readSnapshotDirty = false;
+	if (!m_readChannel)
+	{
+		return;
+	}
+
+	// 没有初始化或还没加载时发布空存档
+	std::shared_ptr<ReadSnapshot> snapshot;
+	if (m_inited && m_keyIndex && m_jsonDoc.IsObject())
+	{
+		// 复制只分配一块内存
+		size_t size = m_jsonAllocator->Size();
+		if (size < AllocatorMinChunk)
+		{
+			size = AllocatorMinChunk;
+		}
+		snapshot = std::make_shared<ReadSnapshot>(size);
+		snapshot->doc.CopyFrom(m_jsonDoc, snapshot->allocator);
+		snapshot->index.slots = m_keyIndex->slots;
+		snapshot->index.count = m_keyIndex->count;
+		snapshot->loadBuffer = m_loadBuffer;
+	}
+	m_readChannel->Publish(snapshot);
+}
+
+bool RemoteSaveSession::init(const std::string &uid, const std::string &version,
+					  const std::string &key, const std::string &iv, 
+					  const std::string &urlLoad, const std::string &urlSave)
+{
+	if (m_inited)
+	{
+		cocos2d::log("[%s]: already inited", __PRETTY_FUNCTION__);
+		return false;
+	}
+
+	if (uid.empty())
+	{
+		cocos2d::log("[%s]: empty uid", __PRETTY_FUNCTION__);
+		return false;
+	}
+
+	if (version.empty())
+	{
+		cocos2d::log("[%s]: empty version", __PRETTY_FUNCTION__);
+		return false;
+	}
+
+	if (key.size() < 16)
+	{
+		cocos2d::log("[%s]: invalid key: %s", __PRETTY_FUNCTION__, key.c_str());
+		return false;
+	}
+
+	if (iv.size() < 16)
+	{
+		cocos2d::log("[%s]: invalid iv: %s", __PRETTY_FUNCTION__, iv.c_str());
+		return false;
+	}
+
+	m_uid = uid;
+	m_version = version;
+	m_urlLoad = urlLoad;
+	m_urlSave = urlSave;
+
+	m_aesContext = m_context->getAesContext(key, iv);
+	// uid的加密结果固定不变，只算一次
+	encode(m_uid, m_uidEncoded);
+
+	std::random_device random;
+	char requestIdPrefix[17];
+	snprintf(requestIdPrefix, sizeof(requestIdPrefix), "%08x%08x", (unsigned int)random(), (unsigned int)random());
+	m_requestIdPrefix = requestIdPrefix;
+	// 传输层在release()之后保留，再次init()时继续使用已建立的连接
+	if (!m_transport)
+	{
+		m_transport = m_context->getTransport();
+	}
+
+	m_sn = 0;
+	m_jsonDoc.SetNull();
+	m_keyIndex = new KeyIndex;
+	m_allocatorGarbage = 0;
+	m_removedKeys.clear();
+	m_ackedSn = 0;
+	m_fullSaveRequired = true;
+	m_serverLoaded = false;
+	if (!m_journalDirectory.empty())
+	{
+		openJournal();
+	}
+	m_inited = true;
+
+	return true;
+}
+
+void RemoteSaveSession::release()
+{
+	if (!m_inited)
+	{
+		return;
+	}
+
+	// 后台的保存用到密钥和uid，等它交给传输层
+	waitSaveJob();
+	cancelAutoSave();
+	// 已发出的请求的回应都丢弃，不再发送等待中的保存
+	++m_generation;
+	m_savePending = false;
+	m_saveInFlight = false;
+	cancelRetry(m_loadRetry, RetryLoadScheduleKey);
+	cancelRetry(m_saveRetry, RetrySaveScheduleKey);
+	closeJournal();
+	m_inited = false;
+	m_sn = 0;
+	m_jsonDoc.SetObject();
+	// 后台的保存已经结束，之后到达的回应和保存失败都因m_generation不同被丢弃，不会再用到它们
+	m_aesContext.reset();
+	delete m_keyIndex; m_keyIndex = nullptr;
+	++m_keyLayout;
+	// Reader之后读到空存档
+	if (m_readSnapshotDirty)
+	{
+		cocos2d::Director::getInstance()->getScheduler()->unschedule(PublishScheduleKey, this);
+	}
+	publishReadSnapshot();
+}
+
+void RemoteSaveSession::load()
+{
+	if (!m_inited)
+	{
+		return;
+	}
+
+	sendRequestLoadGame();
+}
+
+void RemoteSaveSession::save()
+{
+	if (!m_inited)
+	{
+		return;
+	}
+
+	// 这次保存已经包含了所有等待合并的改变
+	cancelAutoSave();
+	if (m_saveInFlight || waitingForServer())
+	{
+		// 发送时才序列化，等待中的保存会包含这次的改变
+		if (m_savePending)
+		{
+			m_metrics->Count(MC_COALESCED_SAVES);
+		}
+		m_savePending = true;
+		return;
+	}
+
+	sendRequestSaveGame();
+}
+
+void RemoteSaveSession::setSaveCoalescing(float quietPeriod, float maxDelay)
+{
+	m_saveQuietPeriod = quietPeriod;
+	m_saveMaxDelay = maxDelay;
+	if (m_saveQuietPeriod <= 0.f && m_saveDirty)
+	{
+		save();
+	}
+}
+
+void RemoteSaveSession::setRetryPolicy(unsigned int maxAttempts, float baseDelay /* = 1.f */, float maxDelay /* = 30.f */)
+{
+	m_retryMaxAttempts = maxAttempts;
+	m_retryBaseDelay = baseDelay;
+	m_retryMaxDelay = maxDelay;
+}
+
+void RemoteSaveSession::setSaveMode(SaveMode mode, unsigned int fullSaveInterval /* = 20 */)
+{
+	m_saveMode = mode;
+	m_fullSaveInterval = fullSaveInterval;
+}
+
+void RemoteSaveSession::flush()
+{
+	if (m_saveDirty)
+	{
+		save();
+	}
+}
+
+void RemoteSaveSession::beginBatch()
+{
+	++m_batchDepth;
+}
+
+void RemoteSaveSession::commitBatch()
+{
+	if (m_batchDepth == 0)
+	{
+		cocos2d::log("[%s]: commitBatch() without beginBatch()", __PRETTY_FUNCTION__);
+		return;
+	}
+
+	if (--m_batchDepth > 0)
+	{
+		return;
+	}
+
+	// 批量修改中的日志一次写入
+	flushJournal();
+	if (m_batchPending)
+	{
+		m_batchPending = false;
+		requestAutoSave();
+	}
+}
+
+RemoteSaveSession::Batch::Batch(RemoteSaveSession *remoteSave /* = nullptr */)
+	: m_remoteSave(remoteSave ? remoteSave : g_RemoteSave)
+{
+	m_remoteSave->beginBatch();
+}
+
+RemoteSaveSession::Batch::~Batch()
+{
+	commit();
+}
+
+void RemoteSaveSession::Batch::commit()
+{
+	if (m_remoteSave)
+	{
+		m_remoteSave->commitBatch();
+		m_remoteSave = nullptr;
+	}
+}
+
+RemoteSaveSession::Reader::Reader(RemoteSaveSession &session)
+	: m_version(0)
+	, m_autoRefresh(true)
+{
+	// 第一个Reader创建时立即发布一次，之后在有改变的帧发布
+	if (!session.m_readChannel)
+	{
+		session.m_readChannel = std::make_shared<ReadChannel>();
+		session.publishReadSnapshot();
+	}
+	m_channel = session.m_readChannel;
+	m_version = m_channel->Acquire(m_snapshot);
+}
 
-			(*state)[i][0] = Multiply(a, 0x0e) ^ Multiply(b, 0x0b) ^ Multiply(c, 0x0d) ^ Multiply(d, 0x09);
-			(*state)[i][1] = Multiply(a, 0x09) ^ Multiply(b, 0x0e) ^ Multiply(c, 0x0b) ^ Multiply(d, 0x0d);
-			(*state)[i][2] = Multiply(a, 0x0d) ^ Multiply(b, 0x09) ^ Multiply(c, 0x0e) ^ Multiply(d, 0x0b);
-			(*state)[i][3] = Multiply(a, 0x0b) ^ Multiply(b, 0x0d) ^ Multiply(c, 0x09) ^ Multiply(d, 0x0e);
-		}
+bool RemoteSaveSession::Reader::refresh()
+{
+	if (m_channel->version.load(std::memory_order_acquire) == m_version)
+	{
+		return false;
 	}
 
+	m_version = m_channel->Acquire(m_snapshot);
+	return true;
+}
 
-	// The SubBytes Function Substitutes the values in the
-	// state matrix with values in an S-box.
-	static void InvSubBytes(void)
+const rapidjson::Value *RemoteSaveSession::Reader::findValue(const char *pKey)
+{
+	if (!pKey || !(*pKey))
 	{
-		uint8_t i, j;
-		for (i = 0; i < 4; ++i)
-		{
-			for (j = 0; j < 4; ++j)
-			{
-				(*state)[j][i] = getSBoxInvert((*state)[j][i]);
-			}
-		}
+		return nullptr;
 	}
 
-	static void InvShiftRows(void)
+	if (m_autoRefresh)
 	{
-		uint8_t temp;
+		refresh();
+	}
+	if (!m_snapshot)
+	{
+		return nullptr;
+	}
 
-		// Rotate first row 1 columns to right  
-		temp = (*state)[3][1];
-		(*state)[3][1] = (*state)[2][1];
-		(*state)[2][1] = (*state)[1][1];
-		(*state)[1][1] = (*state)[0][1];
-		(*state)[0][1] = temp;
+	auto &doc = m_snapshot->doc;
+	auto length = strlen(pKey);
+	auto slot = m_snapshot->index.Find(doc, pKey, length, KeyIndex::Hash(pKey, length));
+	if (slot->member == KeyIndex::EmptySlot)
+	{
+		return nullptr;
+	}
+	return &(doc.MemberBegin() + slot->member)->value;
+}
 
-		// Rotate second row 2 columns to right 
-		temp = (*state)[0][2];
-		(*state)[0][2] = (*state)[2][2];
-		(*state)[2][2] = temp;
+bool RemoteSaveSession::Reader::getBoolForKey(const char *pKey, bool defaultValue /* = false */)
+{
+	auto pNode = findValue(pKey);
+	return pNode && pNode->IsBool() ? pNode->GetBool() : defaultValue;
+}
 
-		temp = (*state)[1][2];
-		(*state)[1][2] = (*state)[3][2];
-		(*state)[3][2] = temp;
+int RemoteSaveSession::Reader::getIntegerForKey(const char *pKey, int defaultValue /* = 0 */)
+{
+	auto pNode = findValue(pKey);
+	return pNode && pNode->IsInt() ? pNode->GetInt() : defaultValue;
+}
 
-		// Rotate third row 3 columns to right
-		temp = (*state)[0][3];
-		(*state)[0][3] = (*state)[1][3];
-		(*state)[1][3] = (*state)[2][3];
-		(*state)[2][3] = (*state)[3][3];
-		(*state)[3][3] = temp;
-	}
+float RemoteSaveSession::Reader::getFloatForKey(const char *pKey, float defaultValue /* = 0.f */)
+{
+	auto pNode = findValue(pKey);
+	return pNode && pNode->IsDouble() ? (float)pNode->GetDouble() : defaultValue;
+}
 
+double RemoteSaveSession::Reader::getDoubleForKey(const char *pKey, double defaultValue /* = 0. */)
+{
+	auto pNode = findValue(pKey);
+	return pNode && pNode->IsDouble() ? pNode->GetDouble() : defaultValue;
+}
 
-	// Cipher is the main function that encrypts the PlainText.
-	static void Cipher(void)
+std::string RemoteSaveSession::Reader::getStringForKey(const char *pKey, const std::string &defaultValue /* = RemoteSaveSession::NullString */)
+{
+	auto pNode = findValue(pKey);
+	if (pNode && pNode->IsString())
 	{
-		uint8_t round = 0;
+		return std::string(pNode->GetString(), pNode->GetStringLength());
+	}
+	return defaultValue;
+}
 
-		// Add the First round key to the state before starting the rounds.
-		AddRoundKey(0);
+cocos2d::Data RemoteSaveSession::Reader::getDataForKey(const char *pKey, const cocos2d::Data &defaultValue /* = cocos2d::Data::Null */)
+{
+	auto pNode = findValue(pKey);
+	cocos2d::Data ret;
+	if (pNode && pNode->IsString() && __RemoveSave_private::Base64DecodeData(ret, pNode->GetString(), pNode->GetStringLength()))
+	{
+		return ret;
+	}
+	return defaultValue;
+}
 
-		// There will be Nr rounds.
-		// The first Nr-1 rounds are identical.
-		// These Nr-1 rounds are executed in the loop below.
-		for (round = 1; round < Nr; ++round)
+void RemoteSaveSession::requestAutoSave()
+{
+	// 批量修改中只记下需要保存，commitBatch()时统一处理
+	if (m_batchDepth > 0)
+	{
+		if (m_batchPending)
 		{
-			SubBytes();
-			ShiftRows();
-			MixColumns();
-			AddRoundKey(round);
+			m_metrics->Count(MC_COALESCED_SAVES);
 		}
-
-		// The last round is given below.
-		// The MixColumns function is not here in the last round.
-		SubBytes();
-		ShiftRows();
-		AddRoundKey(Nr);
+		m_batchPending = true;
+		return;
 	}
 
-	static void InvCipher(void)
+	if (m_saveQuietPeriod <= 0.f)
 	{
-		uint8_t round = 0;
+		save();
+		return;
+	}
 
-		// Add the First round key to the state before starting the rounds.
-		AddRoundKey(Nr);
+	m_saveQuietElapsed = 0.f;
+	if (m_saveDirty)
+	{
+		m_metrics->Count(MC_COALESCED_SAVES);
+		return;
+	}
 
-		// There will be Nr rounds.
-		// The first Nr-1 rounds are identical.
-		// These Nr-1 rounds are executed in the loop below.
-		for (round = Nr - 1; round > 0; round--)
-		{
-			InvShiftRows();
-			InvSubBytes();
-			AddRoundKey(round);
-			InvMixColumns();
-		}
+	m_saveDirty = true;
+	m_saveDirtyElapsed = 0.f;
+	cocos2d::Director::getInstance()->getScheduler()->schedule(
+		CC_CALLBACK_1(RemoteSaveSession::updateAutoSave, this), this, 0.f, false, AutoSaveScheduleKey);
+}
 
-		// The last round is given below.
-		// The MixColumns function is not here in the last round.
-		InvShiftRows();
-		InvSubBytes();
-		AddRoundKey(0);
+void RemoteSaveSession::updateAutoSave(float dt)
+{
+	m_saveQuietElapsed += dt;
+	m_saveDirtyElapsed += dt;
+	if (m_saveQuietElapsed >= m_saveQuietPeriod || m_saveDirtyElapsed >= m_saveMaxDelay)
+	{
+		save();
 	}
+}
 
-	static void BlockCopy(uint8_t* output, const uint8_t* input)
+void RemoteSaveSession::cancelAutoSave()
+{
+	if (!m_saveDirty)
 	{
-		uint8_t i;
-		for (i = 0; i < KEYLEN; ++i)
-		{
-			output[i] = input[i];
-		}
+		return;
 	}
 
+	m_saveDirty = false;
+	cocos2d::Director::getInstance()->getScheduler()->unschedule(AutoSaveScheduleKey, this);
+}
 
+bool RemoteSaveSession::scheduleRetry(const RemoteSaveTransport::Response &response, const std::string &tag, unsigned int &attempts,
+							   std::function<void()> &retry, const std::string &scheduleKey, const std::function<void()> &resend)
+{
+	// 4xx是请求本身的问题，重试也不会成功
+	auto statusCode = response.statusCode;
+	if (statusCode > 0 && statusCode != 429 && statusCode < 500)
+	{
+		return false;
+	}
 
-	/*****************************************************************************/
-	/* Public functions:                                                         */
-	/*****************************************************************************/
-#if defined(ECB) && ECB
-	
-	void AES128_ECB_encrypt(uint8_t* input, const uint8_t* key, uint8_t* output)
+	if (!m_inited || attempts + 1 >= m_retryMaxAttempts)
 	{
-		// Copy input to output, and work in-memory on output
-		BlockCopy(output, input);
-		state = (state_t*)output;
+		return false;
+	}
 
-		Key = key;
-		KeyExpansion();
+	// 指数退避上限内完全随机，服务器恢复时所有客户端的重试不会挤在同一时刻
+	++attempts;
+	float delay = std::min(m_retryMaxDelay, m_retryBaseDelay * (float)(1u << std::min(attempts - 1, 20u)));
+	delay = cocos2d::random(0.f, delay);
+	cocos2d::log("[%s]: retry %u in %.2fs: %s", __PRETTY_FUNCTION__, attempts, delay, tag.c_str());
 
-		// The next function call encrypts the PlainText with the Key using AES algorithm.
-		Cipher();
-	}
+	// resend持有请求，发送前请求一直有效
+	retry = resend;
+	cocos2d::Director::getInstance()->getScheduler()->schedule([&retry](float)
+	{
+		auto resend = std::move(retry);
+		retry = nullptr;
+		resend();
+	}, this, 0.f, 0, delay, false, scheduleKey);
+	return true;
+}
 
-	void AES128_ECB_decrypt(uint8_t* input, const uint8_t* key, uint8_t *output)
+bool RemoteSaveSession::cancelRetry(std::function<void()> &retry, const std::string &scheduleKey)
+{
+	if (!retry)
 	{
-		// Copy input to output, and work in-memory on output
-		BlockCopy(output, input);
-		state = (state_t*)output;
+		return false;
+	}
 
-		// The KeyExpansion routine must be called before encryption.
-		Key = key;
-		KeyExpansion();
+	cocos2d::Director::getInstance()->getScheduler()->unschedule(scheduleKey, this);
+	retry = nullptr;
+	return true;
+}
 
-		InvCipher();
-	}
+void RemoteSaveSession::sendRequestLoadGame()
+{
+	cancelRetry(m_loadRetry, RetryLoadScheduleKey);
+	m_loadAttempts = 0;
 
-#endif // #if defined(ECB) && ECB
+	auto request = std::make_shared<RemoteSaveTransport::Request>();
+	request->url = m_urlLoad;
 
+	// write the post data
+	auto &postData = request->data;
+	postData += "user_id=";
+	appendPostData(postData, m_uidEncoded.data(), m_uidEncoded.size());
+	REMOTESAVE_LOG_PAYLOAD("[%s]: Post request, url: %s, data: %s", __PRETTY_FUNCTION__, m_urlLoad.c_str(), postData.c_str());
+
+	request->tag = "POST load data for uid: " + m_uid;
+	m_metrics->Count(MC_LOADS);
+	sendLoad(request);
+}
 
-#if defined(CBC) && CBC
-	
-	static void XorWithIv(uint8_t* buf)
+void RemoteSaveSession::sendLoad(const TransportRequest &request)
+{
+	m_loadSentAt = MetricsRecorder::Now();
+	std::weak_ptr<bool> alive = m_alive;
+	auto generation = m_generation;
+	m_transport->send(request, [this, alive, generation, request](RemoteSaveTransport::Response &response)
 	{
-		uint8_t i;
-		for (i = 0; i < KEYLEN; ++i)
+		if (!alive.expired() && generation == m_generation)
 		{
-			buf[i] ^= Iv[i];
+			onHttpRequestCompletedLoadGame(request, response);
 		}
-	}
+	});
+}
 
-	void AES128_CBC_encrypt_buffer(uint8_t* output, const uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv)
+void RemoteSaveSession::onHttpRequestCompletedLoadGame(const TransportRequest &request, RemoteSaveTransport::Response &response)
+{
+	if (!m_inited)
 	{
-		uintptr_t i;
-		uint8_t remainders = length % KEYLEN; /* Remaining bytes in the last non-full block */
+		return;
+	}
+
+	cocos2d::log("[%s]: Receive response: %s", __PRETTY_FUNCTION__, request->tag.c_str());
 
-		// 	BlockCopy(output, input);
-		// 	state = (state_t*)output;
+	auto statusCode = response.statusCode;
+	cocos2d::log("[%s]: HTTP Status Code: %ld", __PRETTY_FUNCTION__, statusCode);
+	m_metrics->Record(MS_HTTP_LOAD, MetricsRecorder::Now() - m_loadSentAt, response.data.size());
 
-		// Skip the key expansion if key is passed as 0
-		if (0 != key)
+	ErrorCode code = EC_OK;
+	std::string msg;
+	bool uploadLocal = false;
+	std::vector<std::string> changedKeys;
+	do 
+	{
+		if (!response.succeeded)
 		{
-			Key = key;
-			KeyExpansion();
+			if (scheduleRetry(response, request->tag, m_loadAttempts, m_loadRetry, RetryLoadScheduleKey,
+							  [this, request]() { sendLoad(request); }))
+			{
+				m_metrics->Count(MC_LOAD_RETRIES);
+				return;
+			}
+
+			code = EC_RESPONSE;
+			msg = response.error;
+			cocos2d::log("[%s]: Response failed, error: %s", __PRETTY_FUNCTION__, msg.c_str());
+			break;
 		}
 
-		if (iv != 0)
+		auto buffer = &response.data;
+		cocos2d::log("[%s]: Response succeeded, %s bytes", __PRETTY_FUNCTION__, std::to_string(buffer->size()).c_str());
+
+		// 回应和解码后的存档都原地解析，不复制；存档解码进堆上的字符串，解析后地址不再变化
+		unsigned long long sn = 0;
+		auto saveData = std::make_shared<std::string>();
+		size_t offset = 0;
+		if (!parseResponseLoadGame(*buffer, sn, *saveData, offset))
 		{
-			Iv = (uint8_t*)iv;
+			code = EC_PARSE_RESPONSE;
+			msg = "";
+			cocos2d::log("[%s]: parseResponseLoadGame failed", __PRETTY_FUNCTION__);
+			break;
 		}
 
-		for (i = KEYLEN; i <= length; i += KEYLEN)
+		// 本地存档不比服务器的旧时保留本地的
+		if (m_journal && sn <= m_ackedSn)
 		{
-			BlockCopy(output, input);
-			XorWithIv(output);
-			state = (state_t*)output;
-			Cipher();
-			Iv = output;
-			input += KEYLEN;
-			output += KEYLEN;
+			if (sn < m_ackedSn)
+			{
+				// 服务器落后于本地确认过的存档，当作一次没上传的改变，重启后也会上传
+				++m_journal->changes;
+				writeSnapshot();
+			}
+			uploadLocal = m_journal->Unsynced();
+			cocos2d::log("[%s]: keep local save, sn: %s, server sn: %s, unsynced: %d", __PRETTY_FUNCTION__,
+						 std::to_string(m_ackedSn).c_str(), std::to_string(sn).c_str(), uploadLocal);
+			m_sn = std::max(m_sn, sn);
 		}
-
-		if (remainders)
+		else
 		{
-			memcpy(output, input, remainders);
-			memset(output + remainders, 0, KEYLEN - remainders); /* add 0-padding */
-			XorWithIv(output);
-			state = (state_t*)output;
-			Cipher();
+			// 即时启动时游戏在加载期间做的改变比服务器的存档新，合并进去之后再上传
+			auto &dirty = m_keyIndex->dirty;
+			bool mergeLocal = m_instantStart
+				&& (!m_removedKeys.empty() || std::find(dirty.begin(), dirty.end(), 1) != dirty.end());
+			if (!loadWithBuffer(saveData, offset, mergeLocal, m_cbOnChange ? &changedKeys : nullptr))
+			{
+				code = EC_LOAD_DATA;
+				msg = "";
+				cocos2d::log("[%s]: loadWithBuffer failed", __PRETTY_FUNCTION__);
+				break;
+			}
+
+			m_sn = sn;
+			m_ackedSn = sn;
+			uploadLocal = mergeLocal;
+			if (m_journal)
+			{
+				// 服务器的存档取代了本地所有的改变，合并进来的记为一次没上传的改变
+				m_journal->syncedChanges = m_journal->changes;
+				m_journal->sentSn = 0;
+				if (mergeLocal)
+				{
+					++m_journal->changes;
+				}
+				writeSnapshot();
+			}
 		}
+
+		// 增量以服务器上的这份存档为基准，第一次先上传完整存档
+		m_ackedSn = sn;
+		m_fullSaveRequired = true;
+		m_removedKeys.clear();
+		m_serverLoaded = true;
+	} while (0);
+
+	if (code != EC_OK)
+	{
+		m_metrics->Count(MC_FAILED_LOADS);
 	}
 
-	void AES128_CBC_decrypt_buffer(uint8_t* output, const uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv)
+	if (!changedKeys.empty())
 	{
-		uintptr_t i;
-		uint8_t remainders = length % KEYLEN; /* Remaining bytes in the last non-full block */
+		m_cbOnChange(changedKeys);
+	}
+
+	if (m_cbOnLoad)
+	{
+		m_cbOnLoad(code, msg);
+	}
+
+	if (uploadLocal)
+	{
+		requestAutoSave();
+	}
+	// 即时启动时等待加载的保存
+	sendPendingSave();
+}
 
-		// 	BlockCopy(output, input);
-		// 	state = (state_t*)output;
+bool RemoteSaveSession::parseResponseLoadGame(std::vector<char> &buffer, unsigned long long &sn, std::string &saveData, size_t &offset)
+{
+	if (buffer.empty())
+	{
+		cocos2d::log("[%s]: buffer empty", __PRETTY_FUNCTION__);
+		return false;
+	}
 
-		// Skip the key expansion if key is passed as 0
-		if (0 != key)
+	saveData = "";
+	offset = 0;
+	sn = 0;
+	if (buffer.size() != 4 || memcmp(&buffer[0], "NULL", 4) != 0)
+	{
+		// 只有sn和save_data两个成员，节点放在栈上的缓冲区里；save_data原地反转义，不复制
+		size_t pool[128];
+		JsonAllocator allocator(pool, sizeof(pool));
+		rapidjson::Document jsonDoc(&allocator);
+		buffer.push_back('\0');
+		jsonDoc.ParseInsitu(&buffer[0]);
+		if (jsonDoc.HasParseError())  //打印解析错误
 		{
-			Key = key;
-			KeyExpansion();
+			cocos2d::log("[%s]: jsonDoc.Parse() failed, Error: %d", __PRETTY_FUNCTION__,
+						 jsonDoc.GetParseError());
+			return false;
 		}
 
-		// If iv is passed as 0, we continue to encrypt without re-setting the Iv
-		if (iv != 0)
+		if (!jsonDoc.IsObject())
 		{
-			Iv = (uint8_t*)iv;
+			cocos2d::log("[%s]: jsonDoc is not an object", __PRETTY_FUNCTION__);
+			return false;
 		}
 
-		for (i = KEYLEN; i <= length; i += KEYLEN)
+		auto itSN = jsonDoc.FindMember("sn");
+		if (itSN != jsonDoc.MemberEnd())
 		{
-			BlockCopy(output, input);
-			state = (state_t*)output;
-			InvCipher();
-			XorWithIv(output);
-			Iv = input;
-			input += KEYLEN;
-			output += KEYLEN;
+			auto &node = itSN->value;
+			if (node.IsUint64())
+			{
+				sn = node.GetUint64();
+			}
 		}
 
-		if (remainders)
+		auto itSaveData = jsonDoc.FindMember("save_data");
+		if (itSaveData != jsonDoc.MemberEnd())
 		{
-			BlockCopy(output, input);
-			state = (state_t*)output;
-			InvCipher();
-			XorWithIv(output);
-			memset(output + remainders, 0, KEYLEN - remainders); /* add 0-padding */
+			auto &node = itSaveData->value;
+			if (node.IsString())
+			{
+				if (!decode(node.GetString(), node.GetStringLength(), m_compressBuffer, saveData, offset))
+				{
+					cocos2d::log("[%s]: decode save_data failed", __PRETTY_FUNCTION__);
+					return false;
+				}
+			}
 		}
 	}
-	
-#endif // #if defined(CBC) && CBC
-} // namespace
-
-
-const std::string RemoteSave::NullString = "";
-RemoteSave* RemoteSave::m_instance = nullptr;
 
-RemoteSave::RemoteSave() 
-	: m_inited(false)
-	, m_saveOnGetDefault(false)
-	, m_saveOnChangeValue(false)
-	, m_cbOnLoad(nullptr)
-	, m_cbOnSave(nullptr)
-	, m_sn(0)
-{
+	cocos2d::log("[%s]: game loaded, sn: %s, save_data: %s bytes", __PRETTY_FUNCTION__,
+				 std::to_string(sn).c_str(), std::to_string(saveData.size() - offset).c_str());
+	return true;
 }
 
-bool RemoteSave::getBoolForKey(const char *pKey, bool defaultValue /* = false */)
+bool RemoteSaveSession::loadWithBuffer(const std::shared_ptr<std::string> &buffer, size_t offset, bool mergeLocal /* = false */,
+								std::vector<std::string> *changedKeys /* = nullptr */)
 {
-	if (!m_inited)
+	// 解析到临时文档，成功后再放进清空的m_jsonDoc，旧数据占用的内存池整个释放，重复加载不会累积
+	// 原地解析，字符串都指向buffer；节点的内存池按上次存档的大小预先分配
+	auto start = MetricsRecorder::Now();
+	auto length = buffer->size() - offset;
+	auto chunk = m_jsonAllocator->Size() > length ? m_jsonAllocator->Size() : length;
+	JsonAllocator allocator(chunk > AllocatorMinChunk ? chunk : AllocatorMinChunk);
+	rapidjson::Document jsonDoc(&allocator);
+	if (!length)
 	{
-		return defaultValue;
-	}
-
-	if (!pKey || !(*pKey))
-	{
-		return defaultValue;
+		cocos2d::log("[%s]: empty JSON buffer", __PRETTY_FUNCTION__);
+		jsonDoc.SetObject();
 	}
-
-	auto it = m_jsonDoc.FindMember(pKey);
-	if (it != m_jsonDoc.MemberEnd())
+	else
 	{
-		auto &node = it->value;
-		if (node.IsBool())
+		jsonDoc.ParseInsitu(&(*buffer)[offset]);
+		if (jsonDoc.HasParseError())
 		{
-			return node.GetBool();
+			cocos2d::log("[%s]: m_jsonDoc.Parse() failed, Error: %d", __PRETTY_FUNCTION__,
+						 jsonDoc.GetParseError());
+			return false;
 		}
-	}
-
-	rapidjson::Value jsonValue(defaultValue);
-	rapidjson::Document::AllocatorType &allocator = m_jsonDoc.GetAllocator();
-	m_jsonDoc.RemoveMember(pKey);
-	m_jsonDoc.AddMember(rapidjson::Value(pKey, allocator).Move(), jsonValue, allocator);
-	saveOnGetDefault();
-
-	return defaultValue;
-}
 
-int RemoteSave::getIntegerForKey(const char *pKey, int defaultValue /* = 0 */)
-{
-	if (!m_inited)
-	{
-		return defaultValue;
+		if (!jsonDoc.IsObject())
+		{
+			cocos2d::log("[%s]: m_jsonDoc is not an object", __PRETTY_FUNCTION__);
+			return false;
+		}
 	}
 
-	if (!pKey || !(*pKey))
+	if (mergeLocal)
 	{
-		return defaultValue;
+		mergeLocalChanges(jsonDoc);
 	}
-
-	auto it = m_jsonDoc.FindMember(pKey);
-	if (it != m_jsonDoc.MemberEnd())
+	if (changedKeys)
 	{
-		auto &node = it->value;
-		if (node.IsInt())
-		{
-			return node.GetInt();
-		}
+		diffKeys(jsonDoc, *changedKeys);
 	}
 
-	rapidjson::Value jsonValue(defaultValue);
-	rapidjson::Document::AllocatorType &allocator = m_jsonDoc.GetAllocator();
-	m_jsonDoc.RemoveMember(pKey);
-	m_jsonDoc.AddMember(rapidjson::Value(pKey, allocator).Move(), jsonValue, allocator);
-	saveOnGetDefault();
+	// 旧的m_jsonDoc不再引用m_loadBuffer之后才能替换，后台保存的快照还引用旧的时由快照释放
+	assignJsonDoc(jsonDoc, allocator.Size());
+	m_loadBuffer = buffer;
+	m_keyIndex->Rebuild(m_jsonDoc);
 
-	return defaultValue;
+	m_metrics->Record(MS_PARSE, MetricsRecorder::Now() - start, length);
+	return true;
 }
 
-float RemoteSave::getFloatForKey(const char *pKey, float defaultValue /* = 0.f */)
-{
-	if (!m_inited)
-	{
-		return defaultValue;
-	}
-
-	if (!pKey || !(*pKey))
+void RemoteSaveSession::mergeLocalChanges(rapidjson::Document &jsonDoc)
+{
+	auto &allocator = jsonDoc.GetAllocator();
+	for (auto &key : m_removedKeys)
 	{
-		return defaultValue;
+		// 删除后又设置过的键在下面处理
+		if (!findValue(key.c_str()))
+		{
+			jsonDoc.RemoveMember(key.c_str());
+		}
 	}
 
-	auto it = m_jsonDoc.FindMember(pKey);
-	if (it != m_jsonDoc.MemberEnd())
+	KeyIndex index;
+	index.Rebuild(jsonDoc);
+	auto &dirty = m_keyIndex->dirty;
+	auto member = m_jsonDoc.MemberBegin();
+	for (size_t i = 0; i < dirty.size(); ++i, ++member)
 	{
-		auto &node = it->value;
-		if (node.IsDouble())
+		if (!dirty[i])
 		{
-			return node.GetDouble();
+			continue;
 		}
-	}
 
-	rapidjson::Value jsonValue(defaultValue);
-	rapidjson::Document::AllocatorType &allocator = m_jsonDoc.GetAllocator();
-	m_jsonDoc.RemoveMember(pKey);
-	m_jsonDoc.AddMember(rapidjson::Value(pKey, allocator).Move(), jsonValue, allocator);
-	saveOnGetDefault();
+		auto &name = member->name;
+		auto hash = KeyIndex::Hash(name.GetString(), name.GetStringLength());
+		auto slot = index.Find(jsonDoc, name.GetString(), name.GetStringLength(), hash);
+		// 改变过的值都是setValue()复制进m_jsonDoc内存池的，不会指向将被替换的m_loadBuffer
+		rapidjson::Value value;
+		value.CopyFrom(member->value, allocator);
+		if (slot->member != KeyIndex::EmptySlot)
+		{
+			(jsonDoc.MemberBegin() + slot->member)->value = value;
+			continue;
+		}
 
-	return defaultValue;
+		jsonDoc.AddMember(rapidjson::Value(name.GetString(), name.GetStringLength(), allocator).Move(), value, allocator);
+		index.Insert(hash, jsonDoc.MemberCount() - 1);
+	}
 }
 
-double RemoteSave::getDoubleForKey(const char *pKey, double defaultValue /* = 0. */)
+void RemoteSaveSession::diffKeys(rapidjson::Value &jsonDoc, std::vector<std::string> &changedKeys)
 {
-	if (!m_inited)
+	KeyIndex index;
+	index.Rebuild(jsonDoc);
+	for (auto member = jsonDoc.MemberBegin(); member != jsonDoc.MemberEnd(); ++member)
 	{
-		return defaultValue;
+		auto &name = member->name;
+		auto value = findValue(name.GetString());
+		if (!value || *value != member->value)
+		{
+			changedKeys.push_back(std::string(name.GetString(), name.GetStringLength()));
+		}
 	}
 
-	if (!pKey || !(*pKey))
+	if (!m_jsonDoc.IsObject())
 	{
-		return defaultValue;
+		return;
 	}
 
-	auto it = m_jsonDoc.FindMember(pKey);
-	if (it != m_jsonDoc.MemberEnd())
+	for (auto member = m_jsonDoc.MemberBegin(); member != m_jsonDoc.MemberEnd(); ++member)
 	{
-		auto &node = it->value;
-		if (node.IsDouble())
+		auto &name = member->name;
+		auto hash = KeyIndex::Hash(name.GetString(), name.GetStringLength());
+		if (index.Find(jsonDoc, name.GetString(), name.GetStringLength(), hash)->member == KeyIndex::EmptySlot)
 		{
-			return node.GetDouble();
+			changedKeys.push_back(std::string(name.GetString(), name.GetStringLength()));
 		}
 	}
-
-	rapidjson::Value jsonValue(defaultValue);
-	rapidjson::Document::AllocatorType &allocator = m_jsonDoc.GetAllocator();
-	m_jsonDoc.RemoveMember(pKey);
-	m_jsonDoc.AddMember(rapidjson::Value(pKey, allocator).Move(), jsonValue, allocator);
-	saveOnGetDefault();
-
-	return defaultValue;
 }
 
-std::string RemoteSave::getStringForKey(const char *pKey, const std::string &defaultValue /* = RemoteSave::NullString */)
+void RemoteSaveSession::sendRequestSaveGame()
 {
-	if (!m_inited)
+	// 只在没有保存等待回应时发送，增量的基准m_ackedSn是确定的
+	bool delta = m_saveMode == SM_DELTA && !m_fullSaveRequired && m_deltaSaveCount < m_fullSaveInterval;
+	m_savePending = false;
+
+	if (!m_jsonDoc.IsObject())
 	{
-		return defaultValue;
+		if (m_cbOnSave)
+		{
+			m_cbOnSave(EC_SAVE_DATA, NullString);
+		}
+		cocos2d::log("[%s]: m_jsonDoc is NOT a json obj", __PRETTY_FUNCTION__);
+		return;
 	}
 
-	if (!pKey || !(*pKey))
+	// 调用线程上只复制快照和记账，序列化之后的步骤在runSaveJob()中
+	auto start = MetricsRecorder::Now();
+	waitSaveJob();
+	if (!m_saveJob)
 	{
-		return defaultValue;
+		m_saveJob = std::make_shared<SaveJob>();
 	}
+	auto job = m_saveJob;
+	takeSaveSnapshot(*job, delta);
+	auto snapshotSize = job->allocator.Size();
 
-	auto it = m_jsonDoc.FindMember(pKey);
-	if (it != m_jsonDoc.MemberEnd())
+	// 传输层还持有上一个请求时（例如还在等待重试）不能修改它
+	if (!m_saveRequest || m_saveRequest.use_count() > 1)
 	{
-		auto &node = it->value;
-		if (node.IsString())
-		{
-			auto str = node.GetString();
-			auto len = node.GetStringLength();
-			std::string ret(str, len);
-			return ret;
-		}
+		m_saveRequest = std::make_shared<RemoteSaveTransport::Request>();
+	}
+	auto &request = m_saveRequest;
+	request->url = m_urlSave;
+	request->tag = "POST save data for uid: " + m_uid;
+	++m_sn;
+	auto sn = m_sn;
+	// 重试时请求原样重发，服务器据此识别同一次保存
+	request->headers.assign(1, "Idempotency-Key: " + m_requestIdPrefix + "-" + std::to_string(sn));
+	m_saveAttempts = 0;
+
+	job->request = request;
+	job->delta = delta;
+	job->format = m_payloadFormat;
+	job->sn = sn;
+	job->baseSn = m_ackedSn;
+
+	// 这次保存已经包含了所有改变，之后的改变重新记录
+	clearDirtyKeys();
+	if (delta)
+	{
+		++m_deltaSaveCount;
+		m_metrics->Count(MC_DELTA_SAVES);
 	}
+	else
+	{
+		m_deltaSaveCount = 0;
+		m_fullSaveRequired = false;
+	}
+	m_saveInFlight = true;
+	m_metrics->Count(MC_SAVES);
 
-	rapidjson::Document::AllocatorType &allocator = m_jsonDoc.GetAllocator();
+	if (m_backgroundSave)
+	{
+		job->running = true;
+		// 失败在主线程处理，那时可能已经release()，m_aesContext和m_keyIndex都已释放，
+		// 和请求的回应一样按m_generation丢弃
+		std::weak_ptr<bool> alive = m_alive;
+		auto generation = m_generation;
+		auto scheduler = cocos2d::Director::getInstance()->getScheduler();
+		m_context->m_workerPool->Post([this, job, alive, generation, scheduler]()
+		{
+			if (!runSaveJob(*job))
+			{
+				scheduler->performFunctionInCocosThread([this, alive, generation]()
+				{
+					if (!alive.expired() && generation == m_generation)
+					{
+						onSaveJobFailed();
+					}
+				});
+			}
 
-	rapidjson::Value jsonValue;
-	jsonValue.SetString(defaultValue.c_str(), defaultValue.size(), allocator);
+			std::lock_guard<std::mutex> lock(job->mutex);
+			job->running = false;
+			job->done.notify_all();
+		});
+	}
 
-	m_jsonDoc.RemoveMember(pKey);
-	m_jsonDoc.AddMember(rapidjson::Value(pKey, allocator).Move(), jsonValue, allocator);
-	saveOnGetDefault();
+	// 可能整理日志，用到m_saveBuffer，不和后台的保存共用缓冲区
+	journalSaveState("sent", sn);
 
-	return defaultValue;
+	if (!m_backgroundSave && !runSaveJob(*job))
+	{
+		onSaveJobFailed();
+	}
+	m_metrics->Record(MS_SAVE_MAIN, MetricsRecorder::Now() - start, snapshotSize);
 }
 
-cocos2d::Data RemoteSave::getDataForKey(const char *pKey, const cocos2d::Data &defaultValue /* = cocos2d::Data::Null */)
+void RemoteSaveSession::takeSaveSnapshot(SaveJob &job, bool delta)
 {
-	if (!m_inited)
+	auto &allocator = job.allocator;
+	auto &snapshot = job.snapshot;
+	snapshot.SetNull();
+	allocator.Clear();
+	// 加载来的字符串只复制指针，快照持有m_loadBuffer直到序列化完成
+	job.loadBuffer = m_loadBuffer;
+
+	if (!delta)
 	{
-		return defaultValue;
+		snapshot.CopyFrom(m_jsonDoc, allocator);
+		return;
 	}
 
-	if (!pKey || !(*pKey))
+	// {"set":{改变的键值},"remove":[删除的键]}
+	rapidjson::Value set(rapidjson::kObjectType);
+	auto &dirty = m_keyIndex->dirty;
+	auto member = m_jsonDoc.MemberBegin();
+	for (size_t i = 0; i < dirty.size(); ++i, ++member)
 	{
-		return defaultValue;
+		if (dirty[i])
+		{
+			rapidjson::Value name(member->name, allocator);
+			rapidjson::Value value(member->value, allocator);
+			set.AddMember(name, value, allocator);
+		}
 	}
-
-	auto it = m_jsonDoc.FindMember(pKey);
-	if (it != m_jsonDoc.MemberEnd())
+	rapidjson::Value remove(rapidjson::kArrayType);
+	for (auto &key : m_removedKeys)
 	{
-		auto &node = it->value;
-		if (node.IsString())
+		// 删除后又设置过的键已经在set中
+		if (!findValue(key.c_str()))
 		{
-			auto str = node.GetString();
-			auto len = node.GetStringLength();
-
-			unsigned char *decodedData = nullptr;
-			auto decodedDataLen = cocos2d::base64Decode((const unsigned char *)str, len, &decodedData);
-			if (decodedData)
-			{
-				cocos2d::Data ret;
-				ret.fastSet(decodedData, decodedDataLen);
-				return ret;
-			}
+			remove.PushBack(rapidjson::Value(key.data(), (rapidjson::SizeType)key.size(), allocator).Move(), allocator);
 		}
 	}
+	snapshot.SetObject();
+	snapshot.AddMember(rapidjson::StringRef("set"), set, allocator);
+	snapshot.AddMember(rapidjson::StringRef("remove"), remove, allocator);
+}
 
-	char *encodedData = nullptr;
-	auto encodedDataLen = cocos2d::base64Encode(defaultValue.getBytes(), defaultValue.getSize(), &encodedData);
-	if (!encodedData)
+bool RemoteSaveSession::runSaveJob(SaveJob &job)
+{
+	// 序列化、加密都在job.buffer中原地完成，PF_GCM的头部预留在JSON之前
+	auto &buffer = job.buffer;
+	size_t offset = job.format != PF_CBC ? PayloadHeaderSize : 0;
+	auto start = MetricsRecorder::Now();
+	bool serialized = saveToBuffer(job.snapshot, buffer, offset);
+	// 快照用完就释放，不再占着m_loadBuffer
+	job.snapshot.SetNull();
+	job.allocator.Clear();
+	job.loadBuffer.reset();
+	if (!serialized)
 	{
-		CCLOG("[%s]: base64Encode() failed", __PRETTY_FUNCTION__);
+		cocos2d::log("[%s]: saveToBuffer failed", __PRETTY_FUNCTION__);
+		job.request.reset();
+		return false;
 	}
-	else
-	{
-		rapidjson::Document::AllocatorType &allocator = m_jsonDoc.GetAllocator();
 
-		rapidjson::Value jsonValue;
-		jsonValue.SetString(encodedData, encodedDataLen, allocator);
+	auto now = MetricsRecorder::Now();
+	m_metrics->Record(MS_SERIALIZE, now - start, buffer.size() - offset);
+	start = now;
+	REMOTESAVE_LOG_PAYLOAD("[%s]: save game: %s", __PRETTY_FUNCTION__, buffer.c_str() + offset);
 
-		m_jsonDoc.RemoveMember(pKey);
-		m_jsonDoc.AddMember(rapidjson::Value(pKey, allocator).Move(), jsonValue, allocator);
-		saveOnGetDefault();
-
-		free(encodedData); encodedData = nullptr;
+	if (job.format == PF_GCM_LZ4)
+	{
+		__RemoveSave_private::Lz4CompressBuffer(buffer, offset, job.compressBuffer);
 	}
-
-	return defaultValue;
+	encryptBuffer(buffer, offset, job.format);
+	now = MetricsRecorder::Now();
+	m_metrics->Record(MS_ENCRYPT, now - start, buffer.size());
+	start = now;
+
+	// write the post data，save_data边base64边写入，不生成中间字符串
+	auto &postData = job.request->data;
+	postData.clear();
+	postData += "user_id=";
+	appendPostData(postData, m_uidEncoded.data(), m_uidEncoded.size());
+	postData += "&sn=";
+	postData += std::to_string(job.sn);
+	postData += "&version=";
+	appendPostData(postData, m_version.data(), m_version.size());
+	if (job.delta)
+	{
+		postData += "&base_sn=";
+		postData += std::to_string(job.baseSn);
+	}
+	postData += "&save_data=";
+	unsigned long long base64Nanos = 0;
+	appendPostDataBase64(postData, (const unsigned char*)buffer.data(), buffer.size(), &base64Nanos);
+	// base64和转义交替进行，转义的时间是总时间减去base64的
+	now = MetricsRecorder::Now();
+	m_metrics->Record(MS_BASE64_ENCODE, base64Nanos, __RemoveSave_private::Base64EncodedSize(buffer.size()));
+	m_metrics->Record(MS_FORM_ENCODE, now - start - base64Nanos, postData.size());
+	REMOTESAVE_LOG_PAYLOAD("[%s]: Post request, url: %s, data: %s", __PRETTY_FUNCTION__, job.request->url.c_str(), postData.c_str());
+
+	sendSave(job.request, job.sn, job.delta);
+	job.request.reset();
+	return true;
 }
 
-void RemoteSave::setBoolForKey(const char *pKey, bool value)
+void RemoteSaveSession::onSaveJobFailed()
 {
-	if (!m_inited)
+	// 改变已经不再标记，下次上传完整存档
+	m_saveInFlight = false;
+	m_fullSaveRequired = true;
+	m_metrics->Count(MC_FAILED_SAVES);
+	if (m_cbOnSave)
 	{
-		return;
+		m_cbOnSave(EC_SAVE_DATA, NullString);
 	}
 
-	if (!pKey || !(*pKey))
+	sendPendingSave();
+}
+
+void RemoteSaveSession::waitSaveJob()
+{
+	if (!m_saveJob)
 	{
 		return;
 	}
 
-	auto it = m_jsonDoc.FindMember(pKey);
-	if (it != m_jsonDoc.MemberEnd())
+	std::unique_lock<std::mutex> lock(m_saveJob->mutex);
+	auto &job = *m_saveJob;
+	job.done.wait(lock, [&job] { return !job.running; });
+}
+
+void RemoteSaveSession::sendSave(const TransportRequest &request, unsigned long long sn, bool delta)
+{
+	m_saveSentAt = MetricsRecorder::Now();
+	std::weak_ptr<bool> alive = m_alive;
+	auto generation = m_generation;
+	m_transport->send(request, [this, alive, generation, request, sn, delta](RemoteSaveTransport::Response &response)
 	{
-		auto &node = it->value;
-		if (node.IsBool())
+		if (!alive.expired() && generation == m_generation)
 		{
-			auto curValue = node.GetBool();
-			if (curValue == value)
-			{
-				return;
-			}
+			onHttpRequestCompletedSaveGame(request, response, sn, delta);
 		}
-	}
-
-	rapidjson::Value jsonValue(value);
-	rapidjson::Document::AllocatorType &allocator = m_jsonDoc.GetAllocator();
-	m_jsonDoc.RemoveMember(pKey);
-	m_jsonDoc.AddMember(rapidjson::Value(pKey, allocator).Move(), jsonValue, allocator);
-	saveOnChangeValue();
+	});
 }
 
-void RemoteSave::setIntegerForKey(const char *pKey, int value)
+void RemoteSaveSession::onHttpRequestCompletedSaveGame(const TransportRequest &request, RemoteSaveTransport::Response &response,
+												unsigned long long sn, bool delta)
 {
 	if (!m_inited)
 	{
 		return;
 	}
 
-	if (!pKey || !(*pKey))
-	{
-		return;
-	}
+	m_saveInFlight = false;
+	cocos2d::log("[%s]: Receive response: %s", __PRETTY_FUNCTION__, request->tag.c_str());
+
+	auto statusCode = response.statusCode;
+	cocos2d::log("[%s]: HTTP Status Code: %ld", __PRETTY_FUNCTION__, statusCode);
+	m_metrics->Record(MS_HTTP_SAVE, MetricsRecorder::Now() - m_saveSentAt, request->data.size());
 
-	auto it = m_jsonDoc.FindMember(pKey);
-	if (it != m_jsonDoc.MemberEnd())
+	ErrorCode code = EC_OK;
+	std::string msg;
+	do 
 	{
-		auto &node = it->value;
-		if (node.IsInt())
+		if (!response.succeeded)
 		{
-			auto curValue = node.GetInt();
-			if (curValue == value)
+			if (scheduleRetry(response, request->tag, m_saveAttempts, m_saveRetry, RetrySaveScheduleKey,
+							  [this, request, sn, delta]() { sendSave(request, sn, delta); }))
 			{
+				m_metrics->Count(MC_SAVE_RETRIES);
+				// 重试的还是这次保存，之后的保存继续等待
+				m_saveInFlight = true;
 				return;
 			}
+
+			code = EC_RESPONSE;
+			msg = response.error;
+			cocos2d::log("[%s]: Response failed, error: %s", __PRETTY_FUNCTION__, msg.c_str());
+			break;
 		}
-	}
 
-	rapidjson::Value jsonValue(value);
-	rapidjson::Document::AllocatorType &allocator = m_jsonDoc.GetAllocator();
-	m_jsonDoc.RemoveMember(pKey);
-	m_jsonDoc.AddMember(rapidjson::Value(pKey, allocator).Move(), jsonValue, allocator);
-	saveOnChangeValue();
-}
+		auto &buffer = response.data;
+		auto text = std::string(buffer.begin(), buffer.end());
+		REMOTESAVE_LOG_PAYLOAD("[%s]: Response succeeded, buffer: %s", __PRETTY_FUNCTION__, text.c_str());
 
-void RemoteSave::setFloatForKey(const char *pKey, float value)
-{
-	if (!m_inited)
-	{
-		return;
-	}
+		if (delta && text == DeltaRejected)
+		{
+			// 服务器上的存档不是增量的基准，改为上传完整存档，由那次保存回调。
+			// 和等待中的保存一样经过sendPendingSave()，已经release()时不再发送
+			cocos2d::log("[%s]: delta rejected, base sn: %s, resend full save", __PRETTY_FUNCTION__,
+						 std::to_string(m_ackedSn).c_str());
+			m_fullSaveRequired = true;
+			m_savePending = true;
+			sendPendingSave();
+			return;
+		}
 
-	if (!pKey || !(*pKey))
+		if (text != "Done")
+		{
+			code = EC_SAVE_RESULT;
+			msg = text;
+			cocos2d::log("[%s]: save failed, %s", __PRETTY_FUNCTION__, msg.c_str());
+			break;
+		}
+
+		if (sn > m_ackedSn)
+		{
+			m_ackedSn = sn;
+		}
+		journalSaveState("ack", sn);
+	} while (0);
+
+	// 失败的保存里的改变已经不再标记，服务器上的存档也不确定，下次上传完整存档
+	if (code != EC_OK)
 	{
-		return;
+		m_fullSaveRequired = true;
+		m_metrics->Count(MC_FAILED_SAVES);
 	}
 
-	auto it = m_jsonDoc.FindMember(pKey);
-	if (it != m_jsonDoc.MemberEnd())
+	if (m_cbOnSave)
 	{
-		auto &node = it->value;
-		if (node.IsDouble())
-		{
-			auto curValue = node.GetDouble();
-			if (curValue == value)
-			{
-				return;
-			}
-		}
+		m_cbOnSave(code, msg);
 	}
 
-	rapidjson::Value jsonValue(value);
-	rapidjson::Document::AllocatorType &allocator = m_jsonDoc.GetAllocator();
-	m_jsonDoc.RemoveMember(pKey);
-	m_jsonDoc.AddMember(rapidjson::Value(pKey, allocator).Move(), jsonValue, allocator);
-	saveOnChangeValue();
+	sendPendingSave();
 }
 
-void RemoteSave::setDoubleForKey(const char *pKey, double value)
+void RemoteSaveSession::sendPendingSave()
 {
-	if (!m_inited)
+	// 回调中可能已经调用save()直接发送，或者release()
+	if (!m_savePending || m_saveInFlight || !m_inited || waitingForServer())
 	{
 		return;
 	}
 
-	if (!pKey || !(*pKey))
+	sendRequestSaveGame();
+}
+
+namespace __RemoveSave_private
+{
+	// rapidjson::Writer的输出流，直接追加到std::string，复用其已有容量
+	struct StringAppendStream
 	{
-		return;
-	}
+		typedef char Ch;
+
+		StringAppendStream(std::string &str) : str(str) {}
+		void Put(char c) { str.push_back(c); }
+		void Flush() {}
+
+		std::string &str;
+	};
+}
+
+bool RemoteSaveSession::saveToBuffer(const rapidjson::Value &value, std::string &buffer, size_t offset /* = 0 */)
+{
+	buffer.resize(offset);
 
-	auto it = m_jsonDoc.FindMember(pKey);
-	if (it != m_jsonDoc.MemberEnd())
+	__RemoveSave_private::StringAppendStream jsonStream(buffer);
+	rapidjson::Writer<__RemoveSave_private::StringAppendStream> jsonWriter(jsonStream);
+	if (!value.Accept(jsonWriter))
 	{
-		auto &node = it->value;
-		if (node.IsDouble())
-		{
-			auto curValue = node.GetDouble();
-			if (curValue == value)
-			{
-				return;
-			}
-		}
+		cocos2d::log("[%s]: value.Accept() failed", __PRETTY_FUNCTION__);
+		buffer.clear();
+		return false;
 	}
 
-	rapidjson::Value jsonValue(value);
-	rapidjson::Document::AllocatorType &allocator = m_jsonDoc.GetAllocator();
-	m_jsonDoc.RemoveMember(pKey);
-	m_jsonDoc.AddMember(rapidjson::Value(pKey, allocator).Move(), jsonValue, allocator);
-	saveOnChangeValue();
+	return true;
 }
 
-void RemoteSave::setStringForKey(const char *pKey, const std::string &value)
+bool RemoteSaveSession::selfTest()
 {
-	if (!m_inited)
+	return __RemoveSave_private::AES128_CBC_selfTest() && __RemoveSave_private::AES128_GCM_selfTest();
+}
+
+void RemoteSaveSession::clearDirtyKeys()
+{
+	auto &dirty = m_keyIndex->dirty;
+	if (!dirty.empty())
 	{
-		return;
+		memset(&dirty[0], 0, dirty.size());
 	}
+	m_removedKeys.clear();
+}
 
-	if (!pKey || !(*pKey))
+void RemoteSaveSession::encryptBuffer(std::string &buffer, size_t offset, PayloadFormat format) const
+{
+	auto sizeIn = buffer.size() - offset;
+
+	if (format != PF_CBC)
 	{
-		return;
+		buffer.resize(buffer.size() + PayloadTagSize);
+
+		auto header = (unsigned char*)&buffer[0];
+		auto nonce = header + sizeof(PayloadMagic) + 1;
+		memcpy(header, PayloadMagic, sizeof(PayloadMagic));
+		header[sizeof(PayloadMagic)] = format == PF_GCM_LZ4 ? PayloadFlagLz4 : 0;
+		// 所有用户共用一个密钥，nonce必须随机生成，不能由uid/sn推出
+		__RemoveSave_private::GenerateNonce(nonce, PayloadNonceSize);
+		auto length = nonce + PayloadNonceSize;
+		length[0] = (unsigned char)(sizeIn >> 24);
+		length[1] = (unsigned char)(sizeIn >> 16);
+		length[2] = (unsigned char)(sizeIn >> 8);
+		length[3] = (unsigned char)sizeIn;
+
+		auto data = header + PayloadHeaderSize;
+		__RemoveSave_private::AES128_GCM_encrypt(m_aesContext.get(), data, data, sizeIn,
+												 nonce, header, PayloadHeaderSize, data + sizeIn, m_context->m_workerPool);
 	}
-
-	auto it = m_jsonDoc.FindMember(pKey);
-	if (it != m_jsonDoc.MemberEnd())
+	else
 	{
-		auto &node = it->value;
-		if (node.IsString())
+		auto k = sizeIn % 16; // 128 bit
+		if (k)
 		{
-			auto str = node.GetString();
-			auto len = node.GetStringLength();
-			std::string curValue(str, len);
-			if (curValue == value)
-			{
-				return;
-			}
+			// 0填充
+			buffer.resize(buffer.size() + 16 - k, '\0');
 		}
+		auto data = (unsigned char*)&buffer[offset];
+		__RemoveSave_private::AES128_CBC_encrypt_buffer(m_aesContext.get(), data, data, buffer.size() - offset);
 	}
+}
 
-	rapidjson::Document::AllocatorType &allocator = m_jsonDoc.GetAllocator();
-
-	rapidjson::Value jsonValue;
-	jsonValue.SetString(value.data(), value.size(), allocator);
+void RemoteSaveSession::base64Encode(const unsigned char *data, size_t size, std::string &out)
+{
+	out.resize(__RemoveSave_private::Base64EncodedSize(size));
+	if (size)
+	{
+		__RemoveSave_private::Base64Encode(&out[0], data, size);
+	}
+}
 
-	m_jsonDoc.RemoveMember(pKey);
-	m_jsonDoc.AddMember(rapidjson::Value(pKey, allocator).Move(), jsonValue, allocator);
-	saveOnChangeValue();
+bool RemoteSaveSession::base64Decode(const char *in, size_t size, std::string &out)
+{
+	out.resize(__RemoveSave_private::Base64DecodeBufferSize(size));
+	size_t length = 0;
+	bool ok = __RemoveSave_private::Base64Decode((unsigned char*)&out[0], &length, in, size);
+	out.resize(length);
+	return ok;
 }
 
-void RemoteSave::setDataForKey(const char *pKey, const cocos2d::Data &value)
+void RemoteSaveSession::encode(const std::string &in, std::string &out, PayloadFormat format /* = PF_CBC */) const
 {
-	if (!m_inited)
+	size_t offset = format != PF_CBC ? PayloadHeaderSize : 0;
+	std::string buffer;
+	buffer.reserve(offset + in.size() + PayloadTagSize + 16);
+	buffer.resize(offset);
+	buffer += in;
+	if (format == PF_GCM_LZ4)
 	{
-		return;
+		std::string scratch;
+		__RemoveSave_private::Lz4CompressBuffer(buffer, offset, scratch);
 	}
+	encryptBuffer(buffer, offset, format);
 
-	if (!pKey || !(*pKey))
+	out.resize(__RemoveSave_private::Base64EncodedSize(buffer.size()));
+	__RemoveSave_private::Base64Encode(&out[0], (const unsigned char*)buffer.data(), buffer.size());
+}
+
+bool RemoteSaveSession::decode(const char *in, size_t size, std::string &scratch, std::string &out, size_t &offset) const
+{
+	offset = 0;
+	auto start = MetricsRecorder::Now();
+	scratch.resize(__RemoveSave_private::Base64DecodeBufferSize(size));
+	auto data = (unsigned char*)&scratch[0];
+	size_t sizeData = 0;
+	if (!__RemoveSave_private::Base64Decode(data, &sizeData, in, size))
 	{
-		return;
+		cocos2d::log("[%s]: base64Decode() failed", __PRETTY_FUNCTION__);
+		out = "";
+		return false;
 	}
+	auto now = MetricsRecorder::Now();
+	m_metrics->Record(MS_BASE64_DECODE, now - start, sizeData);
+	start = now;
 
-	auto valueBuffer = value.getBytes();
-	auto valueSize = value.getSize();
-
-	auto it = m_jsonDoc.FindMember(pKey);
-	if (it != m_jsonDoc.MemberEnd())
+	// 以魔数、flags和长度一致来识别PF_GCM格式，其余都按旧的CBC格式处理
+	if (!isGcmPayload(data, sizeData))
 	{
-		auto &node = it->value;
-		if (node.IsString())
+		// CBC按16字节一块解密，长度不是整块的数据已经损坏，解密会读写越界
+		if (sizeData % 16 != 0)
 		{
-			auto str = node.GetString();
-			auto len = node.GetStringLength();
-
-			unsigned char *decodedData = nullptr;
-			auto decodedDataLen = cocos2d::base64Decode((const unsigned char *)str, len, &decodedData);
-			if (decodedData)
-			{
-				if (decodedDataLen == valueSize)
-				{
-					if (memcmp(valueBuffer, decodedData, valueSize) == 0)
-					{
-						return;
-					}
-				}
-				free(decodedData); decodedData = nullptr;
-			}
+			cocos2d::log("[%s]: CBC payload of %s bytes is not whole blocks", __PRETTY_FUNCTION__, std::to_string(sizeData).c_str());
+			out = "";
+			return false;
 		}
+
+		// 2015/12/10-18:06 by YYBear [TODO] 这里的实际解密后的Size实际上是错误的，尾部可能会有填充的0，但是由于这里最后解密出来的应该是个json字符串，所以尾部的0不会产生影响
+		out.resize(sizeData);
+		__RemoveSave_private::AES128_CBC_decrypt_buffer(m_aesContext.get(), (unsigned char*)&out[0], data, sizeData);
+		m_metrics->Record(MS_DECRYPT, MetricsRecorder::Now() - start, sizeData);
+		return true;
+	}
+
+	// 校验通过后原地解密，校验失败的数据不会被解密，更不会交给loadWithBuffer解析
+	auto sizePlain = sizeData - PayloadHeaderSize - PayloadTagSize;
+	auto plain = data + PayloadHeaderSize;
+	if (!__RemoveSave_private::AES128_GCM_decrypt(m_aesContext.get(), plain, plain, sizePlain,
+												  data + sizeof(PayloadMagic) + 1, data, PayloadHeaderSize, plain + sizePlain,
+												  m_context->m_workerPool))
+	{
+		cocos2d::log("[%s]: GCM tag mismatch, payload corrupted", __PRETTY_FUNCTION__);
+		out = "";
+		return false;
 	}
 
-	char *encodedData = nullptr;
-	auto encodedDataLen = cocos2d::base64Encode(valueBuffer, valueSize, &encodedData);
-	if (!encodedData)
+	if (data[sizeof(PayloadMagic)] & PayloadFlagLz4)
 	{
-		CCLOG("[%s]: base64Encode() failed", __PRETTY_FUNCTION__);
+		if (!decompress(plain, sizePlain, out))
+		{
+			return false;
+		}
 	}
 	else
 	{
-		rapidjson::Document::AllocatorType &allocator = m_jsonDoc.GetAllocator();
-
-		rapidjson::Value jsonValue;
-		jsonValue.SetString(encodedData, encodedDataLen, allocator);
-
-		m_jsonDoc.RemoveMember(pKey);
-		m_jsonDoc.AddMember(rapidjson::Value(pKey, allocator).Move(), jsonValue, allocator);
-		saveOnChangeValue();
-
-		free(encodedData); encodedData = nullptr;
+		// 截掉tag，明文留在原处，交换出去
+		scratch.resize(PayloadHeaderSize + sizePlain);
+		out.swap(scratch);
+		offset = PayloadHeaderSize;
 	}
+	m_metrics->Record(MS_DECRYPT, MetricsRecorder::Now() - start, out.size() - offset);
+	return true;
 }
 
-bool RemoteSave::init(const std::string &uid, const std::string &version,
-					  const std::string &key, const std::string &iv, 
-					  const std::string &urlLoad, const std::string &urlSave)
+bool RemoteSaveSession::decryptBuffer(const unsigned char *data, size_t size, std::string &out) const
 {
-	if (m_inited)
+	if (!isGcmPayload(data, size))
 	{
-		cocos2d::log("[%s]: already inited", __PRETTY_FUNCTION__);
+		out = "";
 		return false;
 	}
 
-	if (uid.empty())
+	// 校验失败的数据不会被解密，更不会交给loadWithBuffer解析
+	auto header = data;
+	auto sizePlain = size - PayloadHeaderSize - PayloadTagSize;
+	out.resize(sizePlain);
+	if (!__RemoveSave_private::AES128_GCM_decrypt(m_aesContext.get(), (unsigned char*)&out[0], header + PayloadHeaderSize, sizePlain,
+												  header + sizeof(PayloadMagic) + 1, header, PayloadHeaderSize,
+												  header + PayloadHeaderSize + sizePlain, m_context->m_workerPool))
 	{
-		cocos2d::log("[%s]: empty uid", __PRETTY_FUNCTION__);
+		cocos2d::log("[%s]: GCM tag mismatch, payload corrupted", __PRETTY_FUNCTION__);
+		out = "";
 		return false;
 	}
 
-	if (version.empty())
+	if (header[sizeof(PayloadMagic)] & PayloadFlagLz4)
 	{
-		cocos2d::log("[%s]: empty version", __PRETTY_FUNCTION__);
-		return false;
+		std::string compressed;
+		compressed.swap(out);
+		return decompress((const unsigned char*)compressed.data(), compressed.size(), out);
 	}
+	return true;
+}
 
-	if (key.size() < 16)
+bool RemoteSaveSession::isGcmPayload(const unsigned char *data, size_t size)
+{
+	if (size < PayloadHeaderSize + PayloadTagSize
+		|| memcmp(data, PayloadMagic, sizeof(PayloadMagic)) != 0
+		|| (data[sizeof(PayloadMagic)] & ~PayloadFlagLz4) != 0)
 	{
-		cocos2d::log("[%s]: invalid key: %s", __PRETTY_FUNCTION__, key.c_str());
 		return false;
 	}
 
-	if (iv.size() < 16)
+	auto length = data + sizeof(PayloadMagic) + 1 + PayloadNonceSize;
+	size_t sizePlain = ((size_t)length[0] << 24) | ((size_t)length[1] << 16) | ((size_t)length[2] << 8) | (size_t)length[3];
+	return sizePlain == size - PayloadHeaderSize - PayloadTagSize;
+}
+
+bool RemoteSaveSession::decompress(const unsigned char *data, size_t size, std::string &out)
+{
+	size_t sizeRaw = 0;
+	if (size >= 4)
 	{
-		cocos2d::log("[%s]: invalid iv: %s", __PRETTY_FUNCTION__, iv.c_str());
-		return false;
+		sizeRaw = ((size_t)data[0] << 24) | ((size_t)data[1] << 16) | ((size_t)data[2] << 8) | (size_t)data[3];
 	}
 
-	m_uid = uid;
-	m_version = version;
-	m_key = key;
-	m_iv = iv;
-	m_urlLoad = urlLoad;
-	m_urlSave = urlSave;
-
-	m_sn = 0;
-	m_jsonDoc.SetNull();
-	m_inited = true;
+	bool ret = size >= 4 && sizeRaw <= PayloadMaxPlainSize;
+	if (ret)
+	{
+		out.resize(sizeRaw);
+		ret = __RemoveSave_private::Lz4Decompress((unsigned char*)&out[0], sizeRaw, data + 4, size - 4);
+	}
 
+	if (!ret)
+	{
+		cocos2d::log("[%s]: LZ4 decompress failed", __PRETTY_FUNCTION__);
+		out = "";
+		return false;
+	}
 	return true;
 }
 
-void RemoteSave::release()
+void RemoteSaveSession::appendPostData(std::string &dataOut, const char *data, size_t size)
 {
-    if (!m_inited)
-    {
-        return;
-    }
-    
-    m_inited = false;
-    m_sn = 0;
-    m_jsonDoc.SetObject();
+	// 按最坏情况一次性分配，编码后再截掉多余部分
+	auto pos = dataOut.size();
+	dataOut.resize(pos + __RemoveSave_private::FormEncodedMaxSize(size));
+	auto n = __RemoveSave_private::FormEncode(&dataOut[pos], data, size);
+	dataOut.resize(pos + n);
 }
 
-void RemoteSave::load()
+void RemoteSaveSession::appendPostDataBase64(std::string &dataOut, const unsigned char *data, size_t size,
+									  unsigned long long *base64Nanos /* = nullptr */)
 {
-	if (!m_inited)
+	// 分块编码到栈上的缓冲区，块大小是3的倍数，拼接结果和整体编码一致
+	// 每块编码后立即转义写入dataOut，dataOut按最坏情况一次性分配
+	const size_t chunkIn = 3 * 1024;
+	char chunk[4 * 1024];
+
+	auto pos = dataOut.size();
+	dataOut.resize(pos + __RemoveSave_private::FormEncodedMaxSize(__RemoveSave_private::Base64EncodedSize(size)));
+	auto out = &dataOut[pos];
+	for (size_t offset = 0; offset < size; offset += chunkIn)
 	{
-		return;
+		auto start = base64Nanos ? MetricsRecorder::Now() : 0;
+		auto n = __RemoveSave_private::Base64Encode(chunk, data + offset, std::min(chunkIn, size - offset));
+		if (base64Nanos)
+		{
+			*base64Nanos += MetricsRecorder::Now() - start;
+		}
+		out += __RemoveSave_private::FormEncode(out, chunk, n);
 	}
-
-	sendRequestLoadGame();
+	dataOut.resize(out - dataOut.data());
 }
 
-void RemoteSave::save()
+namespace __RemoveSave_private
 {
-	if (!m_inited)
+	// Read-only view of a whole file: mapped on POSIX systems, read into memory on Windows.
+	class MappedFile
 	{
-		return;
-	}
+	public:
+		explicit MappedFile(const std::string& path)
+			: m_data(nullptr)
+			, m_size(0)
+		{
+#ifdef _WIN32
+			FILE* file = fopen(path.c_str(), "rb");
+			if (!file)
+			{
+				return;
+			}
+			fseek(file, 0, SEEK_END);
+			long size = ftell(file);
+			fseek(file, 0, SEEK_SET);
+			if (size > 0)
+			{
+				m_buffer.resize(size);
+				if (fread(&m_buffer[0], 1, size, file) == (size_t)size)
+				{
+					m_data = &m_buffer[0];
+					m_size = size;
+				}
+			}
+			fclose(file);
+#else
+			int fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0)
+			{
+				return;
+			}
+			struct stat st;
+			if (fstat(fd, &st) == 0 && st.st_size > 0)
+			{
+				void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (data != MAP_FAILED)
+				{
+					m_data = (const uint8_t*)data;
+					m_size = st.st_size;
+				}
+			}
+			close(fd);
+#endif
+		}
 
-	sendRequestSaveGame();
-}
+		~MappedFile()
+		{
+#ifndef _WIN32
+			if (m_data)
+			{
+				munmap((void*)m_data, m_size);
+			}
+#endif
+		}
 
-void RemoteSave::sendRequestLoadGame()
-{
-	cocos2d::network::HttpRequest* request = new (std::nothrow) cocos2d::network::HttpRequest();
-	request->setUrl(m_urlLoad.c_str());
-	request->setRequestType(cocos2d::network::HttpRequest::Type::POST);
-	request->setResponseCallback(CC_CALLBACK_2(RemoteSave::onHttpRequestCompletedLoadGame, this));
+		const uint8_t* Data() const { return m_data; }
+		size_t Size() const { return m_size; }
 
-	std::string uid;
-	encode(m_uid, uid);
+	private:
+		MappedFile(const MappedFile&);
+		MappedFile& operator=(const MappedFile&);
 
-	auto postDataIn = "user_id=" + uid;
-	std::string postDataOut;
-	formatPostData(postDataIn, postDataOut);
+		const uint8_t* m_data;
+		size_t m_size;
+#ifdef _WIN32
+		std::vector<uint8_t> m_buffer;
+#endif
+	};
 
-	request->setRequestData(postDataOut.c_str(), postDataOut.length());
-	cocos2d::log("[%s]: Post request, url: %s, data: %s", __PRETTY_FUNCTION__, m_urlLoad.c_str(), postDataOut.c_str());
+	// Writes data and waits until it is on the disk.
+	bool WriteFileSynced(const std::string& path, const std::string& data)
+	{
+		FILE* file = fopen(path.c_str(), "wb");
+		if (!file)
+		{
+			return false;
+		}
 
-	auto tag = "POST load data for uid: " + m_uid;
-	request->setTag(tag.c_str());
-	cocos2d::network::HttpClient::getInstance()->sendImmediate(request);
-	request->release();
-}
+		bool ok = fwrite(data.data(), 1, data.size(), file) == data.size() && fflush(file) == 0;
+#ifdef _WIN32
+		ok = ok && _commit(_fileno(file)) == 0;
+#else
+		ok = ok && fsync(fileno(file)) == 0;
+#endif
+		return fclose(file) == 0 && ok;
+	}
 
-void RemoteSave::onHttpRequestCompletedLoadGame(cocos2d::network::HttpClient *sender, cocos2d::network::HttpResponse *response)
-{
-	if (!response)
+	// Atomic on POSIX systems. rename() on Windows does not replace an existing file, so the
+	// old one is removed first; if that is interrupted only the source file is left.
+	bool ReplaceFile(const std::string& from, const std::string& to)
 	{
-		return;
+#ifdef _WIN32
+		remove(to.c_str());
+#endif
+		return rename(from.c_str(), to.c_str()) == 0;
 	}
 
-	// You can get original request type from: response->request->reqType
-	auto tag = response->getHttpRequest()->getTag();
-	if (tag)
+	static unsigned long long GetUint64Member(const rapidjson::Value& object, const char* name)
 	{
-		cocos2d::log("[%s]: Receive response: %s", __PRETTY_FUNCTION__, tag);
+		auto member = object.FindMember(name);
+		return member != object.MemberEnd() && member->value.IsUint64() ? member->value.GetUint64() : 0;
 	}
+}
 
-	auto statusCode = response->getResponseCode();
-	cocos2d::log("[%s]: HTTP Status Code: %ld", __PRETTY_FUNCTION__, statusCode);
+void RemoteSaveSession::openJournal()
+{
+	auto journal = m_journal = new Journal;
 
-	ErrorCode code = EC_OK;
-	std::string msg;
-	do 
+	// 文件名用uid的64位FNV-1a，不暴露uid
+	unsigned long long hash = 14695981039346656037ull;
+	for (auto c : m_uid)
+	{
+		hash = (hash ^ (unsigned char)c) * 1099511628211ull;
+	}
+	char name[40];
+	snprintf(name, sizeof(name), "RemoteSave_%016llx", hash);
+	auto directory = m_journalDirectory;
+	if (directory.back() != '/' && directory.back() != '\\')
+	{
+		directory += '/';
+	}
+	journal->snapshotPath = directory + name + ".snapshot";
+	journal->journalPath = directory + name + ".journal";
+
+	// 替换快照时中断过的话只剩临时文件
+	bool restored = false;
+	auto snapshotBuffer = std::make_shared<std::string>();
+	std::string snapshotPaths[] = { journal->snapshotPath, journal->snapshotPath + ".tmp" };
+	for (auto &path : snapshotPaths)
 	{
-		if (!response->isSucceed())
+		__RemoveSave_private::MappedFile file(path);
+		if (!file.Size() || !decryptBuffer(file.Data(), file.Size(), *snapshotBuffer))
 		{
-			code = EC_RESPONSE;
-			msg = response->getErrorBuffer();
-			cocos2d::log("[%s]: Response failed, error: %s", __PRETTY_FUNCTION__, msg.c_str());
-			break;
+			continue;
 		}
 
-		auto buffer = response->getResponseData();
-		auto text = std::string(buffer->begin(), buffer->end());
-		cocos2d::log("[%s]: Response succeeded, buffer: %s", __PRETTY_FUNCTION__, text.c_str());
-
-		unsigned long long sn = 0;
-		std::string saveData;
-		if (!parseResponseLoadGame(text, sn, saveData))
+		// 和加载一样原地解析，快照的明文留作m_loadBuffer，解析后不再移动
+		rapidjson::Document snapshot;
+		snapshot.ParseInsitu(&(*snapshotBuffer)[0]);
+		if (snapshot.HasParseError() || !snapshot.IsObject())
 		{
-			code = EC_PARSE_RESPONSE;
-			msg = "";
-			cocos2d::log("[%s]: parseResponseLoadGame failed", __PRETTY_FUNCTION__);
-			break;
+			continue;
 		}
-
-		if (!loadWithBuffer(saveData))
+		auto data = snapshot.FindMember("data");
+		if (data == snapshot.MemberEnd() || !data->value.IsObject())
 		{
-			code = EC_LOAD_DATA;
-			msg = "";
-			cocos2d::log("[%s]: loadWithBuffer failed", __PRETTY_FUNCTION__);
-			break;
+			continue;
 		}
 
-		m_sn = sn;
-	} while (0);
-
-	if (m_cbOnLoad)
-	{
-		m_cbOnLoad(code, msg);
+		assignJsonDoc(data->value, snapshot.GetAllocator().Size());
+		m_loadBuffer = snapshotBuffer;
+		journal->generation = (uint32_t)__RemoveSave_private::GetUint64Member(snapshot, "generation");
+		journal->changes = __RemoveSave_private::GetUint64Member(snapshot, "changes");
+		journal->syncedChanges = __RemoveSave_private::GetUint64Member(snapshot, "synced_changes");
+		journal->sentSn = __RemoveSave_private::GetUint64Member(snapshot, "sent_sn");
+		journal->sentChanges = __RemoveSave_private::GetUint64Member(snapshot, "sent_changes");
+		journal->snapshotSize = file.Size();
+		m_sn = __RemoveSave_private::GetUint64Member(snapshot, "sn");
+		m_ackedSn = __RemoveSave_private::GetUint64Member(snapshot, "acked_sn");
+		restored = true;
+		break;
 	}
-}
-
-bool RemoteSave::parseResponseLoadGame(const std::string &buffer, unsigned long long &sn, std::string &saveData)
-{
-	if (buffer.empty())
+	if (!restored)
 	{
-		cocos2d::log("[%s]: buffer empty", __PRETTY_FUNCTION__);
-		return false;
+		assignJsonDoc(rapidjson::Value(rapidjson::kObjectType));
 	}
+	m_keyIndex->Rebuild(m_jsonDoc);
 
-	saveData = "";
-	sn = 0;
-	if (buffer != "NULL")
+	// 重放到第一条不完整或校验失败的记录为止，第一条记录是日志所属快照的generation
+	bool valid = false;
+	size_t offset = 0;
 	{
-		rapidjson::Document jsonDoc;
-		jsonDoc.Parse(buffer.c_str());
-		if (jsonDoc.HasParseError())  //打印解析错误
-		{
-			cocos2d::log("[%s]: jsonDoc.Parse() failed, Error: %d", __PRETTY_FUNCTION__,
-						 jsonDoc.GetParseError());
-			return false;
-		}
-
-		if (!jsonDoc.IsObject())
+		std::string plain;
+		__RemoveSave_private::MappedFile file(journal->journalPath);
+		auto data = file.Data();
+		auto size = file.Size();
+		bool first = true;
+		while (size - offset >= 4)
 		{
-			cocos2d::log("[%s]: jsonDoc is not an object", __PRETTY_FUNCTION__);
-			return false;
-		}
+			auto header = data + offset;
+			size_t length = ((size_t)header[0] << 24) | ((size_t)header[1] << 16) | ((size_t)header[2] << 8) | (size_t)header[3];
+			if (length > size - offset - 4 || !decryptBuffer(header + 4, length, plain))
+			{
+				break;
+			}
 
-		auto itSN = jsonDoc.FindMember("sn");
-		if (itSN != jsonDoc.MemberEnd())
-		{
-			auto &node = itSN->value;
-			if (node.IsUint64())
+			rapidjson::Document record;
+			record.Parse(plain.c_str());
+			if (record.HasParseError() || !record.IsObject())
 			{
-				sn = node.GetUint64();
+				break;
 			}
-		}
 
-		auto itSaveData = jsonDoc.FindMember("save_data");
-		if (itSaveData != jsonDoc.MemberEnd())
-		{
-			auto &node = itSaveData->value;
-			if (node.IsString())
+			if (first)
+			{
+				if (__RemoveSave_private::GetUint64Member(record, "generation") != journal->generation)
+				{
+					break;
+				}
+				first = false;
+			}
+			else if (!applyJournalRecord(record))
 			{
-				auto str = node.GetString();
-				auto len = node.GetStringLength();
-				std::string saveDataEncode(str, len);
-				decode(saveDataEncode, saveData);
+				break;
 			}
+			offset += 4 + length;
 		}
+		valid = !first && offset == size;
 	}
+	clearDirtyKeys();
+	cocos2d::log("[%s]: local save restored, snapshot: %d, journal: %s bytes, members: %u", __PRETTY_FUNCTION__,
+				 restored, std::to_string(offset).c_str(), m_jsonDoc.MemberCount());
 
-	cocos2d::log("[%s]: game loaded, sn: %s, save_data: %s", __PRETTY_FUNCTION__,
-				 std::to_string(sn).c_str(), saveData.c_str());
-	return true;
-}
-
-bool RemoteSave::loadWithBuffer(const std::string &buffer)
-{
-	if (buffer.empty())
+	if (valid)
 	{
-		cocos2d::log("[%s]: empty JSON buffer", __PRETTY_FUNCTION__);
-		m_jsonDoc.SetObject();
-		return true;
+		journal->file = fopen(journal->journalPath.c_str(), "ab");
+		journal->fileSize = offset;
 	}
 
-	m_jsonDoc.Parse(buffer.c_str());
-	if (m_jsonDoc.HasParseError())
+	// 日志不完整、属于别的快照或者还没有时，从当前的存档开始新的快照和日志
+	if (!journal->file)
 	{
-		cocos2d::log("[%s]: m_jsonDoc.Parse() failed, Error: %d", __PRETTY_FUNCTION__,
-					 m_jsonDoc.GetParseError());
-		return false;
+		writeSnapshot();
 	}
-
-	if (!m_jsonDoc.IsObject())
+	else
 	{
-		cocos2d::log("[%s]: m_jsonDoc is not an object", __PRETTY_FUNCTION__);
-		return false;
+		flushJournal();
 	}
+}
 
-	return true;
+void RemoteSaveSession::closeJournal()
+{
+	delete m_journal; m_journal = nullptr;
 }
 
-void RemoteSave::sendRequestSaveGame()
+bool RemoteSaveSession::applyJournalRecord(const rapidjson::Value &record)
 {
-	std::string buffer;
-	if (!saveToBuffer(buffer))
+	auto journal = m_journal;
+	for (auto it = record.MemberBegin(); it != record.MemberEnd(); ++it)
 	{
-		if (m_cbOnSave)
+		auto name = it->name.GetString();
+		auto &value = it->value;
+		if (strcmp(name, "set") == 0 && value.IsObject())
 		{
-			m_cbOnSave(EC_SAVE_DATA, NullString);
+			for (auto member = value.MemberBegin(); member != value.MemberEnd(); ++member)
+			{
+				rapidjson::Value copy;
+				copy.CopyFrom(member->value, m_jsonDoc.GetAllocator());
+				setValue(member->name.GetString(), copy);
+				++journal->changes;
+			}
+		}
+		else if (strcmp(name, "remove") == 0 && value.IsArray())
+		{
+			for (rapidjson::SizeType i = 0; i < value.Size(); ++i)
+			{
+				if (value[i].IsString())
+				{
+					eraseValue(value[i].GetString());
+					++journal->changes;
+				}
+			}
+		}
+		else if (strcmp(name, "sent") == 0 && value.IsUint64())
+		{
+			journal->sentSn = (unsigned long long)value.GetUint64();
+			journal->sentChanges = journal->changes;
+			m_sn = std::max(m_sn, journal->sentSn);
+		}
+		else if (strcmp(name, "ack") == 0 && value.IsUint64())
+		{
+			auto sn = (unsigned long long)value.GetUint64();
+			if (sn == journal->sentSn)
+			{
+				journal->syncedChanges = std::max(journal->syncedChanges, journal->sentChanges);
+			}
+			m_ackedSn = std::max(m_ackedSn, sn);
+		}
+		else
+		{
+			return false;
 		}
-		cocos2d::log("[%s]: saveToBuffer failed", __PRETTY_FUNCTION__);
-		return;
 	}
-
-	cocos2d::log("[%s]: save game: %s", __PRETTY_FUNCTION__, buffer.c_str());
-
-	cocos2d::network::HttpRequest* request = new (std::nothrow) cocos2d::network::HttpRequest();
-	request->setUrl(m_urlSave.c_str());
-	request->setRequestType(cocos2d::network::HttpRequest::Type::POST);
-	request->setResponseCallback(CC_CALLBACK_2(RemoteSave::onHttpRequestCompletedSaveGame, this));
-
-	std::string uid;
-	encode(m_uid, uid);
-	++m_sn;
-
-	std::string saveData;
-	encode(buffer, saveData);
-
-	// write the post data
-	auto postDataIn = "user_id=" + uid
-		+ "&sn=" + std::to_string(m_sn)
-		+ "&version=" + m_version
-		+ "&save_data=" + saveData;
-	std::string postDatOut;
-	formatPostData(postDataIn, postDatOut);
-	request->setRequestData(postDatOut.c_str(), postDatOut.length());
-	cocos2d::log("[%s]: Post request, url: %s, data: %s", __PRETTY_FUNCTION__, m_urlSave.c_str(), postDatOut.c_str());
-
-	auto tag = "POST save data for uid: " + m_uid;
-	request->setTag(tag.c_str());
-	cocos2d::network::HttpClient::getInstance()->sendImmediate(request);
-	request->release();
+	return true;
 }
 
-void RemoteSave::onHttpRequestCompletedSaveGame(cocos2d::network::HttpClient *sender, cocos2d::network::HttpResponse *response)
+void RemoteSaveSession::journalChange(const char *pKey, size_t length, const rapidjson::Value *value)
 {
-	if (!response)
+	// 重放日志时不再记录
+	if (!m_journal || !m_journal->file)
 	{
 		return;
 	}
 
-	// You can get original request type from: response->request->reqType
-	auto tag = response->getHttpRequest()->getTag();
-	if (tag)
-	{
-		cocos2d::log("[%s]: Receive response: %s", __PRETTY_FUNCTION__, tag);
-	}
-
-	auto statusCode = response->getResponseCode();
-	cocos2d::log("[%s]: HTTP Status Code: %ld", __PRETTY_FUNCTION__, statusCode);
+	++m_journal->changes;
 
-	ErrorCode code = EC_OK;
-	std::string msg;
-	do 
+	// {"set":{键:值}}或{"remove":[键]}
+	auto &record = m_journal->record;
+	record.resize(PayloadHeaderSize);
+	__RemoveSave_private::StringAppendStream jsonStream(record);
+	rapidjson::Writer<__RemoveSave_private::StringAppendStream> jsonWriter(jsonStream);
+	jsonWriter.StartObject();
+	if (value)
 	{
-		if (!response->isSucceed())
-		{
-			code = EC_RESPONSE;
-			msg = response->getErrorBuffer();
-			cocos2d::log("[%s]: Response failed, error: %s", __PRETTY_FUNCTION__, msg.c_str());
-			break;
-		}
-
-		auto buffer = response->getResponseData();
-		auto text = std::string(buffer->begin(), buffer->end());
-		cocos2d::log("[%s]: Response succeeded, buffer: %s", __PRETTY_FUNCTION__, text.c_str());
-
-		if (text != "Done")
-		{
-			code = EC_SAVE_RESULT;
-			msg = text;
-			cocos2d::log("[%s]: save failed, %s", __PRETTY_FUNCTION__, msg.c_str());
-		}
-	} while (0);
-
-	if (m_cbOnSave)
+		jsonWriter.Key("set", 3);
+		jsonWriter.StartObject();
+		jsonWriter.Key(pKey, (rapidjson::SizeType)length);
+		value->Accept(jsonWriter);
+		jsonWriter.EndObject();
+	}
+	else
 	{
-		m_cbOnSave(code, msg);
+		jsonWriter.Key("remove", 6);
+		jsonWriter.StartArray();
+		jsonWriter.String(pKey, (rapidjson::SizeType)length);
+		jsonWriter.EndArray();
 	}
+	jsonWriter.EndObject();
+
+	appendJournal();
 }
 
-bool RemoteSave::saveToBuffer(std::string &buffer)
+void RemoteSaveSession::journalSaveState(const char *name, unsigned long long sn)
 {
-	if (!m_jsonDoc.IsObject())
+	if (!m_journal || !m_journal->file)
 	{
-		cocos2d::log("[%s]: m_jsonDoc is NOT a json obj", __PRETTY_FUNCTION__);
-		buffer = "";
-		return false;
+		return;
 	}
 
-	rapidjson::StringBuffer jsonBuffer;
-	rapidjson::Writer<rapidjson::StringBuffer> jsonWriter(jsonBuffer);
-	if (!m_jsonDoc.Accept(jsonWriter))
+	// 和applyJournalRecord()一致
+	auto journal = m_journal;
+	if (strcmp(name, "sent") == 0)
 	{
-		cocos2d::log("[%s]: m_jsonDoc.Accept() failed", __PRETTY_FUNCTION__);
-		buffer = "";
-		return false;
+		journal->sentSn = sn;
+		journal->sentChanges = journal->changes;
 	}
-
-	auto str = jsonBuffer.GetString();
-	auto size = jsonBuffer.GetSize();
-	buffer.assign(static_cast<const char*>(str), size);
-	return true;
-}
-
-void RemoteSave::encode(const std::string &in, std::string &out)
-{
-	auto bufferIn = (unsigned char*)in.c_str();
-	auto sizeIn = in.size();
-	auto key = (unsigned char*)m_key.c_str();
-	auto iv = (unsigned char*)m_iv.c_str();
-	auto sizeAES = sizeIn;
-	auto k = sizeIn % 16; // 128 bit
-	if (k)
+	else if (sn == journal->sentSn)
 	{
-		sizeAES = sizeIn - k + 16;
+		journal->syncedChanges = std::max(journal->syncedChanges, journal->sentChanges);
 	}
-	auto bufferAESOut = new unsigned char[sizeAES];
-	__RemoveSave_private::AES128_CBC_encrypt_buffer(bufferAESOut, bufferIn, sizeIn, key, iv);
 
-	char *bufferOut = nullptr;
-	auto sizeOut = cocos2d::base64Encode(bufferAESOut, sizeAES, &bufferOut);
-	out.assign(bufferOut, sizeOut);
+	auto &record = journal->record;
+	record.resize(PayloadHeaderSize);
+	__RemoveSave_private::StringAppendStream jsonStream(record);
+	rapidjson::Writer<__RemoveSave_private::StringAppendStream> jsonWriter(jsonStream);
+	jsonWriter.StartObject();
+	jsonWriter.Key(name);
+	jsonWriter.Uint64(sn);
+	jsonWriter.EndObject();
 
-	free(bufferOut); bufferOut = nullptr;
-	delete[] bufferAESOut; bufferAESOut = nullptr;
+	appendJournal();
 }
 
-void RemoteSave::decode(const std::string &in, std::string &out)
+void RemoteSaveSession::appendJournal()
 {
-	auto bufferIn = (unsigned char*)in.c_str();
-	auto sizeIn = in.size();
-	unsigned char *bufferOut = nullptr;
-	auto sizeOut = cocos2d::base64Decode(bufferIn, sizeIn, &bufferOut);
+	auto journal = m_journal;
+	auto &record = journal->record;
+	encryptBuffer(record, PayloadHeaderSize, PF_GCM);
 
-	auto key = (unsigned char*)m_key.c_str();
-	auto iv = (unsigned char*)m_iv.c_str();
+	unsigned char length[4] = {
+		(unsigned char)(record.size() >> 24), (unsigned char)(record.size() >> 16),
+		(unsigned char)(record.size() >> 8), (unsigned char)record.size() };
+	journal->pending.append((const char*)length, sizeof(length));
+	journal->pending += record;
 
-	// 2015/12/10-18:06 by YYBear [TODO] 这里的实际解密后的Size实际上是错误的，尾部可能会有填充的0，但是由于这里最后解密出来的应该是个json字符串，所以尾部的0不会产生影响
-	auto bufferAESOut = new unsigned char[sizeOut];
-	__RemoveSave_private::AES128_CBC_decrypt_buffer(bufferAESOut, bufferOut, sizeOut, key, iv);
-	out.assign((char *)bufferAESOut, sizeOut);
-
-	free(bufferOut); bufferOut = nullptr;
-	delete[] bufferAESOut; bufferAESOut = nullptr;
+	if (m_batchDepth == 0)
+	{
+		flushJournal();
+	}
 }
 
+void RemoteSaveSession::flushJournal()
+{
+	if (!m_journal)
+	{
+		return;
+	}
+
+	m_journal->Write();
+	if (m_journal->file && m_journal->fileSize > JournalCompactMin && m_journal->fileSize > m_journal->snapshotSize)
+	{
+		writeSnapshot();
+	}
+}
 
-void RemoteSave::formatPostData(const std::string &dataIn, std::string &dataOut)
+void RemoteSaveSession::writeSnapshot()
 {
-	std::string c = "+";
-	std::string t = "%2B";
-	std::string::size_type pos1, pos2;
-	pos1 = 0;
-	pos2 = dataIn.find('+');
+	auto journal = m_journal;
 
-	while (std::string::npos != pos2)
+	// 快照可能很大，和保存共用缓冲区
+	auto generation = journal->generation + 1;
+	auto &buffer = m_saveBuffer;
+	buffer.resize(PayloadHeaderSize);
 	{
-		dataOut += dataIn.substr(pos1, pos2 - pos1);
-		dataOut += t;
+		__RemoveSave_private::StringAppendStream jsonStream(buffer);
+		rapidjson::Writer<__RemoveSave_private::StringAppendStream> jsonWriter(jsonStream);
+		jsonWriter.StartObject();
+		jsonWriter.Key("generation");
+		jsonWriter.Uint(generation);
+		jsonWriter.Key("sn");
+		jsonWriter.Uint64(m_sn);
+		jsonWriter.Key("acked_sn");
+		jsonWriter.Uint64(m_ackedSn);
+		jsonWriter.Key("changes");
+		jsonWriter.Uint64(journal->changes);
+		jsonWriter.Key("synced_changes");
+		jsonWriter.Uint64(journal->syncedChanges);
+		jsonWriter.Key("sent_sn");
+		jsonWriter.Uint64(journal->sentSn);
+		jsonWriter.Key("sent_changes");
+		jsonWriter.Uint64(journal->sentChanges);
+		jsonWriter.Key("data");
+		m_jsonDoc.Accept(jsonWriter);
+		jsonWriter.EndObject();
+	}
+	__RemoveSave_private::Lz4CompressBuffer(buffer, PayloadHeaderSize, m_compressBuffer);
+	encryptBuffer(buffer, PayloadHeaderSize, PF_GCM_LZ4);
 
-		pos1 = pos2 + c.size();
-		pos2 = dataIn.find(c, pos1);
+	// 先写临时文件再替换，任何时候中断都有一份完整的快照，失败时继续用旧的快照和日志
+	auto tempPath = journal->snapshotPath + ".tmp";
+	if (!__RemoveSave_private::WriteFileSynced(tempPath, buffer)
+		|| !__RemoveSave_private::ReplaceFile(tempPath, journal->snapshotPath))
+	{
+		cocos2d::log("[%s]: write snapshot failed: %s", __PRETTY_FUNCTION__, journal->snapshotPath.c_str());
+		return;
 	}
+	journal->snapshotSize = buffer.size();
+	journal->generation = generation;
+	// 还没写入的记录都已经包含在快照中
+	journal->pending.clear();
 
-	if (pos1 != dataIn.length())
+	// 旧日志已经包含在快照中，换成新一代的空日志
+	if (journal->file)
 	{
-		dataOut += dataIn.substr(pos1);
+		fclose(journal->file);
 	}
+	journal->file = fopen(journal->journalPath.c_str(), "wb");
+	journal->fileSize = 0;
+	if (!journal->file)
+	{
+		cocos2d::log("[%s]: open journal failed: %s", __PRETTY_FUNCTION__, journal->journalPath.c_str());
+		return;
+	}
+
+	auto &record = journal->record;
+	record.resize(PayloadHeaderSize);
+	__RemoveSave_private::StringAppendStream jsonStream(record);
+	rapidjson::Writer<__RemoveSave_private::StringAppendStream> jsonWriter(jsonStream);
+	jsonWriter.StartObject();
+	jsonWriter.Key("generation");
+	jsonWriter.Uint(generation);
+	jsonWriter.EndObject();
+	appendJournal();
+	journal->Write();
 }
@@ -4,10 +4,14 @@
 
 #include <cocos2d.h>
 #include <json/document.h>
-#include <network/HttpClient.h>
+#include <map>
+#include "RemoteSaveTransport.h"
 
 
-class RemoteSave
+// 一个用户（uid）的远程存档。可以在同一个进程中创建任意多个，例如压力测试的机器人或者运营工具，
+// 共享同一个Context的会话使用同一个传输层、加密线程池、展开的密钥和性能统计。
+// 所有方法都在cocos2d的主线程中调用
+class RemoteSaveSession
 {
 public:
 	enum ErrorCode
@@ -20,13 +24,116 @@ public:
 		EC_SAVE_RESULT, // 服务器保存错误，有详细信息
 	};
 
-	static RemoteSave* getInstance();
+	// save_data的加密格式
+	enum PayloadFormat
+	{
+		PF_CBC, // AES128-CBC，0填充，旧版本客户端也能读取
+		PF_GCM, // AES128-GCM，记录明文长度并带校验，大存档多线程加密
+		PF_GCM_LZ4, // 加密前先用LZ4压缩，其余同PF_GCM
+	};
+
+	// 保存方式
+	// SM_DELTA需要服务器支持：请求带base_sn时，save_data是{"set":{改变的键值},"remove":[删除的键]}，
+	// 服务器记录的sn等于base_sn时合并并返回Done，否则返回SN_MISMATCH
+	enum SaveMode
+	{
+		SM_FULL, // 每次上传完整存档
+		SM_DELTA, // 只上传服务器确认以来改变和删除的键
+	};
+
+	// 性能统计的阶段，保存依次经过序列化到HTTP，加载依次经过HTTP到解析
+	enum MetricStage
+	{
+		MS_SAVE_MAIN, // 每次保存占用调用线程（主线程）的时间，后台保存时只有复制快照和记账
+		MS_SERIALIZE, // 序列化JSON，完整或增量
+		MS_ENCRYPT, // LZ4压缩和加密
+		MS_BASE64_ENCODE,
+		MS_FORM_ENCODE, // POST数据的转义和拼接
+		MS_HTTP_SAVE, // 保存请求从发送到回应，每次重试单独记录
+		MS_HTTP_LOAD, // 加载请求从发送到回应，每次重试单独记录
+		MS_BASE64_DECODE,
+		MS_DECRYPT, // 校验、解密和LZ4解压
+		MS_PARSE, // 解析JSON，包括合并本地改变和整理到m_jsonDoc
+		MS_COUNT
+	};
+
+	// 性能统计的计数
+	enum MetricCounter
+	{
+		MC_LOADS, // 发出的加载请求，不含重试
+		MC_SAVES, // 发出的保存请求，不含重试
+		MC_DELTA_SAVES, // 其中的增量保存
+		MC_LOAD_RETRIES,
+		MC_SAVE_RETRIES,
+		MC_FAILED_LOADS, // 重试后仍然失败，回调了错误的加载
+		MC_FAILED_SAVES,
+		MC_COALESCED_SAVES, // 被合并掉、没有单独发出的保存
+		MC_COUNT
+	};
+
+	// 一个阶段的统计，时间单位微秒。分位数来自对数分桶的直方图，误差不超过1/16
+	struct StageMetrics
+	{
+		unsigned long long count;
+		// 这个阶段输出的字节数之和，HTTP是请求（保存）或回应（加载）的大小
+		unsigned long long bytes;
+		double meanMicros;
+		double p50Micros;
+		double p90Micros;
+		double p99Micros;
+		double maxMicros;
+	};
+
+	struct Metrics
+	{
+		StageMetrics stages[MS_COUNT];
+		unsigned long long counters[MC_COUNT];
+	};
+
+	// 键的值类型，resolveKey()时指定
+	enum KeyType
+	{
+		KT_BOOL,
+		KT_INT,
+		KT_FLOAT,
+		KT_DOUBLE,
+		KT_STRING,
+		KT_DATA, // base64编码的字符串
+	};
+
+	// resolveKey()返回的句柄，在创建它的会话中一直有效：重新加载、整理内存池、删除键和release()后再次init()都不影响。
+	// 通过句柄读写省去每次计算键的哈希和比较键名，只在存档的成员位置变化后的第一次访问时重新查找
+	struct KeyHandle
+	{
+		KeyHandle() : id(InvalidId), type(KT_INT) {}
+
+		bool isValid() const { return id != InvalidId; }
+
+		static const unsigned int InvalidId = 0xffffffff;
+		unsigned int id;
+		KeyType type;
+	};
+
+	// AES128加密上下文，init()时展开密钥，之后只读，可以在多个线程中同时使用
+	struct AesContext;
+
+	// 会话之间共享的资源
+	class Context;
+	// 在其他线程中读取存档
+	class Reader;
+
+	// context为空时使用自己的Context
+	explicit RemoteSaveSession(const std::shared_ptr<Context> &context = nullptr);
+	// 调用release()，已发出的请求不再回调
+	~RemoteSaveSession();
+
+	const std::shared_ptr<Context> &getContext() const { return m_context; }
     
 	bool getBoolForKey(const char *pKey, bool defaultValue = false);
 	int getIntegerForKey(const char *pKey, int defaultValue = 0);
 	float getFloatForKey(const char *pKey, float defaultValue = 0.f);
 	double getDoubleForKey(const char *pKey, double defaultValue = 0.);
-	std::string getStringForKey(const char *pKey, const std::string &defaultValue = RemoteSave::NullString);
+	std::string getStringForKey(const char *pKey, const std::string &defaultValue = RemoteSaveSession::NullString);
 	cocos2d::Data getDataForKey(const char *pKey, const cocos2d::Data &defaultValue = cocos2d::Data::Null);
 
 	void setBoolForKey(const char *pKey, bool value);
@@ -35,6 +142,28 @@ public:
 	void setDoubleForKey(const char *pKey, double value);
 	void setStringForKey(const char *pKey, const std::string &value);
 	void setDataForKey(const char *pKey, const cocos2d::Data &value);
+	void deleteValueForKey(const char *pKey);
+
+	// 每帧读写的键先取得句柄，之后用句柄代替键名，行为和用键名相同。
+	// 同一个键多次调用返回同一个句柄，键名为空时返回无效的句柄，读写无效的句柄和没有初始化时一样。
+	// 句柄只能用于resolveKey()时指定类型的方法
+	//	static auto gold = g_RemoteSave->resolveKey("Gold", RemoteSave::KT_INT);
+	//	g_RemoteSave->setIntegerForKey(gold, g_RemoteSave->getIntegerForKey(gold) + 1);
+	KeyHandle resolveKey(const char *pKey, KeyType type);
+
+	bool getBoolForKey(KeyHandle handle, bool defaultValue = false);
+	int getIntegerForKey(KeyHandle handle, int defaultValue = 0);
+	float getFloatForKey(KeyHandle handle, float defaultValue = 0.f);
+	double getDoubleForKey(KeyHandle handle, double defaultValue = 0.);
+	std::string getStringForKey(KeyHandle handle, const std::string &defaultValue = RemoteSaveSession::NullString);
+	cocos2d::Data getDataForKey(KeyHandle handle, const cocos2d::Data &defaultValue = cocos2d::Data::Null);
+
+	void setBoolForKey(KeyHandle handle, bool value);
+	void setIntegerForKey(KeyHandle handle, int value);
+	void setFloatForKey(KeyHandle handle, float value);
+	void setDoubleForKey(KeyHandle handle, double value);
+	void setStringForKey(KeyHandle handle, const std::string &value);
+	void setDataForKey(KeyHandle handle, const cocos2d::Data &value);
 
 	// 初始化
 	// uid: 用户ID，唯一标识
@@ -51,66 +180,443 @@ public:
 	// 从服务器加载数据，异步操作
 	void load();
 	// 向服务器保存数据，异步操作
+	// 同一时间只有一个保存请求：上一个还没回应时只记下需要保存，回应后再发送当时的存档，
+	// 期间多次调用合并为一次，只回调一次。sn在发送时分配，回调按发送顺序到达
 	void save();
+	// 是否有保存请求在等待回应
+	bool isSaving() const { return m_saveInFlight; }
+	// 设置是否在后台保存，默认开启：调用线程只复制一份存档快照，序列化、压缩、加密和编码
+	// 在Context的线程池中完成，然后直接交给传输层，回调仍在主线程。关闭时都在调用线程中完成
+	void setBackgroundSave(bool enabled) { m_backgroundSave = enabled; }
 
 	// 设置是否在使用默认值的时候，自动保存
 	void setSaveOnGetDefault(bool enabled) { m_saveOnGetDefault = enabled; }
 	// 设置是否在值发生改变的时候，自动保存
 	void setSaveOnChangeValue(bool enabled) { m_saveOnChangeValue = enabled; }
+	// 设置自动保存的合并方式：改变后quietPeriod秒内没有新的改变，或者第一次改变后已过maxDelay秒，
+	// 才保存一次，期间的多次改变合并为一次保存。由cocos2d的Scheduler驱动
+	// quietPeriod <= 0（默认）时每次改变立即保存
+	void setSaveCoalescing(float quietPeriod, float maxDelay);
+	// 立即保存还在等待合并的改变，没有时什么都不做
+	void flush();
+	// 被合并掉、没有单独发出的保存次数，包括等待上一个保存回应时被取代的，resetMetrics()时清零
+	unsigned int getCoalescedSaveCount() const;
+
+	// 批量修改：beginBatch()和commitBatch()之间的改变不触发自动保存，
+	// 最外层的commitBatch()时如果有改变需要自动保存，只保存一次。可以嵌套
+	void beginBatch();
+	void commitBatch();
+
+	// 批量修改的作用域对象，构造时beginBatch()，析构或commit()时commitBatch()
+	//	{
+	//		RemoteSave::Batch batch; // 其他会话用RemoteSaveSession::Batch batch(session);
+	//		g_RemoteSave->setIntegerForKey("Gold", gold);
+	//		g_RemoteSave->setIntegerForKey("Exp", exp);
+	//	} // 只保存一次
+	class Batch
+	{
+	public:
+		// remoteSave为nullptr时是g_RemoteSave
+		explicit Batch(RemoteSaveSession *remoteSave = nullptr);
+		~Batch();
+		// 提前结束批量修改，之后析构不再提交
+		void commit();
+
+	private:
+		Batch(const Batch&);
+		Batch &operator=(const Batch&);
+
+		RemoteSaveSession *m_remoteSave;
+	};
+
+	// 设置请求失败时的自动重试：网络错误、HTTP 429和5xx时最多尝试maxAttempts次（包括第一次），
+	// 第n次重试前随机等待0到min(maxDelay, baseDelay * 2^(n-1))秒。maxAttempts <= 1时不重试，默认4次
+	// 重试发送同一个请求，不重新序列化和加密，只有最后一次的结果回调。
+	// 保存请求带Idempotency-Key头，同一次保存的重试相同，服务器可以据此忽略已处理过的重复请求
+	void setRetryPolicy(unsigned int maxAttempts, float baseDelay = 1.f, float maxDelay = 30.f);
+
+	// 设置保存时save_data的加密格式，默认PF_CBC，加载时所有格式都能识别
+	void setPayloadFormat(PayloadFormat format) { m_payloadFormat = format; }
+	// 设置保存方式，默认SM_FULL。SM_DELTA时加载后的第一次、每fullSaveInterval次增量之后、
+	// 保存失败或服务器拒绝增量之后，上传完整存档
+	void setSaveMode(SaveMode mode, unsigned int fullSaveInterval = 20);
+
+	// 设置本地存档的目录，init()之前调用，例如FileUtils::getInstance()->getWritablePath()。空（默认）时不保存本地存档
+	// 每次改变都追加到本地日志，日志变大时整理成快照，都用init()的密钥加密。
+	// init()时从快照和日志恢复存档，不用等load()；load()时服务器的sn比本地确认过的新才用服务器的存档，
+	// 否则保留本地存档，还有没上传的改变时自动保存
+	void setJournalDirectory(const std::string &directory) { m_journalDirectory = directory; }
+
+	// 即时启动，配合setJournalDirectory()使用：init()之后getter直接返回本地存档中的值，不用等load()。
+	// 服务器的存档加载成功之前，getter不写入默认值，保存也等到那时才发送。
+	// 服务器的sn比本地的新时以服务器的存档为准，但本次启动以来改变和删除的键保留本地的值，
+	// 其余有变化的键通过setCallBackOnChange()通知
+	void setInstantStart(bool enabled) { m_instantStart = enabled; }
+
+	// 设置发送加载和保存请求的传输层，init()之前调用。没有设置时init()使用Context的传输层，
+	// 默认保持到服务器的长连接；测试时可以用RemoteSaveLoopbackTransport
+	void setTransport(const std::shared_ptr<RemoteSaveTransport> &transport) { m_transport = transport; }
+
+	// 读取性能统计，可以在任意线程中调用。记录都是无锁的原子操作，读取期间的记录可能只算进一部分。
+	// 统计属于Context，共享Context的会话读到的是所有会话的合计
+	void getMetrics(Metrics &metrics) const;
+	void resetMetrics();
+	// 每个阶段和计数一行，用于打印
+	std::string getMetricsReport() const;
+	static const char *getMetricStageName(MetricStage stage);
+	static const char *getMetricCounterName(MetricCounter counter);
+
+	// 存档数据内存池当前占用的字节数
+	size_t getAllocatorSize();
+	// 内存池中已被覆盖、等待整理的字节数（估算）
+	size_t getAllocatorGarbageSize() const { return m_allocatorGarbage; }
+	// 设置垃圾超过内存池占用的多大比例时自动整理，默认0.5
+	void setCompactRatio(float ratio) { m_compactRatio = ratio; }
 
 	// 设置加载数据回调
 	void setCallBackOnLoad(const std::function<void(ErrorCode, const std::string&)> &func) { m_cbOnLoad = func; }
 	// 设置保存数据回调
 	void setCallBackOnSave(const std::function<void(ErrorCode, const std::string&)> &func) { m_cbOnSave = func; }
+	// 设置加载使存档内容变化时的回调，参数是值改变、增加或删除了的键，在加载数据回调之前调用
+	void setCallBackOnChange(const std::function<void(const std::vector<std::string>&)> &func) { m_cbOnChange = func; }
 
 	// 空字符串
 	const static std::string NullString;
 
 protected:
-	RemoteSave();
-	~RemoteSave() {};
+	RemoteSaveSession(const RemoteSaveSession&);
+	RemoteSaveSession &operator=(const RemoteSaveSession&);
+
+	// m_jsonDoc成员的哈希索引，查找和修改都是O(1)
+	struct KeyIndex;
+	// 找不到时返回nullptr
+	rapidjson::Value *findValue(const char *pKey);
+	// 设置pKey的值，value的内容会被移走。已有的键原地覆盖
+	void setValue(const char *pKey, rapidjson::Value &value);
+	// 覆盖第member个成员的值，pKey是它的键名
+	void replaceValue(uint32_t member, const char *pKey, size_t length, rapidjson::Value &value);
+
+	// resolveKey()记下的键和它在m_jsonDoc中的位置
+	struct KeyHandleEntry
+	{
+		std::string key;
+		uint32_t hash;
+		// 上次找到的位置，layout不等于m_keyLayout时重新查找；没有这个键时不缓存
+		uint32_t member;
+		unsigned int layout;
+	};
+	// 句柄无效、没有初始化或者没有这个键时返回nullptr
+	rapidjson::Value *findValue(KeyHandle handle, KeyType type);
+	// 用findValue()刚找到的位置覆盖值
+	void setValue(KeyHandle handle, rapidjson::Value &value);
+	// 无效的句柄返回nullptr，用键名的方法把它当作空键
+	const char *getKeyName(KeyHandle handle) const;
+	// 垃圾达到m_compactRatio时把m_jsonDoc复制到新的内存池，释放旧的
+	void compactAllocator();
+	// value和它的成员、元素在m_jsonDoc内存池中占用的字节，被覆盖或删除时记为垃圾
+	// 短字符串存在节点里，原地解析的字符串指向m_loadBuffer，都不占内存池
+	size_t getPoolSize(const rapidjson::Value &value) const;
+	// 删除pKey，只修改m_jsonDoc和索引，不存在时返回false
+	bool eraseValue(const char *pKey);
+	// 把value复制到新的内存池作为m_jsonDoc，释放旧的内存池；value可以在旧的内存池中
+	// size是value大约占用的内存池大小，新的内存池按它分配，复制只分配一次
+	void assignJsonDoc(const rapidjson::Value &value, size_t size = 0);
+	// 垃圾少于这个值时不整理，避免小存档频繁复制
+	static const size_t CompactMinGarbage = 64 * 1024;
+	// 发布给Reader的只读快照，和发布它的地方
+	struct ReadSnapshot;
+	struct ReadChannel;
+	// 有Reader时，m_jsonDoc改变后在下一帧发布一次
+	void markReadSnapshotDirty();
+	void publishReadSnapshot();
+	static const std::string PublishScheduleKey;
+	// 内存池每块至少这么大，和rapidjson的默认值相同
+	static const size_t AllocatorMinChunk = 64 * 1024;
+	typedef rapidjson::Document::AllocatorType JsonAllocator;
+
+	typedef std::shared_ptr<const RemoteSaveTransport::Request> TransportRequest;
+	// 失败可以重试时，安排稍后调用resend重新发送同一个请求，返回true
+	// attempts: 这个请求已经重试的次数；retry: 等待中的重试，调用或取消前不为空
+	bool scheduleRetry(const RemoteSaveTransport::Response &response, const std::string &tag, unsigned int &attempts,
+					   std::function<void()> &retry, const std::string &scheduleKey, const std::function<void()> &resend);
+	// 取消等待中的重试，有时返回true
+	bool cancelRetry(std::function<void()> &retry, const std::string &scheduleKey);
+	static const std::string RetryLoadScheduleKey;
+	static const std::string RetrySaveScheduleKey;
 
 	void sendRequestLoadGame();
-	void onHttpRequestCompletedLoadGame(cocos2d::network::HttpClient *sender, cocos2d::network::HttpResponse *response);
-	bool parseResponseLoadGame(const std::string &buffer, unsigned long long &sn, std::string &saveData);
-	bool loadWithBuffer(const std::string &buffer);
+	// 发送或重新发送加载请求
+	void sendLoad(const TransportRequest &request);
+	void onHttpRequestCompletedLoadGame(const TransportRequest &request, RemoteSaveTransport::Response &response);
+	// 原地解析buffer，save_data解码后的JSON在saveData的offset之后，没有存档时为空
+	bool parseResponseLoadGame(std::vector<char> &buffer, unsigned long long &sn, std::string &saveData, size_t &offset);
+	// 原地解析buffer中offset之后的JSON，成功后buffer成为m_loadBuffer，m_jsonDoc的字符串直接引用它
+	// buffer解析后不能再修改或移动（短字符串交换时内容会跟着搬走），所以由共享指针传入
+	// mergeLocal时本次启动以来改变和删除的键保留m_jsonDoc中的值；changedKeys不为nullptr时返回值有变化的键
+	bool loadWithBuffer(const std::shared_ptr<std::string> &buffer, size_t offset, bool mergeLocal = false, std::vector<std::string> *changedKeys = nullptr);
+	// 把m_jsonDoc中标记为改变和删除的键应用到jsonDoc
+	void mergeLocalChanges(rapidjson::Document &jsonDoc);
+	// 比较jsonDoc和m_jsonDoc，返回值不同、只在其中一个里的键
+	void diffKeys(rapidjson::Value &jsonDoc, std::vector<std::string> &changedKeys);
 
+	// 一次保存从快照到交给传输层的数据，每个会话一个，重复使用
+	struct SaveJob;
 	void sendRequestSaveGame();
-	void onHttpRequestCompletedSaveGame(cocos2d::network::HttpClient *sender, cocos2d::network::HttpResponse *response);
-	bool saveToBuffer(std::string &buffer);
+	// 在调用线程中把m_jsonDoc或其中改变的部分复制到job.snapshot
+	void takeSaveSnapshot(SaveJob &job, bool delta);
+	// 序列化、压缩、加密和编码job.snapshot并发送，后台保存时在线程池中执行，
+	// 除了发送时写入m_saveSentAt，只读取init()之后不变的成员
+	bool runSaveJob(SaveJob &job);
+	// runSaveJob()失败时在主线程中回调EC_SAVE_DATA
+	void onSaveJobFailed();
+	// 等待后台的保存交给传输层，release()和下一次保存之前调用
+	void waitSaveJob();
+	// 上一个保存回应后，发送期间等待的保存
+	void sendPendingSave();
+	// 发送或重新发送保存请求
+	void sendSave(const TransportRequest &request, unsigned long long sn, bool delta);
+	void onHttpRequestCompletedSaveGame(const TransportRequest &request, RemoteSaveTransport::Response &response,
+										unsigned long long sn, bool delta);
+	// 把value序列化到buffer的offset之后，buffer的容量会被复用
+	static bool saveToBuffer(const rapidjson::Value &value, std::string &buffer, size_t offset = 0);
+	void clearDirtyKeys();
+	// 服务器拒绝增量时的回应
+	static const std::string DeltaRejected;
+	// 原地加密buffer中offset之后的明文，PF_GCM时offset须为头部大小，头部和tag也写入buffer
+	void encryptBuffer(std::string &buffer, size_t offset, PayloadFormat format) const;
 
-	void encode(const std::string &in, std::string &out);
-	void decode(const std::string &in, std::string &out);
-	void formatPostData(const std::string &dataIn, std::string &dataOut);
+	// 本地快照和日志
+	struct Journal;
+	// 从快照和日志恢复m_jsonDoc，打开日志准备追加
+	void openJournal();
+	void closeJournal();
+	// 记录一次改变，value为nullptr时是删除
+	void journalChange(const char *pKey, size_t length, const rapidjson::Value *value);
+	// 记录发出（sent）或服务器确认（ack）了一次保存
+	void journalSaveState(const char *name, unsigned long long sn);
+	// 加密Journal::record中的记录，加入待写入的日志，不在批量修改中时立即写入
+	void appendJournal();
+	// 写入待写入的日志，日志超过快照大小时整理成新的快照
+	void flushJournal();
+	void writeSnapshot();
+	// 重放一条日志记录，返回false时记录无效
+	bool applyJournalRecord(const rapidjson::Value &record);
+	// 日志小于这个值时不整理
+	static const size_t JournalCompactMin = 64 * 1024;
+
+	// 用NIST SP 800-38A的CBC向量和GCM论文的测试用例4检查AES实现，由test/unit中的单元测试调用
+	static bool selfTest();
+	// 只读取m_aesContext，可以在任意线程中调用
+	// uid必须用PF_CBC，结果固定不变，服务器以此为索引
+	void encode(const std::string &in, std::string &out, PayloadFormat format = PF_CBC) const;
+	// 自动识别格式，解码到out中，明文在offset之后，以'\0'结尾可以原地解析。PF_GCM校验失败时返回false
+	// scratch用来原地解码和解密，可能和out交换
+	bool decode(const char *in, size_t size, std::string &scratch, std::string &out, size_t &offset) const;
+	// 解密没有base64编码的PF_GCM/PF_GCM_LZ4数据，格式不对或校验失败时返回false
+	bool decryptBuffer(const unsigned char *data, size_t size, std::string &out) const;
+	static bool isGcmPayload(const unsigned char *data, size_t size);
+	// 把 原始长度 | LZ4块 解压到out
+	static bool decompress(const unsigned char *data, size_t size, std::string &out);
+	// 内置的base64编码和解码，结果写入out并调整到实际长度，out的容量够时不分配内存。
+	// 解码和cocos2d::base64Decode一样跳过字母表以外的字符，输入在一个字节中间结束时返回false
+	static void base64Encode(const unsigned char *data, size_t size, std::string &out);
+	static bool base64Decode(const char *in, size_t size, std::string &out);
+	// 把一个字段的值按application/x-www-form-urlencoded转义后追加到POST数据
+	static void appendPostData(std::string &dataOut, const char *data, size_t size);
+	// 把二进制数据base64编码并转义后追加到POST数据，不生成中间字符串
+	// base64Nanos不为nullptr时加上其中base64编码用的时间
+	static void appendPostDataBase64(std::string &dataOut, const unsigned char *data, size_t size,
+									 unsigned long long *base64Nanos = nullptr);
 	
-	void saveOnGetDefault() { m_saveOnGetDefault ? save() : 0; }
-	void saveOnChangeValue() { m_saveOnChangeValue ? save() : 0; }
+	// 即时启动时服务器的存档还没加载成功：getter不写入默认值，保存等待
+	bool waitingForServer() const { return m_instantStart && !m_serverLoaded; }
+	void saveOnGetDefault() { if (m_saveOnGetDefault) requestAutoSave(); }
+	void saveOnChangeValue() { if (m_saveOnChangeValue) requestAutoSave(); }
+	// 自动保存：不合并时立即保存，否则标记为待保存，由updateAutoSave()到时间后保存
+	void requestAutoSave();
+	void updateAutoSave(float dt);
+	void cancelAutoSave();
+	static const std::string AutoSaveScheduleKey;
 
-	static RemoteSave *m_instance;
+	std::shared_ptr<Context> m_context;
+	// 析构时释放，发出的请求回调时据此判断会话是否还在
+	std::shared_ptr<bool> m_alive;
+	// 每次release()加1，发出请求时记下，回调时不相同说明请求属于release()之前，丢弃回应
+	unsigned int m_generation;
 
 	bool m_inited;
 	bool m_saveOnGetDefault;
 	bool m_saveOnChangeValue;
 	std::function<void(ErrorCode, const std::string&)> m_cbOnLoad;
 	std::function<void(ErrorCode, const std::string&)> m_cbOnSave;
+	std::function<void(const std::vector<std::string>&)> m_cbOnChange;
 
 	std::string m_uid;
+	std::string m_uidEncoded;
 	std::string m_version;
-	std::string m_key;
-	std::string m_iv;
 	std::string m_urlLoad;
 	std::string m_urlSave;
 	unsigned long long m_sn;
+	// 保存请求幂等键的前缀，init()时随机生成，和sn一起唯一标识一次保存
+	std::string m_requestIdPrefix;
+	// 由Context按密钥共享
+	std::shared_ptr<const AesContext> m_aesContext;
+	PayloadFormat m_payloadFormat;
 
+	// m_jsonDoc的内存池，加载和整理时按存档大小换一个新的
+	std::unique_ptr<JsonAllocator> m_jsonAllocator;
 	rapidjson::Document m_jsonDoc;
+	// 加载的存档解码后的JSON，原地解析，m_jsonDoc中加载来的字符串都指向这里，下次加载成功前不能修改。
+	// 后台保存的快照也引用这些字符串，序列化完成前持有它
+	std::shared_ptr<std::string> m_loadBuffer;
+	KeyIndex *m_keyIndex;
+	size_t m_allocatorGarbage;
+	float m_compactRatio;
+	std::vector<KeyHandleEntry> m_keyHandles;
+	std::map<std::string, unsigned int> m_keyHandleIds;
+	// m_jsonDoc的成员可能移动位置时（删除键、重新加载、整理内存池、release()）加1
+	unsigned int m_keyLayout;
+
+	float m_saveQuietPeriod;
+	float m_saveMaxDelay;
+	bool m_saveDirty;
+	float m_saveQuietElapsed;
+	float m_saveDirtyElapsed;
+	unsigned int m_batchDepth;
+	bool m_batchPending;
+
+	unsigned int m_retryMaxAttempts;
+	float m_retryBaseDelay;
+	float m_retryMaxDelay;
+	unsigned int m_loadAttempts;
+	unsigned int m_saveAttempts;
+	// 最近一次发出加载/保存请求的时间，纳秒，用于统计HTTP往返时间
+	unsigned long long m_loadSentAt;
+	unsigned long long m_saveSentAt;
+	std::function<void()> m_loadRetry;
+	std::function<void()> m_saveRetry;
+	std::shared_ptr<RemoteSaveTransport> m_transport;
+
+	SaveMode m_saveMode;
+	unsigned int m_fullSaveInterval;
+	unsigned int m_deltaSaveCount;
+	// 服务器确认保存成功的最大sn，增量的基准
+	unsigned long long m_ackedSn;
+	bool m_fullSaveRequired;
+	// 已发出、还没回应的保存，同一时间最多一个
+	bool m_saveInFlight;
+	// 等上一个保存回应后再发送
+	bool m_savePending;
+	// 上次保存以来删除的键
+	std::vector<std::string> m_removedKeys;
+	std::string m_journalDirectory;
+	Journal *m_journal;
+	bool m_instantStart;
+	// init()以来是否从服务器加载成功过
+	bool m_serverLoaded;
+
+	// Data类型键值编码用的缓冲区，重复使用避免每次分配
+	std::string m_base64Buffer;
+	// 写本地快照时的明文/密文缓冲区，容量在多次写入之间复用
+	std::string m_saveBuffer;
+	// 保存请求，POST数据直接写入其中，传输层不再持有时复用它的容量
+	std::shared_ptr<RemoteSaveTransport::Request> m_saveRequest;
+	// PF_GCM_LZ4压缩输出，和m_saveBuffer交换使用；加载时也用来解码
+	std::string m_compressBuffer;
+	bool m_backgroundSave;
+	// 后台线程持有它直到请求交给传输层
+	std::shared_ptr<SaveJob> m_saveJob;
+	// 第一个Reader创建时才有，之前改变存档不需要发布
+	std::shared_ptr<ReadChannel> m_readChannel;
+	bool m_readSnapshotDirty;
+
+	// 性能统计，属于m_context
+	struct MetricsRecorder;
+	MetricsRecorder *m_metrics;
+};
+
+class RemoteSaveSession::Context
+{
+public:
+	// threads: 加密和解密大存档的线程池大小，0时为CPU核数。线程在第一次用到时才创建
+	explicit Context(unsigned int threads = 0);
+	~Context();
+
+	// 设置共享的传输层，第一个会话init()之前调用。没有设置时使用RemoteSaveTransport::createDefault()，
+	// 同时模拟大量用户时可以用多个连接的RemoteSaveKeepAliveTransport
+	void setTransport(const std::shared_ptr<RemoteSaveTransport> &transport) { m_transport = transport; }
+	const std::shared_ptr<RemoteSaveTransport> &getTransport();
+
+	// 固定数量线程的线程池
+	struct WorkerPool;
+
+private:
+	Context(const Context&);
+	Context &operator=(const Context&);
+	friend class RemoteSaveSession;
+
+	// 返回key和iv展开后的密钥，相同的密钥只展开一次，所有会话都不再使用时释放
+	std::shared_ptr<const AesContext> getAesContext(const std::string &key, const std::string &iv);
+
+	std::shared_ptr<RemoteSaveTransport> m_transport;
+	WorkerPool *m_workerPool;
+	MetricsRecorder *m_metrics;
+	// key和iv的前16字节 -> 展开的密钥
+	std::map<std::string, std::weak_ptr<const AesContext>> m_aesContexts;
+};
+
+// 在其他线程（AI、统计等）中读取存档，不用转到主线程。
+// 会话在有改变的那一帧结束后把存档发布成一份只读的快照，Reader读取最近发布的快照：
+// 确认有没有新快照只是读一个原子变量，读取不加锁，也不修改共享的引用计数，多个线程同时读取互不影响。
+// 写入仍然只在主线程。读到的是上一帧结束时的值，会话release()或销毁之后是空存档。
+// 在主线程中用会话创建，复制给每个读取的线程，同一个Reader不能同时在多个线程中使用
+//	RemoteSaveSession::Reader reader(*g_RemoteSave);
+//	std::thread([reader]() mutable { int gold = reader.getIntegerForKey("Gold"); }).detach();
+class RemoteSaveSession::Reader
+{
+public:
+	explicit Reader(RemoteSaveSession &session);
+
+	// 和会话的getter相同，但没有这个键或类型不对时只返回默认值，不写入，也不触发保存
+	bool getBoolForKey(const char *pKey, bool defaultValue = false);
+	int getIntegerForKey(const char *pKey, int defaultValue = 0);
+	float getFloatForKey(const char *pKey, float defaultValue = 0.f);
+	double getDoubleForKey(const char *pKey, double defaultValue = 0.);
+	std::string getStringForKey(const char *pKey, const std::string &defaultValue = RemoteSaveSession::NullString);
+	cocos2d::Data getDataForKey(const char *pKey, const cocos2d::Data &defaultValue = cocos2d::Data::Null);
+
+	// 换到最新发布的快照，有新快照时返回true
+	bool refresh();
+	// 默认每次读取前refresh()。关闭后一直读同一份快照，直到调用refresh()，几个值来自同一帧
+	void setAutoRefresh(bool enabled) { m_autoRefresh = enabled; }
+
+private:
+	const rapidjson::Value *findValue(const char *pKey);
+
+	std::shared_ptr<ReadChannel> m_channel;
+	std::shared_ptr<const ReadSnapshot> m_snapshot;
+	unsigned long long m_version;
+	bool m_autoRefresh;
+};
+
+// 兼容以前的单例用法，g_RemoteSave是使用自己的Context的一个会话
+class RemoteSave : public RemoteSaveSession
+{
+public:
+	static RemoteSave* getInstance();
+
+protected:
+	RemoteSave() {}
+
+	static RemoteSave *m_instance;
 };
 
 inline RemoteSave* RemoteSave::getInstance()
 {
+	// 不析构，退出时不再访问cocos2d和传输层
 	if (!m_instance)
 	{
-		static RemoteSave _inst;
-		m_instance = &_inst;
+		m_instance = new RemoteSave;
 	}
 	return m_instance;
 }
@@ -0,0 +1,294 @@
+﻿#include <cocos2d.h>
+#include <network/HttpClient.h>
+#include <algorithm>
+#include <new>
+#include "RemoteSaveTransport.h"
+
+#if REMOTESAVE_KEEPALIVE_HTTP
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <curl/curl.h>
+#endif
+
+
+std::shared_ptr<RemoteSaveTransport> RemoteSaveTransport::createDefault()
+{
+#if REMOTESAVE_KEEPALIVE_HTTP
+	return std::make_shared<RemoteSaveKeepAliveTransport>();
+#else
+	return std::make_shared<RemoteSaveHttpClientTransport>();
+#endif
+}
+
+void RemoteSaveHttpClientTransport::send(const std::shared_ptr<const Request> &request, const Callback &callback)
+{
+	if (std::this_thread::get_id() == m_cocosThread)
+	{
+		sendInCocosThread(request, callback);
+		return;
+	}
+
+	// HttpClient和HttpRequest的引用计数都不是线程安全的
+	cocos2d::Director::getInstance()->getScheduler()->performFunctionInCocosThread([request, callback]()
+	{
+		sendInCocosThread(request, callback);
+	});
+}
+
+void RemoteSaveHttpClientTransport::sendInCocosThread(const std::shared_ptr<const Request> &request, const Callback &callback)
+{
+	cocos2d::network::HttpRequest* httpRequest = new (std::nothrow) cocos2d::network::HttpRequest();
+	httpRequest->setUrl(request->url.c_str());
+	httpRequest->setRequestType(cocos2d::network::HttpRequest::Type::POST);
+	httpRequest->setHeaders(request->headers);
+	httpRequest->setRequestData(request->data.data(), request->data.size());
+	httpRequest->setTag(request->tag.c_str());
+	httpRequest->setResponseCallback([callback](cocos2d::network::HttpClient *, cocos2d::network::HttpResponse *httpResponse)
+	{
+		Response response;
+		if (httpResponse)
+		{
+			response.statusCode = httpResponse->getResponseCode();
+			response.succeeded = httpResponse->isSucceed();
+			response.data.swap(*httpResponse->getResponseData());
+			response.error = httpResponse->getErrorBuffer();
+		}
+		else
+		{
+			response.error = "no response";
+		}
+		callback(response);
+	});
+	cocos2d::network::HttpClient::getInstance()->sendImmediate(httpRequest);
+	httpRequest->release();
+}
+
+#if REMOTESAVE_KEEPALIVE_HTTP
+// Every thread performs requests from the shared queue on its own easy handle.
+// curl_easy_reset() between requests keeps the handle's connection cache, DNS cache and
+// TLS session IDs, so once warm a thread reuses its open HTTP/1.1 connection to the host.
+struct RemoteSaveKeepAliveTransport::Worker
+{
+	struct Task
+	{
+		std::shared_ptr<const Request> request;
+		Callback callback;
+	};
+
+	// The same limits cocos2d::network::HttpClient uses by default, in seconds
+	static const long ConnectTimeout = 30;
+	static const long Timeout = 60;
+
+	std::string sslCaFile;
+	bool verifyPeer;
+	cocos2d::Scheduler *scheduler;
+	std::mutex mutex;
+	std::condition_variable wakeUp;
+	std::deque<Task> tasks;
+	// Set by the destructor, aborts the transfers in progress from the progress callback
+	std::atomic<bool> stopping;
+	std::vector<std::thread> threads;
+
+	Worker(const std::string &sslCaFile, unsigned int connections, bool verifyPeer)
+		: sslCaFile(sslCaFile)
+		, verifyPeer(verifyPeer)
+		, scheduler(cocos2d::Director::getInstance()->getScheduler())
+		, stopping(false)
+	{
+		curl_global_init(CURL_GLOBAL_DEFAULT);
+		for (unsigned int i = 0; i < std::max(connections, 1u); ++i)
+		{
+			threads.push_back(std::thread(&Worker::Run, this));
+		}
+	}
+
+	~Worker()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wakeUp.notify_all();
+		for (auto &thread : threads)
+		{
+			thread.join();
+		}
+		curl_global_cleanup();
+	}
+
+	void Push(const std::shared_ptr<const Request> &request, const Callback &callback)
+	{
+		Task task = { request, callback };
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			tasks.push_back(std::move(task));
+		}
+		wakeUp.notify_one();
+	}
+
+	void Run()
+	{
+		CURL *curl = curl_easy_init();
+		for (;;)
+		{
+			Task task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wakeUp.wait(lock, [this] { return stopping || !tasks.empty(); });
+				if (stopping)
+				{
+					break;
+				}
+				task = std::move(tasks.front());
+				tasks.pop_front();
+			}
+
+			auto response = std::make_shared<Response>();
+			Perform(curl, *task.request, *response);
+			if (stopping)
+			{
+				break;
+			}
+
+			auto callback = std::move(task.callback);
+			scheduler->performFunctionInCocosThread([callback, response]()
+			{
+				callback(*response);
+			});
+		}
+
+		if (curl)
+		{
+			curl_easy_cleanup(curl);
+		}
+	}
+
+	void Perform(CURL *curl, const Request &request, Response &response)
+	{
+		if (!curl)
+		{
+			response.error = "curl_easy_init failed";
+			return;
+		}
+
+		curl_easy_reset(curl);
+		char errorBuffer[CURL_ERROR_SIZE] = { 0 };
+		curl_slist *headers = nullptr;
+		for (auto &header : request.headers)
+		{
+			headers = curl_slist_append(headers, header.c_str());
+		}
+		// Without this curl holds back POST bodies over 1KB until the server answers
+		// "100 Continue", one more round trip for every save
+		headers = curl_slist_append(headers, "Expect:");
+
+		curl_easy_setopt(curl, CURLOPT_URL, request.url.c_str());
+		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+		curl_easy_setopt(curl, CURLOPT_POST, 1L);
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request.data.data());
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)request.data.size());
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteData);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response.data);
+		curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorBuffer);
+		curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+		curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, ConnectTimeout);
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT, Timeout);
+		curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+		curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+		// Older curl releases leave Nagle on, which can stall the tail of a large POST
+		curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1L);
+		curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+#if LIBCURL_VERSION_NUM >= 0x072000
+		// PROGRESSFUNCTION is deprecated since 7.32.0
+		curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, XferInfo);
+		curl_easy_setopt(curl, CURLOPT_XFERINFODATA, this);
+#else
+		curl_easy_setopt(curl, CURLOPT_PROGRESSFUNCTION, Progress);
+		curl_easy_setopt(curl, CURLOPT_PROGRESSDATA, this);
+#endif
+		if (!verifyPeer)
+		{
+			// Explicit opt-out for test servers with self-signed certificates
+			curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+			curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+		}
+		else
+		{
+			curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
+			curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 2L);
+			if (!sslCaFile.empty())
+			{
+				curl_easy_setopt(curl, CURLOPT_CAINFO, sslCaFile.c_str());
+			}
+#if LIBCURL_VERSION_NUM >= 0x074700
+			else
+			{
+				// Without a CA file use the operating system's store (the Windows certificate
+				// store for OpenSSL builds). Older releases use the bundle libcurl was built with
+				curl_easy_setopt(curl, CURLOPT_SSL_OPTIONS, (long)CURLSSLOPT_NATIVE_CA);
+			}
+#endif
+		}
+
+		CURLcode code = curl_easy_perform(curl);
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response.statusCode);
+		curl_slist_free_all(headers);
+
+		// Like HttpClient only 200 counts as success
+		response.succeeded = code == CURLE_OK && response.statusCode == 200;
+		if (code != CURLE_OK)
+		{
+			response.error = errorBuffer[0] ? errorBuffer : curl_easy_strerror(code);
+		}
+	}
+
+	static size_t WriteData(char *data, size_t size, size_t count, void *userData)
+	{
+		auto &buffer = *(std::vector<char>*)userData;
+		buffer.insert(buffer.end(), data, data + size * count);
+		return size * count;
+	}
+
+	// Called about once a second even while the transfer is idle
+#if LIBCURL_VERSION_NUM >= 0x072000
+	static int XferInfo(void *userData, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+	{
+		return ((Worker*)userData)->stopping ? 1 : 0;
+	}
+#else
+	static int Progress(void *userData, double, double, double, double)
+	{
+		return ((Worker*)userData)->stopping ? 1 : 0;
+	}
+#endif
+};
+
+RemoteSaveKeepAliveTransport::RemoteSaveKeepAliveTransport(const std::string &sslCaFile /* = "" */, unsigned int connections /* = 1 */,
+														   bool verifyPeer /* = true */)
+	: m_worker(new Worker(sslCaFile, connections, verifyPeer))
+{
+}
+
+RemoteSaveKeepAliveTransport::~RemoteSaveKeepAliveTransport()
+{
+	delete m_worker;
+}
+
+void RemoteSaveKeepAliveTransport::send(const std::shared_ptr<const Request> &request, const Callback &callback)
+{
+	m_worker->Push(request, callback);
+}
+#endif // #if REMOTESAVE_KEEPALIVE_HTTP
+
+void RemoteSaveLoopbackTransport::send(const std::shared_ptr<const Request> &request, const Callback &callback)
+{
+	auto response = std::make_shared<Response>();
+	m_handler(*request, *response);
+	cocos2d::Director::getInstance()->getScheduler()->performFunctionInCocosThread([callback, response]()
+	{
+		callback(*response);
+	});
+}
@@ -0,0 +1,125 @@
+﻿#ifndef __RemoteSaveTransport_H
+#define __RemoteSaveTransport_H
+
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// 默认的传输层：1时用libcurl保持HTTP/1.1长连接，0时用cocos2d::network::HttpClient。
+// 只在Win32上默认为1，cocos2d在Win32上自带libcurl；其他平台默认用HttpClient，需要时定义为1
+#ifndef REMOTESAVE_KEEPALIVE_HTTP
+#if defined(_WIN32)
+#define REMOTESAVE_KEEPALIVE_HTTP 1
+#else
+#define REMOTESAVE_KEEPALIVE_HTTP 0
+#endif
+#endif
+
+
+// RemoteSave发送加载和保存请求的传输层
+class RemoteSaveTransport
+{
+public:
+	// 一个POST请求
+	struct Request
+	{
+		std::string url;
+		// 附加的HTTP头，每个是"Name: value"
+		std::vector<std::string> headers;
+		// application/x-www-form-urlencoded的POST数据
+		std::string data;
+		// 用于日志
+		std::string tag;
+	};
+
+	struct Response
+	{
+		Response() : statusCode(0), succeeded(false) {}
+
+		// HTTP状态码，没有收到回应时为0或负数
+		long statusCode;
+		// 收到了HTTP 200的回应
+		bool succeeded;
+		std::vector<char> data;
+		// 失败时的错误信息
+		std::string error;
+	};
+
+	// 在cocos2d的主线程中回调，response的内容可以被移走或原地修改
+	typedef std::function<void(Response &response)> Callback;
+
+	virtual ~RemoteSaveTransport() {}
+
+	// 异步发送request，完成后回调一次。不能在send()中同步回调。
+	// 回调之前传输层持有request，调用方不能再修改它；同一个request可以再次发送（重试）
+	// 可以在任意线程中调用，后台保存时由Context的线程池调用
+	virtual void send(const std::shared_ptr<const Request> &request, const Callback &callback) = 0;
+
+	// 按REMOTESAVE_KEEPALIVE_HTTP创建默认的传输层
+	static std::shared_ptr<RemoteSaveTransport> createDefault();
+};
+
+
+// cocos2d::network::HttpClient，大多数平台上每个请求重新建立连接。
+// 在cocos2d的主线程中创建，其他线程的请求转到主线程的下一帧再交给HttpClient
+class RemoteSaveHttpClientTransport : public RemoteSaveTransport
+{
+public:
+	RemoteSaveHttpClientTransport() : m_cocosThread(std::this_thread::get_id()) {}
+
+	virtual void send(const std::shared_ptr<const Request> &request, const Callback &callback) override;
+
+private:
+	static void sendInCocosThread(const std::shared_ptr<const Request> &request, const Callback &callback);
+
+	std::thread::id m_cocosThread;
+};
+
+
+#if REMOTESAVE_KEEPALIVE_HTTP
+// libcurl长连接：每个连接一个工作线程，按发送顺序取请求，各自复用自己curl句柄的连接缓存，
+// 加载和保存的主机各保持一个连接，之后的请求省去TCP和TLS握手。
+// connections: 同时发送的请求数，默认1个，所有请求按顺序发送；同一进程模拟大量用户时调大。
+// 超时同HttpClient：连接30秒，整个请求60秒。
+// 总是校验服务器证书和主机名：sslCaFile为空时用系统的CA证书，否则用sslCaFile中的证书。
+// verifyPeer为false时不校验，只用于使用自签名证书的测试服务器
+class RemoteSaveKeepAliveTransport : public RemoteSaveTransport
+{
+public:
+	explicit RemoteSaveKeepAliveTransport(const std::string &sslCaFile = "", unsigned int connections = 1, bool verifyPeer = true);
+	// 中止正在发送的请求（最多约1秒），丢弃还没回调的请求，之后不再回调
+	virtual ~RemoteSaveKeepAliveTransport();
+
+	virtual void send(const std::shared_ptr<const Request> &request, const Callback &callback) override;
+
+private:
+	RemoteSaveKeepAliveTransport(const RemoteSaveKeepAliveTransport&);
+	RemoteSaveKeepAliveTransport &operator=(const RemoteSaveKeepAliveTransport&);
+
+	struct Worker;
+	Worker *m_worker;
+};
+#endif // #if REMOTESAVE_KEEPALIVE_HTTP
+
+
+// 进程内回环，不经过网络，用于测试和性能测试。
+// send()时在调用的线程中直接调用handler生成回应，后台保存时handler必须线程安全。
+// 回调仍在下一帧由cocos2d的Scheduler发出，和网络请求的时序相同
+class RemoteSaveLoopbackTransport : public RemoteSaveTransport
+{
+public:
+	typedef std::function<void(const Request &request, Response &response)> Handler;
+
+	explicit RemoteSaveLoopbackTransport(const Handler &handler) : m_handler(handler) {}
+
+	virtual void send(const std::shared_ptr<const Request> &request, const Callback &callback) override;
+
+private:
+	Handler m_handler;
+};
+
+
+#endif // __RemoteSaveTransport_H
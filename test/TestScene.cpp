@@ -26,12 +26,19 @@ bool TestScene::init()
 
 	do
 	{
+		// 本地保存一份存档，启动时不用等服务器
+		g_RemoteSave->setJournalDirectory(cocos2d::FileUtils::getInstance()->getWritablePath());
+
 		if (!g_RemoteSave->init(uid, version, key, iv, urlLoad, urlSave))
 		{
 			cocos2d::log("init failed");
 			break;
 		}
 
+		// 值改变时自动保存，0.5秒内的连续改变合并成一次上传，最多延迟3秒
+		g_RemoteSave->setSaveOnChangeValue(true);
+		g_RemoteSave->setSaveCoalescing(0.5f, 3.f);
+
 		g_RemoteSave->setCallBackOnLoad([](RemoteSave::ErrorCode code, const std::string &msg)
 		{
 			cocos2d::log("callback OnLoad");
@@ -42,7 +49,6 @@ bool TestScene::init()
 				g_RemoteSave->setBoolForKey("Bool1", true);
 				g_RemoteSave->setIntegerForKey("Int2", 3333);
 				g_RemoteSave->setStringForKey("Str3", "123 456#789+0-=.我晕\"'dd\"");
-				g_RemoteSave->save();
 			}
 		});
 
@@ -53,6 +59,8 @@ bool TestScene::init()
 
 			if (code == RemoteSave::EC_OK)
 			{
+				// 各阶段的耗时和字节数
+				cocos2d::log("%s", g_RemoteSave->getMetricsReport().c_str());
 			}
 		});
 
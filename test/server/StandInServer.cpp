@@ -0,0 +1,223 @@
+﻿#include "StandInServer.h"
+#include <json/stringbuffer.h>
+#include <json/writer.h>
+#include <cstdlib>
+#include <cstring>
+
+// The server decrypts and re-encrypts with the client's own codec, so it
+// understands every payload format the client can send
+class StandInServer::Codec : public RemoteSaveSession
+{
+public:
+	using RemoteSaveSession::encode;
+	using RemoteSaveSession::decode;
+};
+
+StandInServer::StandInServer(const std::string &key, const std::string &iv)
+	: m_codec(new Codec)
+	, m_urlLoad("http://stand-in/load")
+	, m_sn(0)
+	, m_fullSaves(0)
+	, m_deltaSaves(0)
+	, m_rejectedDeltas(0)
+{
+	m_codec->init("stand-in-server", "1", key, iv, m_urlLoad, "http://stand-in/save");
+}
+
+StandInServer::~StandInServer()
+{
+}
+
+std::shared_ptr<RemoteSaveTransport> StandInServer::transport()
+{
+	return std::make_shared<RemoteSaveLoopbackTransport>(
+		[this](const RemoteSaveTransport::Request &request, RemoteSaveTransport::Response &response)
+	{
+		handle(request, response);
+	});
+}
+
+void StandInServer::bumpSn()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	++m_sn;
+}
+
+static int HexValue(char c)
+{
+	if (c >= '0' && c <= '9')
+	{
+		return c - '0';
+	}
+	if (c >= 'a' && c <= 'f')
+	{
+		return c - 'a' + 10;
+	}
+	if (c >= 'A' && c <= 'F')
+	{
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+bool StandInServer::FormValue(const std::string &data, const char *name, std::string &value)
+{
+	value.clear();
+	size_t nameLength = strlen(name);
+	size_t start = 0;
+	while (start <= data.size())
+	{
+		size_t end = data.find('&', start);
+		if (end == std::string::npos)
+		{
+			end = data.size();
+		}
+		if (end - start > nameLength && data.compare(start, nameLength, name) == 0 && data[start + nameLength] == '=')
+		{
+			for (size_t i = start + nameLength + 1; i < end; ++i)
+			{
+				if (data[i] == '+')
+				{
+					value += ' ';
+				}
+				else if (data[i] == '%' && i + 2 < end && HexValue(data[i + 1]) >= 0 && HexValue(data[i + 2]) >= 0)
+				{
+					value += (char)(HexValue(data[i + 1]) * 16 + HexValue(data[i + 2]));
+					i += 2;
+				}
+				else
+				{
+					value += data[i];
+				}
+			}
+			return true;
+		}
+		start = end + 1;
+	}
+	return false;
+}
+
+void StandInServer::handle(const RemoteSaveTransport::Request &request, RemoteSaveTransport::Response &response)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::string body;
+	if (request.url == m_urlLoad)
+	{
+		body = m_sn ? "{\"sn\":" + std::to_string(m_sn) + ",\"save_data\":\"" + m_saveData + "\"}" : "NULL";
+	}
+	else
+	{
+		m_lastSaveRequest = request.data;
+		body = handleSave(request.data);
+	}
+
+	response.statusCode = 200;
+	response.succeeded = true;
+	response.data.assign(body.begin(), body.end());
+}
+
+std::string StandInServer::handleSave(const std::string &data)
+{
+	std::string uid, sn, saveData, baseSn;
+	if (!FormValue(data, "user_id", uid) || !FormValue(data, "sn", sn) || !FormValue(data, "save_data", saveData))
+	{
+		return "missing field";
+	}
+
+	if (!FormValue(data, "base_sn", baseSn))
+	{
+		rapidjson::Document document;
+		if (!decodeSave(saveData, document) || !document.IsObject())
+		{
+			return "bad save_data";
+		}
+		// Swap() would leave m_document pointing into the other document's allocator
+		m_document.CopyFrom(document, m_document.GetAllocator());
+		m_saveData = saveData;
+		m_sn = strtoull(sn.c_str(), nullptr, 10);
+		++m_fullSaves;
+		return "Done";
+	}
+
+	if (strtoull(baseSn.c_str(), nullptr, 10) != m_sn || !m_document.IsObject())
+	{
+		++m_rejectedDeltas;
+		return "SN_MISMATCH";
+	}
+
+	rapidjson::Document delta;
+	if (!decodeSave(saveData, delta) || !mergeDelta(delta))
+	{
+		return "bad delta";
+	}
+
+	// Store the merged save the way a full save would have sent it
+	rapidjson::StringBuffer buffer;
+	rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+	m_document.Accept(writer);
+	m_codec->encode(buffer.GetString(), m_saveData, RemoteSaveSession::PF_GCM);
+	m_sn = strtoull(sn.c_str(), nullptr, 10);
+	++m_deltaSaves;
+	return "Done";
+}
+
+bool StandInServer::decodeSave(const std::string &saveData, rapidjson::Document &document) const
+{
+	std::string scratch, plain;
+	size_t offset = 0;
+	if (!m_codec->decode(saveData.data(), saveData.size(), scratch, plain, offset))
+	{
+		return false;
+	}
+	document.Parse(plain.c_str() + offset);
+	return !document.HasParseError();
+}
+
+bool StandInServer::mergeDelta(const rapidjson::Value &delta)
+{
+	if (!delta.IsObject())
+	{
+		return false;
+	}
+
+	auto &allocator = m_document.GetAllocator();
+	auto set = delta.FindMember("set");
+	if (set != delta.MemberEnd())
+	{
+		if (!set->value.IsObject())
+		{
+			return false;
+		}
+		for (auto it = set->value.MemberBegin(); it != set->value.MemberEnd(); ++it)
+		{
+			auto target = m_document.FindMember(it->name.GetString());
+			if (target != m_document.MemberEnd())
+			{
+				target->value.CopyFrom(it->value, allocator);
+			}
+			else
+			{
+				rapidjson::Value name(it->name.GetString(), it->name.GetStringLength(), allocator);
+				rapidjson::Value value(it->value, allocator);
+				m_document.AddMember(name, value, allocator);
+			}
+		}
+	}
+
+	auto remove = delta.FindMember("remove");
+	if (remove != delta.MemberEnd())
+	{
+		if (!remove->value.IsArray())
+		{
+			return false;
+		}
+		for (auto it = remove->value.Begin(); it != remove->value.End(); ++it)
+		{
+			if (it->IsString())
+			{
+				m_document.RemoveMember(it->GetString());
+			}
+		}
+	}
+	return true;
+}
@@ -0,0 +1,65 @@
+﻿#ifndef __StandInServer_H
+#define __StandInServer_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include "RemoteSave.h"
+
+// 测试用的存档服务器，在进程内实现客户端使用的协议，通过RemoteSaveLoopbackTransport连接，不经过网络：
+//	加载：POST user_id，没有存档时返回NULL，否则返回{"sn":N,"save_data":"..."}
+//	保存：POST user_id、sn、version、save_data，返回Done
+//	增量保存：另外带base_sn，save_data是{"set":{...},"remove":[...]}，
+//	服务器的sn等于base_sn时合并并返回Done，否则返回SN_MISMATCH
+// 服务器用和客户端相同的密钥解密，保存后的存档可以直接和客户端对比
+class StandInServer
+{
+public:
+	StandInServer(const std::string &key, const std::string &iv);
+	~StandInServer();
+
+	// 传给RemoteSaveSession::setTransport()
+	std::shared_ptr<RemoteSaveTransport> transport();
+
+	// 服务器上的存档，没有存档时为Null
+	const rapidjson::Document &document() const { return m_document; }
+	unsigned long long sn() const { return m_sn; }
+	// 模拟另一台设备保存了一次：sn加1，存档不变，之后基于旧sn的增量都被拒绝
+	void bumpSn();
+
+	// 收到的完整保存、合并的增量和拒绝的增量的次数
+	unsigned int fullSaves() const { return m_fullSaves; }
+	unsigned int deltaSaves() const { return m_deltaSaves; }
+	unsigned int rejectedDeltas() const { return m_rejectedDeltas; }
+	// 最近一次保存请求的POST数据
+	const std::string &lastSaveRequest() const { return m_lastSaveRequest; }
+
+	// 取出application/x-www-form-urlencoded数据中name的值并解码，没有这个字段时返回false
+	static bool FormValue(const std::string &data, const char *name, std::string &value);
+
+private:
+	StandInServer(const StandInServer&);
+	StandInServer &operator=(const StandInServer&);
+
+	class Codec;
+
+	void handle(const RemoteSaveTransport::Request &request, RemoteSaveTransport::Response &response);
+	// 返回回应的内容
+	std::string handleSave(const std::string &data);
+	bool decodeSave(const std::string &saveData, rapidjson::Document &document) const;
+	bool mergeDelta(const rapidjson::Value &delta);
+
+	std::unique_ptr<Codec> m_codec;
+	std::string m_urlLoad;
+	// 后台保存时在线程池中收到请求
+	std::mutex m_mutex;
+	rapidjson::Document m_document;
+	std::string m_saveData;
+	unsigned long long m_sn;
+	unsigned int m_fullSaves;
+	unsigned int m_deltaSaves;
+	unsigned int m_rejectedDeltas;
+	std::string m_lastSaveRequest;
+};
+
+#endif // __StandInServer_H
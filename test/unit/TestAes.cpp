@@ -0,0 +1,148 @@
+﻿#include <RemoteSave.h>
+#include <cocos2d.h>
+#include <cstdio>
+
+// AES的单元测试：实现本身的测试向量，以及经过encode()/decode()的完整路径
+static int s_failures = 0;
+
+#define CHECK(cond) \
+	do \
+	{ \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+			++s_failures; \
+		} \
+	} while (0)
+
+// NIST SP 800-38A F.2.1 CBC-AES128.Encrypt
+static const unsigned char NistKey[16] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+static const unsigned char NistIv[16] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+static const unsigned char NistPlain[64] = {
+	0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+	0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+	0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+	0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10 };
+static const unsigned char NistCipher[64] = {
+	0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46, 0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d,
+	0x50, 0x86, 0xcb, 0x9b, 0x50, 0x72, 0x19, 0xee, 0x95, 0xdb, 0x11, 0x3a, 0x91, 0x76, 0x78, 0xb2,
+	0x73, 0xbe, 0xd6, 0xb8, 0xe3, 0xc1, 0x74, 0x3b, 0x71, 0x16, 0xe6, 0x9e, 0x22, 0x22, 0x95, 0x16,
+	0x3f, 0xf1, 0xca, 0xa1, 0x68, 0x1f, 0xac, 0x09, 0x12, 0x0e, 0xca, 0x30, 0x75, 0x86, 0xe1, 0xa7 };
+
+class Session : public RemoteSaveSession
+{
+public:
+	bool initWithKey(const std::string &key, const std::string &iv)
+	{
+		return init("unit-test-user", "1", key, iv, "http://localhost/load", "http://localhost/save");
+	}
+
+	using RemoteSaveSession::selfTest;
+	using RemoteSaveSession::encode;
+	using RemoteSaveSession::decode;
+};
+
+static std::string Base64(const unsigned char *data, size_t size)
+{
+	char *encoded = nullptr;
+	int length = cocos2d::base64Encode(data, (unsigned int)size, &encoded);
+	std::string result(encoded, length);
+	free(encoded);
+	return result;
+}
+
+static void TestSelfTest()
+{
+	CHECK(Session::selfTest());
+}
+
+// encode()在密钥和向量之外没有别的状态，整块的明文应该得到NIST的密文
+static void TestCbcVector()
+{
+	Session session;
+	CHECK(session.initWithKey(std::string((const char*)NistKey, sizeof(NistKey)), std::string((const char*)NistIv, sizeof(NistIv))));
+
+	std::string plain((const char*)NistPlain, sizeof(NistPlain));
+	std::string encoded;
+	session.encode(plain, encoded, RemoteSaveSession::PF_CBC);
+	CHECK(encoded == Base64(NistCipher, sizeof(NistCipher)));
+
+	std::string scratch, out;
+	size_t offset = 0;
+	CHECK(session.decode(encoded.data(), encoded.size(), scratch, out, offset));
+	CHECK(out.compare(offset, std::string::npos, plain.c_str(), plain.size()) == 0);
+
+	// 不是整块的CBC数据已经损坏，不能解密
+	auto truncated = Base64(NistCipher, sizeof(NistCipher) - 1);
+	CHECK(!session.decode(truncated.data(), truncated.size(), scratch, out, offset));
+}
+
+// 不是整块的明文用0填充，解密后去掉结尾的0就是原文
+static void TestCbcPadding()
+{
+	Session session;
+	CHECK(session.initWithKey("1a2b3c4d5e6f7g8h", "#this_is_not_key"));
+
+	std::string plain = "{\"coins\":100,\"name\":\"player\"}";
+	std::string encoded;
+	session.encode(plain, encoded, RemoteSaveSession::PF_CBC);
+
+	std::string scratch, out;
+	size_t offset = 0;
+	CHECK(session.decode(encoded.data(), encoded.size(), scratch, out, offset));
+	CHECK((out.size() - offset) % 16 == 0);
+	CHECK(out.compare(offset, plain.size(), plain) == 0);
+	CHECK(out.find_first_not_of('\0', offset + plain.size()) == std::string::npos);
+}
+
+// GCM的随机数每次不同，检查往返和篡改
+static void TestGcmRoundTrip()
+{
+	Session session;
+	CHECK(session.initWithKey("1a2b3c4d5e6f7g8h", "#this_is_not_key"));
+
+	const RemoteSaveSession::PayloadFormat formats[] = { RemoteSaveSession::PF_GCM, RemoteSaveSession::PF_GCM_LZ4 };
+	for (auto format : formats)
+	{
+		std::string plain = "{\"coins\":100,\"name\":\"player\"}";
+		for (int i = 0; i < 1000; ++i)
+		{
+			plain += " ";
+		}
+
+		std::string encoded, again;
+		session.encode(plain, encoded, format);
+		session.encode(plain, again, format);
+		CHECK(encoded != again);
+
+		std::string scratch, out;
+		size_t offset = 0;
+		CHECK(session.decode(encoded.data(), encoded.size(), scratch, out, offset));
+		CHECK(out.compare(offset, std::string::npos, plain) == 0);
+
+		// 改动密文的一个字节后校验失败
+		unsigned char *data = nullptr;
+		int size = cocos2d::base64Decode((const unsigned char*)encoded.data(), (unsigned int)encoded.size(), &data);
+		data[size / 2] ^= 0x01;
+		auto tampered = Base64(data, size);
+		free(data);
+		CHECK(!session.decode(tampered.data(), tampered.size(), scratch, out, offset));
+	}
+}
+
+int main()
+{
+	cocos2d::standin::setLogEnabled(false);
+	TestSelfTest();
+	TestCbcVector();
+	TestCbcPadding();
+	TestGcmRoundTrip();
+
+	if (s_failures)
+	{
+		fprintf(stderr, "%d check(s) failed\n", s_failures);
+		return 1;
+	}
+	printf("all tests passed\n");
+	return 0;
+}
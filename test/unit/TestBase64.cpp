@@ -0,0 +1,103 @@
+﻿#include <RemoteSave.h>
+#include <cocos2d.h>
+#include <cstdio>
+
+// 内置base64的单元测试，以cocos2d::base64Encode/base64Decode的结果为准。
+// 长度覆盖SIMD分块的边界和结尾的补齐
+static int s_failures = 0;
+
+#define CHECK(cond) \
+	do \
+	{ \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+			++s_failures; \
+		} \
+	} while (0)
+
+class Session : public RemoteSaveSession
+{
+public:
+	using RemoteSaveSession::base64Encode;
+	using RemoteSaveSession::base64Decode;
+};
+
+static std::string CocosEncode(const std::string &bytes)
+{
+	char *out = nullptr;
+	int length = cocos2d::base64Encode((const unsigned char*)bytes.data(), (unsigned int)bytes.size(), &out);
+	std::string result(out, length);
+	free(out);
+	return result;
+}
+
+static std::string RandomBytes(size_t size, unsigned int seed)
+{
+	std::string bytes(size, '\0');
+	for (auto &c : bytes)
+	{
+		seed = seed * 1103515245 + 12345;
+		c = (char)(seed >> 16);
+	}
+	return bytes;
+}
+
+static void TestMatchesCocos()
+{
+	std::string encoded, decoded;
+	for (size_t size = 0; size <= 200; ++size)
+	{
+		auto bytes = RandomBytes(size, (unsigned int)size);
+		Session::base64Encode((const unsigned char*)bytes.data(), bytes.size(), encoded);
+		CHECK(encoded == CocosEncode(bytes));
+		CHECK(Session::base64Decode(encoded.data(), encoded.size(), decoded));
+		CHECK(decoded == bytes);
+	}
+
+	auto bytes = RandomBytes(1024 * 1024 + 1, 1);
+	Session::base64Encode((const unsigned char*)bytes.data(), bytes.size(), encoded);
+	CHECK(encoded == CocosEncode(bytes));
+	CHECK(Session::base64Decode(encoded.data(), encoded.size(), decoded));
+	CHECK(decoded == bytes);
+}
+
+// 和cocos2d一样跳过换行等字母表以外的字符
+static void TestSkipsOtherCharacters()
+{
+	auto bytes = RandomBytes(300, 7);
+	auto encoded = CocosEncode(bytes);
+	std::string wrapped;
+	for (size_t i = 0; i < encoded.size(); i += 76)
+	{
+		wrapped += encoded.substr(i, 76) + "\r\n";
+	}
+
+	std::string decoded;
+	CHECK(Session::base64Decode(wrapped.data(), wrapped.size(), decoded));
+	CHECK(decoded == bytes);
+}
+
+static void TestTruncated()
+{
+	std::string decoded;
+	CHECK(!Session::base64Decode("QUJDR", 5, decoded));
+	CHECK(Session::base64Decode("QUJDRA==", 8, decoded));
+	CHECK(decoded == "ABCD");
+}
+
+int main()
+{
+	cocos2d::standin::setLogEnabled(false);
+	TestMatchesCocos();
+	TestSkipsOtherCharacters();
+	TestTruncated();
+
+	if (s_failures)
+	{
+		fprintf(stderr, "%d check(s) failed\n", s_failures);
+		return 1;
+	}
+	printf("all tests passed\n");
+	return 0;
+}
@@ -0,0 +1,233 @@
+﻿#include <RemoteSave.h>
+#include <StandInServer.h>
+#include <cocos2d.h>
+#include <json/stringbuffer.h>
+#include <json/writer.h>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+// 增量保存和StandInServer的往返：加载后的完整保存、增量、服务器拒绝增量后改为完整保存、
+// 每fullSaveInterval次增量后的完整保存，每一步之后服务器上的存档都和客户端相同。
+// 另外检查release()之前发出的加载和被拒绝的增量的回应被丢弃
+static int s_failures = 0;
+
+#define CHECK(cond) \
+	do \
+	{ \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+			++s_failures; \
+		} \
+	} while (0)
+
+static const char *const Key = "1a2b3c4d5e6f7g8h";
+static const char *const Iv = "#this_is_not_key";
+
+static void RunFramesUntil(const std::function<bool()> &done)
+{
+	auto scheduler = cocos2d::Director::getInstance()->getScheduler();
+	auto start = std::chrono::steady_clock::now();
+	while (!done())
+	{
+		scheduler->update(1.f / 60.f);
+		std::this_thread::yield();
+		if (std::chrono::steady_clock::now() - start > std::chrono::seconds(10))
+		{
+			fprintf(stderr, "timed out waiting for a callback\n");
+			exit(1);
+		}
+	}
+}
+
+class Client : public RemoteSaveSession
+{
+public:
+	explicit Client(StandInServer &server)
+	{
+		setTransport(server.transport());
+		setRetryPolicy(1);
+		init("delta-user", "1", Key, Iv, "http://stand-in/load", "http://stand-in/save");
+	}
+
+	ErrorCode loadAndWait()
+	{
+		bool done = false;
+		ErrorCode result = EC_OK;
+		setCallBackOnLoad([&done, &result](ErrorCode code, const std::string&)
+		{
+			result = code;
+			done = true;
+		});
+		load();
+		RunFramesUntil([&done]() { return done; });
+		return result;
+	}
+
+	ErrorCode saveAndWait()
+	{
+		bool done = false;
+		ErrorCode result = EC_OK;
+		setCallBackOnSave([&done, &result](ErrorCode code, const std::string&)
+		{
+			result = code;
+			done = true;
+		});
+		save();
+		RunFramesUntil([&done]() { return done; });
+		return result;
+	}
+
+	const rapidjson::Value &document() const { return m_jsonDoc; }
+};
+
+static std::string ToJson(const rapidjson::Value &value)
+{
+	rapidjson::StringBuffer buffer;
+	rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+	value.Accept(writer);
+	return buffer.GetString();
+}
+
+// 成员顺序可以不同
+static bool SameSave(const rapidjson::Value &client, const rapidjson::Value &server)
+{
+	if (!client.IsObject() || !server.IsObject() || client.MemberCount() != server.MemberCount())
+	{
+		return false;
+	}
+	for (auto it = client.MemberBegin(); it != client.MemberEnd(); ++it)
+	{
+		auto other = server.FindMember(it->name.GetString());
+		if (other == server.MemberEnd() || ToJson(it->value) != ToJson(other->value))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static void TestDeltaRoundTrip()
+{
+	StandInServer server(Key, Iv);
+	Client client(server);
+	client.setSaveMode(RemoteSaveSession::SM_DELTA, 3);
+	CHECK(client.loadAndWait() == RemoteSaveSession::EC_OK);
+
+	// 加载后的第一次保存是完整的
+	for (int i = 0; i < 200; ++i)
+	{
+		client.setIntegerForKey(("level." + std::to_string(i)).c_str(), i);
+	}
+	client.setStringForKey("name", "player");
+	client.setStringForKey("title", "novice");
+	CHECK(client.saveAndWait() == RemoteSaveSession::EC_OK);
+	CHECK(server.fullSaves() == 1);
+	CHECK(server.deltaSaves() == 0);
+	CHECK(SameSave(client.document(), server.document()));
+	auto fullSize = server.lastSaveRequest().size();
+
+	// 之后只上传改变和删除的键
+	client.setIntegerForKey("level.7", 70);
+	client.setIntegerForKey("coins", 5);
+	client.deleteValueForKey("title");
+	CHECK(client.saveAndWait() == RemoteSaveSession::EC_OK);
+	CHECK(server.fullSaves() == 1);
+	CHECK(server.deltaSaves() == 1);
+	CHECK(server.lastSaveRequest().find("base_sn=") != std::string::npos);
+	CHECK(server.lastSaveRequest().size() < fullSize / 4);
+	CHECK(SameSave(client.document(), server.document()));
+
+	// 另一台设备保存后服务器拒绝增量，客户端改为上传完整存档，只回调一次
+	server.bumpSn();
+	client.setIntegerForKey("coins", 6);
+	CHECK(client.saveAndWait() == RemoteSaveSession::EC_OK);
+	CHECK(server.rejectedDeltas() == 1);
+	CHECK(server.fullSaves() == 2);
+	CHECK(server.lastSaveRequest().find("base_sn=") == std::string::npos);
+	CHECK(SameSave(client.document(), server.document()));
+
+	// 恢复后继续增量，fullSaveInterval次增量之后上传一次完整存档
+	for (int i = 0; i < 3; ++i)
+	{
+		client.setIntegerForKey("coins", 10 + i);
+		CHECK(client.saveAndWait() == RemoteSaveSession::EC_OK);
+		CHECK(SameSave(client.document(), server.document()));
+	}
+	CHECK(server.deltaSaves() == 4);
+	CHECK(server.fullSaves() == 2);
+	client.setIntegerForKey("coins", 20);
+	CHECK(client.saveAndWait() == RemoteSaveSession::EC_OK);
+	CHECK(server.fullSaves() == 3);
+	CHECK(SameSave(client.document(), server.document()));
+
+	// 合并后的存档可以由另一个客户端加载
+	Client other(server);
+	CHECK(other.loadAndWait() == RemoteSaveSession::EC_OK);
+	CHECK(SameSave(client.document(), other.document()));
+	CHECK(other.getIntegerForKey("coins") == 20);
+	CHECK(other.getIntegerForKey("level.7") == 70);
+	CHECK(other.getStringForKey("title", "none") == "none");
+}
+
+// release()后再init()，之前发出的加载的回应不能写入新的存档
+static void TestReleaseDropsLoad()
+{
+	StandInServer server(Key, Iv);
+	Client client(server);
+	CHECK(client.loadAndWait() == RemoteSaveSession::EC_OK);
+	client.setIntegerForKey("coins", 5);
+	CHECK(client.saveAndWait() == RemoteSaveSession::EC_OK);
+
+	bool called = false;
+	client.setCallBackOnLoad([&called](RemoteSaveSession::ErrorCode, const std::string&) { called = true; });
+	client.load();
+	client.release();
+	client.init("another-user", "1", Key, Iv, "http://stand-in/load", "http://stand-in/save");
+	cocos2d::Director::getInstance()->getScheduler()->update(1.f / 60.f);
+	CHECK(!called);
+	CHECK(client.getIntegerForKey("coins") == 0);
+}
+
+// 服务器拒绝增量的回应在release()之后到达时不再重发完整存档。
+// background时在线程池中加密和发送，release()等它结束后释放密钥
+static void TestReleaseAfterRejectedDelta(bool background)
+{
+	StandInServer server(Key, Iv);
+	Client client(server);
+	client.setSaveMode(RemoteSaveSession::SM_DELTA, 3);
+	client.setBackgroundSave(background);
+	CHECK(client.loadAndWait() == RemoteSaveSession::EC_OK);
+	client.setIntegerForKey("coins", 5);
+	CHECK(client.saveAndWait() == RemoteSaveSession::EC_OK);
+	CHECK(server.fullSaves() == 1);
+
+	server.bumpSn();
+	client.setIntegerForKey("coins", 6);
+	bool called = false;
+	client.setCallBackOnSave([&called](RemoteSaveSession::ErrorCode, const std::string&) { called = true; });
+	client.save();
+	client.release();
+	cocos2d::Director::getInstance()->getScheduler()->update(1.f / 60.f);
+	CHECK(server.rejectedDeltas() == 1);
+	CHECK(server.fullSaves() == 1);
+	CHECK(!called);
+}
+
+int main()
+{
+	cocos2d::standin::setLogEnabled(false);
+	TestDeltaRoundTrip();
+	TestReleaseDropsLoad();
+	TestReleaseAfterRejectedDelta(false);
+	TestReleaseAfterRejectedDelta(true);
+
+	if (s_failures)
+	{
+		fprintf(stderr, "%d check(s) failed\n", s_failures);
+		return 1;
+	}
+	printf("all tests passed\n");
+	return 0;
+}